@@ -1,6 +1,7 @@
 #pragma once
 
 #include "rtweekend.h"
+#include "stats.h"
 
 class AABB {
   public:
@@ -8,12 +9,13 @@ class AABB {
     AABB(const Vec3& a, const Vec3& b) : a{a}, b{b} {}
 
     // Doesn't inherent from 'Hittable'
-    bool hit(const Ray& r, double tmin, double tmax) const {
+    bool hit(const Ray& r, Real tmin, Real tmax) const {
+        STAT_INC(boxTests);
         for (int dim = 0; dim < 3; ++dim) {
-            auto invD = 1.0 / r.d[dim];
+            auto invD = 1 / r.d[dim];
             auto t0 = (a[dim] - r.o[dim]) * invD;
             auto t1 = (b[dim] - r.o[dim]) * invD;
-            if (invD < 0.0) std::swap(t0, t1);
+            if (invD < 0) std::swap(t0, t1);
             tmin = std::max(tmin, t0);
             tmax = std::min(tmax, t1);
             if (tmax <= tmin) return false;
@@ -21,6 +23,27 @@ class AABB {
         return true;
     }
 
+    // Slab test with the inverse direction and sign precomputed once per ray.
+    bool hit(const Ray& r, const PreparedRay& pr, Real tmin, Real tmax) const {
+        STAT_INC(boxTests);
+        for (int dim = 0; dim < 3; ++dim) {
+            const auto& near = pr.dirIsNeg[dim] ? b : a;
+            const auto& far = pr.dirIsNeg[dim] ? a : b;
+            auto t0 = (near[dim] - r.o[dim]) * pr.invD[dim];
+            auto t1 = (far[dim] - r.o[dim]) * pr.invD[dim];
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+        }
+        return tmin < tmax;
+    }
+
+    Vec3 centroid() const { return 0.5 * (a + b); }
+
+    Real surfaceArea() const {
+        auto d = b - a;
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
     Vec3 a;
     Vec3 b;
 };
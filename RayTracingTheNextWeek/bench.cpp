@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <sys/resource.h>
+#endif
+
+#include "rtweekend.h"
+#include "scenes.h"
+#include "bvh.h"
+#include "render.h"
+#include "denoise.h"
+#include "stats.h"
+#include "image_io.h"
+
+// Fixed resolution and sample count of one benchmarked scene, small enough that the whole suite
+// runs in about ten seconds on one core.
+struct BenchCase {
+    std::string scene;
+    int imageWidth;
+    int samplesPerPixel;
+};
+
+const std::vector<BenchCase> benchCases = {
+    {"random", 320, 16},        {"two_spheres", 320, 16},    {"two_perlin_spheres", 320, 16},
+    {"earth", 320, 16},         {"simple_light", 320, 32},   {"cornell_box", 200, 32},
+    {"cornell_smoke", 200, 32}, {"final", 200, 32},          {"cornell_teapot", 200, 16},
+    {"two_perlin_spheres_baked", 320, 16},
+};
+
+// Peak resident set size of the process so far, 0 where it is not available.
+uint64_t peakMemoryBytes() {
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    #ifdef __APPLE__
+    return static_cast<uint64_t>(usage.ru_maxrss);
+    #else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+    #endif
+#else
+    return 0;
+#endif
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double meanLuminance(const Framebuffer& image) {
+    double sum = 0;
+    for (size_t i = 0; i < image.pixelCount(); ++i) {
+        auto c = image.get(i);
+        sum += 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    }
+    return sum / image.pixelCount();
+}
+
+double maxDifference(const Framebuffer& a, const Framebuffer& b) {
+    double diff = 0;
+    for (size_t i = 0; i < a.pixelCount(); ++i) {
+        auto d = a.get(i) - b.get(i);
+        for (int c = 0; c < 3; ++c) {
+            diff = std::max(diff, static_cast<double>(std::abs(d[c])));
+        }
+    }
+    return diff;
+}
+
+// Renders one case and writes its results as a JSON object. With 'heatmap', also writes the
+// traversal cost per pixel to heatmap_<scene>.png. With 'denoised', renders feature buffers as
+// well and times denoising the image; meanLuminance stays that of the noisy image. With
+// 'checked', renders the image again with other tile and wavefront sizes, which must not change
+// it, and returns whether it stayed the same.
+bool runCase(const BenchCase& bench, int threadCount, uint64_t seed, bool heatmap,
+             bool denoised, bool checked, std::ostream& os) {
+    using Clock = std::chrono::steady_clock;
+
+    auto start = Clock::now();
+    auto config = makeScene(sceneId(bench.scene), seed);
+    auto sceneSeconds = secondsSince(start);
+
+    start = Clock::now();
+    auto world = makeBvh(config.world, config.t0, config.t1);
+    auto bvhSeconds = secondsSince(start);
+
+    RenderSettings settings;
+    settings.imageWidth = bench.imageWidth;
+    settings.imageHeight = static_cast<int>(bench.imageWidth / config.aspectRatio);
+    settings.samplesPerPixel = bench.samplesPerPixel;
+    settings.maxDepth = 32;
+    settings.backgroundColor = config.backgroundColor;
+    settings.seed = seed;
+    settings.threadCount = threadCount;
+    settings.integrator = IntegratorType::Wavefront;
+
+    auto cam = config.camera();
+    auto tileLoads = textureCache.tileLoads();
+    resetRayStats();
+    start = Clock::now();
+    std::vector<float> cost;
+    FeatureBuffers features;
+    auto image = Renderer(*world, cam, settings)
+                     .render(nullptr, &cost, denoised ? &features : nullptr);
+    auto renderSeconds = secondsSince(start);
+    auto stats = collectRayStats();
+
+    // The sample counts of benchCases do not divide 1000, so wavefronts end mid-pixel.
+    double difference = 0;
+    if (checked) {
+        for (auto [tileSize, wavefrontSize] : {std::pair{8, 1024}, std::pair{16, 1000}}) {
+            auto other = settings;
+            other.tileSize = tileSize;
+            other.wavefrontSize = wavefrontSize;
+            difference = std::max(difference,
+                                  maxDifference(image, Renderer(*world, cam, other).render()));
+        }
+    }
+
+    double denoiseSeconds = 0;
+    if (denoised) {
+        DenoiseSettings denoiseSettings;
+        denoiseSettings.threadCount = threadCount;
+        start = Clock::now();
+        denoise(image, features, denoiseSettings);
+        denoiseSeconds = secondsSince(start);
+    }
+
+    if (heatmap) {
+        writeImage("heatmap_" + bench.scene + ".png",
+                   heatmapImage(cost, settings.imageWidth, settings.imageHeight), false);
+    }
+
+    auto rays = static_cast<double>(std::max<uint64_t>(stats.rays, 1));
+    os << "    {\"scene\": \"" << bench.scene << "\", \"width\": " << settings.imageWidth
+       << ", \"height\": " << settings.imageHeight << ", \"spp\": " << settings.samplesPerPixel
+       << ",\n     \"sceneSeconds\": " << sceneSeconds << ", \"bvhBuildSeconds\": " << bvhSeconds
+       << ", \"renderSeconds\": " << renderSeconds;
+    if (denoised) os << ", \"denoiseSeconds\": " << denoiseSeconds;
+    os << ",\n     \"rays\": " << stats.rays
+       << ", \"mraysPerSecond\": " << stats.rays / renderSeconds * 1e-6
+       << ", \"hits\": " << stats.hits
+       << ",\n     \"nodeVisitsPerRay\": " << stats.nodeVisits / rays
+       << ", \"boxTestsPerRay\": " << stats.boxTests / rays
+       << ", \"primitiveTestsPerRay\": " << stats.primitiveTests / rays
+       << ", \"primitiveHitsPerRay\": " << stats.primitiveHits / rays
+       << ",\n     \"scatters\": " << stats.scatters << ", \"paths\": {\"escaped\": "
+       << stats.pathsEscaped << ", \"absorbed\": " << stats.pathsAbsorbed
+       << ", \"maxDepth\": " << stats.pathsMaxDepth << ", \"roulette\": " << stats.pathsRoulette
+       << "},\n     \"pathDepth\": [";
+    for (int i = 0; i < RayStats::depthBins; ++i) {
+        os << (i > 0 ? ", " : "") << stats.pathDepth[i];
+    }
+    os << "],\n     \"peakMemoryBytes\": " << peakMemoryBytes()
+       << ", \"textureTileLoads\": " << textureCache.tileLoads() - tileLoads
+       << ", \"meanLuminance\": " << meanLuminance(image);
+
+    if (checked) os << ", \"determinismMaxDifference\": " << difference;
+    os << "}";
+    return difference == 0;
+}
+
+// Usage: rt2_bench [--threads n] [--seed s] [--heatmaps] [--texture-budget MiB]
+//                  [--bvh-cache dir] [--denoise] [--check-determinism] [scene ...].
+// Renders the named scenes, or all of them, with the settings of benchCases and prints the
+// results as JSON on stdout. A texture budget pages image textures through textureCache; a BVH
+// cache directory loads BVHs built by earlier runs; --denoise adds feature buffers and a
+// denoising step to every case. --check-determinism renders every case twice more with other
+// tile and wavefront sizes and fails if any image differs. Run it from this directory so the
+// scenes find their textures and models.
+int main(int argc, char* argv[]) {
+    int threadCount = 0;
+    uint64_t seed = 0;
+    bool heatmaps = false;
+    bool denoised = false;
+    bool checked = false;
+    std::vector<BenchCase> cases;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threadCount = std::atoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--heatmaps") {
+            heatmaps = true;
+        } else if (arg == "--denoise") {
+            denoised = true;
+        } else if (arg == "--check-determinism") {
+            checked = true;
+        } else if (arg == "--texture-budget" && i + 1 < argc) {
+            textureCache.setBudget(static_cast<size_t>(std::atof(argv[++i]) * (1 << 20)));
+        } else if (arg == "--bvh-cache" && i + 1 < argc) {
+            bvhCache.setDirectory(argv[++i]);
+        } else {
+            auto it = std::find_if(benchCases.begin(), benchCases.end(),
+                                   [&](const BenchCase& c) { return c.scene == arg; });
+            if (it == benchCases.end()) {
+                std::cerr << "ERROR: unknown scene: " << arg << '\n';
+                return 1;
+            }
+            cases.push_back(*it);
+        }
+    }
+    if (cases.empty()) cases = benchCases;
+
+    auto threads = threadCount > 0
+                       ? threadCount
+                       : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    auto precision = std::is_same_v<Real, float> ? "float" : "double";
+    std::cout << std::setprecision(6) << "{\n  \"precision\": \"" << precision
+              << "\", \"threads\": " << threads << ", \"seed\": " << seed
+              << ",\n  \"results\": [\n";
+    bool deterministic = true;
+    for (size_t i = 0; i < cases.size(); ++i) {
+        deterministic &= runCase(cases[i], threadCount, seed, heatmaps, denoised, checked,
+                                 std::cout);
+        std::cout << (i + 1 < cases.size() ? ",\n" : "\n") << std::flush;
+    }
+    std::cout << "  ]\n}\n";
+    if (!deterministic) {
+        std::cerr << "ERROR: the image depends on the tile or wavefront size\n";
+        return 1;
+    }
+}
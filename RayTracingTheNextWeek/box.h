@@ -2,13 +2,36 @@
 #include "hittable.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "instance.h"
 
+#include <algorithm>
 #include <memory>
+#include <utility>
+
+// Whether a face of the box [lo, hi] lies on 'r' within [tmin, tmax]: the slab test, failing
+// when the segment is wholly inside or outside the box.
+inline bool occludesBox(const Vec3& lo, const Vec3& hi, const Ray& r, Real tmin, Real tmax) {
+    STAT_INC(primitiveTests);
+    Real tEnter = -infinity;
+    Real tExit = infinity;
+    for (int a = 0; a < 3; ++a) {
+        auto invD = 1 / r.d[a];
+        auto t0 = (lo[a] - r.o[a]) * invD;
+        auto t1 = (hi[a] - r.o[a]) * invD;
+        if (invD < 0) std::swap(t0, t1);
+        tEnter = std::max(tEnter, t0);
+        tExit = std::min(tExit, t1);
+    }
+    if (tEnter > tExit || tEnter > tmax || tExit < tmin) return false;
+    if (tEnter < tmin && tExit > tmax) return false;
+    STAT_INC(primitiveHits);
+    return true;
+}
 
 class Box : public Hittable {
   public:
     Box(const Vec3& min, const Vec3& max, const std::shared_ptr<Material>& ptr)
-        : min{min}, max{max} {
+        : min{min}, max{max}, materialId{materialTable.add(ptr)} {
         sides.add(std::make_shared<XYRect>(min.x(), max.x(), min.y(), max.y(), max.z(), ptr));
         sides.add(std::make_shared<XYRect>(min.x(), max.x(), min.y(), max.y(), min.z(), ptr));
 
@@ -19,18 +42,44 @@ class Box : public Hittable {
         sides.add(std::make_shared<YZRect>(min.y(), max.y(), min.z(), max.z(), min.x(), ptr));
     }
 
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override {
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
         return sides.hit(r, tmin, tmax, rec);
     }
 
-    bool boundingBox(double time0, double time1, AABB& outBox) const override {
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override {
+        return occludesBox(min, max, r, tmin, tmax);
+    }
+
+    bool boundingBox(Real time0, Real time1, AABB& outBox) const override {
         outBox = AABB(min, max);
         return true;
     }
 
+    // Slab test against the six planes.
+    bool interval(const Ray& r, Real& tEnter, Real& tExit) const override {
+        tEnter = -infinity;
+        tExit = infinity;
+        for (int a = 0; a < 3; ++a) {
+            auto invD = 1 / r.d[a];
+            auto t0 = (min[a] - r.o[a]) * invD;
+            auto t1 = (max[a] - r.o[a]) * invD;
+            if (invD < 0) std::swap(t0, t1);
+            tEnter = std::max(tEnter, t0);
+            tExit = std::min(tExit, t1);
+        }
+        return tEnter < tExit;
+    }
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        sides.collectEmitters(emitters);
+    }
+
   private:
+    friend class PrimitiveStore;
+
     Vec3 min;
     Vec3 max;
+    uint32_t materialId;
     HittableList sides;
 };
 
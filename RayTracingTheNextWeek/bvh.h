@@ -3,6 +3,9 @@
 #include "hittable.h"
 #include "hittable_list.h"
 #include "aabb.h"
+#include "flat_bvh.h"
+#include "wide_bvh.h"
+#include "stats.h"
 
 #include <algorithm>
 #include <memory>
@@ -21,37 +24,57 @@ class BvhNode : public Hittable {
   public:
     BvhNode() = default;
 
-    BvhNode(const HittableList& list, double t0, double t1)
-        : BvhNode(list.objects, 0, list.objects.size(), t0, t1) {}
-    BvhNode(const std::vector<std::shared_ptr<Hittable>>& srcObjects, size_t start, size_t end,
-            double t0, double t1);
+    BvhNode(const HittableList& list, Real t0, Real t1) {
+        auto objects = list.objects;
+        build(objects, 0, objects.size(), t0, t1);
+    }
+
+    // Reorders 'objects' in [start, end) in place.
+    BvhNode(std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end, Real t0,
+            Real t1) {
+        build(objects, start, end, t0, t1);
+    }
 
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override;
-    bool boundingBox(double t0, double t1, AABB& outBox) const override;
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override;
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override;
+    bool boundingBox(Real t0, Real t1, AABB& outBox) const override;
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        left->collectEmitters(emitters);
+        if (right != left) right->collectEmitters(emitters);
+    }
 
   private:
+    void build(std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end, Real t0,
+               Real t1);
+
     std::shared_ptr<Hittable> left;
     std::shared_ptr<Hittable> right;
     AABB box;
 };
 
 // HitRecord rec is not used.
-inline bool BvhNode::hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const {
+inline bool BvhNode::hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const {
+    STAT_INC(nodeVisits);
     if (!box.hit(r, tmin, tmax)) return false;
     bool hitLeft = left->hit(r, tmin, tmax, rec);
     bool hitRight = right->hit(r, tmin, hitLeft ? rec.t : tmax, rec);
     return hitLeft || hitRight;
 }
 
-inline bool BvhNode::boundingBox(double t0, double t1, AABB& outBox) const {
+inline bool BvhNode::occluded(const Ray& r, Real tmin, Real tmax) const {
+    STAT_INC(nodeVisits);
+    if (!box.hit(r, tmin, tmax)) return false;
+    return left->occluded(r, tmin, tmax) || (right != left && right->occluded(r, tmin, tmax));
+}
+
+inline bool BvhNode::boundingBox(Real t0, Real t1, AABB& outBox) const {
     outBox = box;
     return true;
 }
 
-BvhNode::BvhNode(const std::vector<std::shared_ptr<Hittable>>& srcObjects, size_t start, size_t end,
-                 double t0, double t1) {
-    auto objects = srcObjects;
-
+inline void BvhNode::build(std::vector<std::shared_ptr<Hittable>>& objects, size_t start,
+                           size_t end, Real t0, Real t1) {
     auto axis = gen.randomInt(0, 2);
     const auto& objectSpan = end - start;
     if (objectSpan == 1) {
@@ -65,11 +88,12 @@ BvhNode::BvhNode(const std::vector<std::shared_ptr<Hittable>>& srcObjects, size_
             right = objects[start];
         }
     } else {
-        std::sort(objects.begin() + start, objects.begin() + end,
-                  [axis](const std::shared_ptr<Hittable>& a, const std::shared_ptr<Hittable>& b) {
-                      return compareBoxes(a, b, axis);
-                  });
         auto mid = start + objectSpan / 2;
+        std::nth_element(
+            objects.begin() + start, objects.begin() + mid, objects.begin() + end,
+            [axis](const std::shared_ptr<Hittable>& a, const std::shared_ptr<Hittable>& b) {
+                return compareBoxes(a, b, axis);
+            });
         left = std::make_shared<BvhNode>(objects, start, mid, t0, t1);
         right = std::make_shared<BvhNode>(objects, mid, end, t0, t1);
     }
@@ -81,4 +105,25 @@ BvhNode::BvhNode(const std::vector<std::shared_ptr<Hittable>>& srcObjects, size_
     }
 
     box = surroundingBox(boxL, boxR);
-}
\ No newline at end of file
+}
+
+enum class BvhLayout {
+    Tree,  // BvhNode: pointer-linked nodes
+    Flat,  // FlatBvh: contiguous depth-first node array
+    Wide,  // Bvh4: four children per node, SIMD box tests
+};
+
+inline BvhLayout defaultBvhLayout = BvhLayout::Wide;
+
+inline std::shared_ptr<Hittable> makeBvh(const HittableList& list, Real t0, Real t1,
+                                         BvhLayout layout = defaultBvhLayout) {
+    switch (layout) {
+        case BvhLayout::Tree:
+            return std::make_shared<BvhNode>(list, t0, t1);
+        case BvhLayout::Flat:
+            return std::make_shared<FlatBvh>(list, t0, t1);
+        case BvhLayout::Wide:
+        default:
+            return std::make_shared<Bvh4>(list, t0, t1);
+    }
+}
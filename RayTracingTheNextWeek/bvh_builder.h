@@ -0,0 +1,315 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "aabb.h"
+#include "stats.h"
+
+inline float roundDown(double x) {
+    auto f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float roundUp(double x) {
+    auto f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Two nodes share a 64-byte cache line. Interior nodes store their first child right after
+// themselves (depth-first order), so only the second child needs an explicit index.
+struct alignas(32) LinearBvhNode {
+    float boundsMin[3];
+    union {
+        uint32_t primitiveOffset;  // leaf
+        uint32_t secondChild;      // interior
+    };
+    float boundsMax[3];
+    uint16_t primitiveCount;  // 0 for interior nodes
+    uint8_t axis;             // split axis of interior nodes
+    uint8_t pad;
+
+    void setBounds(const AABB& box) {
+        for (int i = 0; i < 3; ++i) {
+            boundsMin[i] = roundDown(box.a[i]);
+            boundsMax[i] = roundUp(box.b[i]);
+        }
+    }
+
+    AABB bounds() const {
+        return {Vec3(boundsMin[0], boundsMin[1], boundsMin[2]),
+                Vec3(boundsMax[0], boundsMax[1], boundsMax[2])};
+    }
+
+    bool hit(const Vec3& o, const Vec3& invD, const int dirIsNeg[3], Real tmin,
+             Real tmax) const {
+        STAT_INC(boxTests);
+        for (int dim = 0; dim < 3; ++dim) {
+            auto t0 = ((dirIsNeg[dim] ? boundsMax : boundsMin)[dim] - o[dim]) * invD[dim];
+            auto t1 = ((dirIsNeg[dim] ? boundsMin : boundsMax)[dim] - o[dim]) * invD[dim];
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+            if (tmax <= tmin) return false;
+        }
+        return true;
+    }
+};
+
+static_assert(sizeof(LinearBvhNode) == 32);
+
+struct BvhBuildPrimitive {
+    AABB box;
+    Vec3 centroid;
+    uint32_t index;
+};
+
+struct BvhBuildStats {
+    double buildMilliseconds = 0.0;
+    // Expected cost of a random ray through the tree under the SAH cost model, in units of one
+    // primitive intersection.
+    double sahCost = 0.0;
+    size_t primitiveCount = 0;
+    size_t nodeCount = 0;
+    size_t leafCount = 0;
+    int maxDepth = 0;
+    bool fromCache = false;  // loaded from bvhCache; buildMilliseconds is then the load time
+};
+
+inline std::ostream& operator<<(std::ostream& os, const BvhBuildStats& s) {
+    os << s.primitiveCount << " primitives, " << s.nodeCount << " nodes (" << s.leafCount
+       << " leaves, depth " << s.maxDepth << "), " << (s.fromCache ? "loaded" : "built")
+       << " in " << s.buildMilliseconds << " ms, SAH cost " << s.sahCost;
+    return os;
+}
+
+// Top-down binned SAH builder. Primitives are partitioned in place, so every leaf covers a
+// contiguous range of the primitive array; subtrees over large ranges are built in parallel.
+class SahBvhBuilder {
+  public:
+    static const int binCount = 16;
+    static const int maxDepth = 64;  // traversal stacks are sized for this
+    static const size_t maxLeafPrimitives = UINT16_MAX;  // LinearBvhNode::primitiveCount
+    static const size_t parallelThreshold = 4096;
+    static constexpr double traversalCost = 0.125;
+    static constexpr double intersectionCost = 1.0;
+
+  public:
+    explicit SahBvhBuilder(int maxPrimitivesInLeaf) : maxPrimitivesInLeaf{maxPrimitivesInLeaf} {}
+
+    // Fills 'nodes' in depth-first order and reorders 'prims' so that leaf ranges index into it.
+    BvhBuildStats build(std::vector<BvhBuildPrimitive>& prims,
+                        std::vector<LinearBvhNode>& nodes) const;
+
+  private:
+    struct BuildNode {
+        AABB bounds;
+        uint32_t start;
+        uint32_t count;
+        int axis;
+        std::unique_ptr<BuildNode> children[2];
+    };
+
+    std::unique_ptr<BuildNode> buildRecursive(std::vector<BvhBuildPrimitive>& prims, size_t start,
+                                              size_t end, int depth) const;
+
+    void flatten(const BuildNode& node, std::vector<LinearBvhNode>& nodes, BvhBuildStats& stats,
+                 double rootArea, int depth) const;
+
+    // Most primitives a subtree at 'depth' can take: leaves at the depth limit hold up to
+    // maxLeafPrimitives and every level above can halve its range.
+    static size_t capacity(int depth) {
+        auto levels = maxDepth - 1 - depth;
+        return levels >= 40 ? SIZE_MAX : maxLeafPrimitives << levels;
+    }
+
+    // Bin of a centroid coordinate, clamped to [0, binCount - 1]; NaN lands in bin 0.
+    static int binOf(Real c, Real minCentroid, Real scale) {
+        auto x = (c - minCentroid) * scale;
+        if (!(x > 0)) return 0;
+        if (x >= binCount - 1) return binCount - 1;
+        return static_cast<int>(x);
+    }
+
+    int maxPrimitivesInLeaf;
+};
+
+inline BvhBuildStats SahBvhBuilder::build(std::vector<BvhBuildPrimitive>& prims,
+                                          std::vector<LinearBvhNode>& nodes) const {
+    auto startTime = std::chrono::steady_clock::now();
+
+    BvhBuildStats stats;
+    stats.primitiveCount = prims.size();
+    nodes.clear();
+    if (prims.empty()) return stats;
+
+    // Primitives without bounds come in with an infinite box, whose centroid is NaN or
+    // infinite. Bin them at the origin so that the centroid bounds stay finite.
+    for (auto& p : prims) {
+        for (int dim = 0; dim < 3; ++dim) {
+            if (!std::isfinite(p.centroid[dim])) p.centroid[dim] = 0;
+        }
+    }
+
+    auto root = buildRecursive(prims, 0, prims.size(), 0);
+    nodes.reserve(2 * prims.size());
+    flatten(*root, nodes, stats, root->bounds.surfaceArea(), 0);
+
+    stats.buildMilliseconds =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime)
+            .count();
+    return stats;
+}
+
+inline std::unique_ptr<SahBvhBuilder::BuildNode> SahBvhBuilder::buildRecursive(
+    std::vector<BvhBuildPrimitive>& prims, size_t start, size_t end, int depth) const {
+    auto node = std::make_unique<BuildNode>();
+    node->start = static_cast<uint32_t>(start);
+    node->count = static_cast<uint32_t>(end - start);
+    node->axis = 0;
+
+    AABB bounds = prims[start].box;
+    AABB centroidBounds(prims[start].centroid, prims[start].centroid);
+    for (auto i = start + 1; i < end; ++i) {
+        bounds = surroundingBox(bounds, prims[i].box);
+        centroidBounds = surroundingBox(centroidBounds, AABB(prims[i].centroid, prims[i].centroid));
+    }
+    node->bounds = bounds;
+
+    auto count = end - start;
+    if (count == 1 || depth + 1 >= maxDepth) return node;
+
+    // Evaluate the SAH at every bin boundary of every axis.
+    auto extent = centroidBounds.b - centroidBounds.a;
+    auto bestCost = infinity;
+    int bestAxis = -1;
+    int bestSplit = 0;
+
+    for (int axis = 0; axis < 3; ++axis) {
+        if (extent[axis] <= 0.0) continue;
+
+        struct Bin {
+            AABB box;
+            size_t count = 0;
+        } bins[binCount];
+
+        auto scale = binCount / extent[axis];
+        for (auto i = start; i < end; ++i) {
+            auto& bin = bins[binOf(prims[i].centroid[axis], centroidBounds.a[axis], scale)];
+            bin.box = bin.count == 0 ? prims[i].box : surroundingBox(bin.box, prims[i].box);
+            ++bin.count;
+        }
+
+        // Sweep from the right to get suffix areas, then from the left to evaluate splits.
+        double rightArea[binCount];
+        size_t rightCount[binCount];
+        AABB acc;
+        size_t accCount = 0;
+        for (int b = binCount - 1; b > 0; --b) {
+            if (bins[b].count > 0) {
+                acc = accCount == 0 ? bins[b].box : surroundingBox(acc, bins[b].box);
+                accCount += bins[b].count;
+            }
+            rightArea[b] = accCount > 0 ? acc.surfaceArea() : 0.0;
+            rightCount[b] = accCount;
+        }
+
+        accCount = 0;
+        for (int b = 0; b < binCount - 1; ++b) {
+            if (bins[b].count > 0) {
+                acc = accCount == 0 ? bins[b].box : surroundingBox(acc, bins[b].box);
+                accCount += bins[b].count;
+            }
+            if (accCount == 0 || rightCount[b + 1] == 0) continue;
+
+            auto cost = accCount * acc.surfaceArea() + rightCount[b + 1] * rightArea[b + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b;
+            }
+        }
+    }
+
+    auto fitsInLeaf = count <= static_cast<size_t>(maxPrimitivesInLeaf);
+    size_t mid = start + count / 2;
+
+    if (bestAxis < 0) {
+        // All centroids coincide; no split separates them, so cut the range in half.
+        if (fitsInLeaf) return node;
+    } else {
+        auto area = bounds.surfaceArea();
+        auto splitCost = traversalCost + intersectionCost * bestCost / area;
+        auto leafCost = intersectionCost * count;
+        if (fitsInLeaf && leafCost <= splitCost) return node;
+
+        auto scale = binCount / extent[bestAxis];
+        auto minCentroid = centroidBounds.a[bestAxis];
+        auto midIt = std::partition(
+            prims.begin() + start, prims.begin() + end, [&](const BvhBuildPrimitive& p) {
+                return binOf(p.centroid[bestAxis], minCentroid, scale) <= bestSplit;
+            });
+        mid = static_cast<size_t>(midIt - prims.begin());
+        node->axis = bestAxis;
+    }
+
+    // A lopsided split near the depth limit could leave a leaf too large for a node. Halving
+    // the range instead keeps every subtree within its capacity.
+    if (std::max(mid - start, end - mid) > capacity(depth + 1)) {
+        int axis = 0;
+        for (int dim = 1; dim < 3; ++dim) {
+            if (extent[dim] > extent[axis]) axis = dim;
+        }
+        mid = start + count / 2;
+        std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+                         [axis](const BvhBuildPrimitive& a, const BvhBuildPrimitive& b) {
+                             return a.centroid[axis] < b.centroid[axis];
+                         });
+        node->axis = axis;
+    }
+
+    if (count >= parallelThreshold) {
+        auto left = std::async(std::launch::async, [&] {
+            return buildRecursive(prims, start, mid, depth + 1);
+        });
+        node->children[1] = buildRecursive(prims, mid, end, depth + 1);
+        node->children[0] = left.get();
+    } else {
+        node->children[0] = buildRecursive(prims, start, mid, depth + 1);
+        node->children[1] = buildRecursive(prims, mid, end, depth + 1);
+    }
+    return node;
+}
+
+inline void SahBvhBuilder::flatten(const BuildNode& node, std::vector<LinearBvhNode>& nodes,
+                                   BvhBuildStats& stats, double rootArea, int depth) const {
+    auto index = nodes.size();
+    nodes.emplace_back();
+    nodes[index].setBounds(node.bounds);
+
+    ++stats.nodeCount;
+    stats.maxDepth = std::max(stats.maxDepth, depth);
+    // An unbounded primitive makes the root area infinite; every node then counts fully.
+    auto areaRatio = rootArea > 0.0 && std::isfinite(rootArea)
+                         ? node.bounds.surfaceArea() / rootArea
+                         : 1.0;
+
+    if (!node.children[0]) {
+        ++stats.leafCount;
+        stats.sahCost += intersectionCost * node.count * areaRatio;
+        nodes[index].primitiveOffset = node.start;
+        nodes[index].primitiveCount = static_cast<uint16_t>(node.count);
+        return;
+    }
+
+    stats.sahCost += traversalCost * areaRatio;
+    flatten(*node.children[0], nodes, stats, rootArea, depth + 1);
+    nodes[index].secondChild = static_cast<uint32_t>(nodes.size());
+    nodes[index].primitiveCount = 0;
+    nodes[index].axis = static_cast<uint8_t>(node.axis);
+    flatten(*node.children[1], nodes, stats, rootArea, depth + 1);
+}
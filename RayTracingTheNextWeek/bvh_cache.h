@@ -0,0 +1,210 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rtweekend.h"
+#include "bvh_builder.h"
+#include "mapped_file.h"
+
+// Built BVHs on disk, so a scene whose geometry did not change skips the build: the frames of an
+// animation where only the camera moves, or render-farm nodes sharing a cache directory. A build
+// depends only on its primitives' boxes, in order, and the leaf size, so a hash of those names
+// the file; the file holds the node array and the primitive order the builder produced.
+class BvhCache {
+  public:
+    static constexpr uint32_t version = 1;
+
+    // Cache files go to 'path', created if needed; empty, the default, disables the cache.
+    void setDirectory(const std::string& path) {
+        std::lock_guard lock(mutex);
+        directory = path;
+        if (!directory.empty()) {
+            std::error_code error;
+            std::filesystem::create_directories(directory, error);
+        }
+    }
+
+    bool enabled() const {
+        std::lock_guard lock(mutex);
+        return !directory.empty();
+    }
+
+    // Content hash of a build input. Zero when the input cannot be cached: the builder's output
+    // order is only meaningful when every primitive's index is its position.
+    static uint64_t key(const std::vector<BvhBuildPrimitive>& prims, int maxPrimitivesInLeaf) {
+        static_assert(sizeof(AABB) == 6 * sizeof(Real), "boxes are hashed as their bytes");
+        uint64_t h = mixSeed(version, sizeof(Real));
+        h = mixSeed(h ^ static_cast<uint64_t>(maxPrimitivesInLeaf), prims.size());
+        uint64_t words[(sizeof(AABB) + 7) / 8];
+        for (size_t i = 0; i < prims.size(); ++i) {
+            if (prims[i].index != i) return 0;
+            words[sizeof(words) / 8 - 1] = 0;
+            std::memcpy(words, &prims[i].box, sizeof(AABB));
+            for (auto w : words) {
+                h = mixSeed(h ^ w, i);
+            }
+        }
+        return h == 0 ? 1 : h;
+    }
+
+    // On a hit, fills 'nodes', reorders 'prims' as the build would have and returns true.
+    bool load(uint64_t key, std::vector<BvhBuildPrimitive>& prims,
+              std::vector<LinearBvhNode>& nodes, BvhBuildStats& stats) const {
+        auto startTime = std::chrono::steady_clock::now();
+        MappedFile file;
+        if (!file.open(path(key))) return false;
+        if (file.size() < sizeof(Header)) return false;
+        const auto& header = *reinterpret_cast<const Header*>(file.data());
+        if (std::memcmp(header.magic, "RT2B", 4) != 0 || header.version != version ||
+            header.key != key || header.primitiveCount != prims.size() ||
+            file.size() < nodesOffset(prims.size()) ||
+            header.nodeCount > (file.size() - nodesOffset(prims.size())) / sizeof(LinearBvhNode) ||
+            (header.nodeCount == 0) != prims.empty()) {
+            return false;
+        }
+
+        const auto* order = reinterpret_cast<const uint32_t*>(file.data() + sizeof(Header));
+        std::vector<BvhBuildPrimitive> sorted(prims.size());
+        std::vector<bool> seen(prims.size(), false);
+        for (size_t i = 0; i < prims.size(); ++i) {
+            if (order[i] >= prims.size() || seen[order[i]]) return false;
+            seen[order[i]] = true;
+            sorted[i] = prims[order[i]];
+        }
+        nodes.resize(header.nodeCount);
+        std::memcpy(nodes.data(), file.data() + nodesOffset(prims.size()),
+                    nodes.size() * sizeof(LinearBvhNode));
+        if (!validNodes(nodes, prims.size())) {
+            nodes.clear();
+            return false;
+        }
+        prims = std::move(sorted);
+
+        stats.primitiveCount = prims.size();
+        stats.nodeCount = nodes.size();
+        stats.leafCount = header.leafCount;
+        stats.maxDepth = header.maxDepth;
+        stats.sahCost = header.sahCost;
+        stats.fromCache = true;
+        stats.buildMilliseconds =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime)
+                .count();
+        return true;
+    }
+
+    // Writes the result of a build. The file appears under its final name only once complete,
+    // so concurrent readers never map a partial file.
+    void store(uint64_t key, const std::vector<BvhBuildPrimitive>& prims,
+               const std::vector<LinearBvhNode>& nodes, const BvhBuildStats& stats) const {
+        Header header{};
+        std::memcpy(header.magic, "RT2B", 4);
+        header.version = version;
+        header.maxDepth = stats.maxDepth;
+        header.key = key;
+        header.primitiveCount = prims.size();
+        header.nodeCount = nodes.size();
+        header.leafCount = stats.leafCount;
+        header.sahCost = stats.sahCost;
+
+        auto nodeBytes = nodes.size() * sizeof(LinearBvhNode);
+        std::vector<uint8_t> bytes(nodesOffset(prims.size()) + nodeBytes);
+        std::memcpy(bytes.data(), &header, sizeof(header));
+        auto* order = reinterpret_cast<uint32_t*>(bytes.data() + sizeof(Header));
+        for (size_t i = 0; i < prims.size(); ++i) {
+            order[i] = prims[i].index;
+        }
+        std::memcpy(bytes.data() + nodesOffset(prims.size()), nodes.data(), nodeBytes);
+
+        auto finalPath = path(key);
+        auto writer = std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+                      std::chrono::steady_clock::now().time_since_epoch().count();
+        auto tempPath = finalPath + "." + std::to_string(mixSeed(key, writer));
+        auto file = std::fopen(tempPath.c_str(), "wb");
+        if (!file) return;
+        bool ok = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+        ok = std::fclose(file) == 0 && ok;
+        std::error_code error;
+        if (ok) std::filesystem::rename(tempPath, finalPath, error);
+        if (!ok || error) std::filesystem::remove(tempPath, error);
+    }
+
+  private:
+    struct Header {
+        char magic[4];  // "RT2B"
+        uint32_t version;
+        int32_t maxDepth;
+        uint32_t reserved;
+        uint64_t key;
+        uint64_t primitiveCount;
+        uint64_t nodeCount;
+        uint64_t leafCount;
+        double sahCost;
+    };
+
+    // Whether traversal of 'nodes' stays in bounds: children come after their parent in
+    // depth-first order, leaves cover ranges of the primitives, split axes are axes, and no node
+    // is deeper than the traversal stacks allow.
+    static bool validNodes(const std::vector<LinearBvhNode>& nodes, size_t primitiveCount) {
+        if (nodes.empty()) return true;
+        std::vector<int> depth(nodes.size(), -1);
+        depth[0] = 0;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (depth[i] < 0) continue;  // unreachable
+            const auto& node = nodes[i];
+            if (node.primitiveCount > 0) {
+                if (node.primitiveOffset > primitiveCount ||
+                    node.primitiveCount > primitiveCount - node.primitiveOffset) {
+                    return false;
+                }
+                continue;
+            }
+            if (node.axis > 2 || i + 1 >= node.secondChild || node.secondChild >= nodes.size() ||
+                depth[i] + 1 >= SahBvhBuilder::maxDepth) {
+                return false;
+            }
+            for (auto child : {i + 1, static_cast<size_t>(node.secondChild)}) {
+                depth[child] = std::max(depth[child], depth[i] + 1);
+            }
+        }
+        return true;
+    }
+
+    // The primitive order follows the header; the nodes start on the next 32-byte boundary.
+    static size_t nodesOffset(size_t primitiveCount) {
+        return (sizeof(Header) + primitiveCount * sizeof(uint32_t) + 31) / 32 * 32;
+    }
+
+    std::string path(uint64_t key) const {
+        std::lock_guard lock(mutex);
+        char name[24];
+        std::snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(key));
+        return (std::filesystem::path(directory) / name).string();
+    }
+
+    mutable std::mutex mutex;  // guards directory
+    std::string directory;
+};
+
+inline BvhCache bvhCache;
+
+// SahBvhBuilder::build() through bvhCache: loads the result when the cache has it, and stores it
+// after building otherwise.
+inline BvhBuildStats buildBvh(int maxPrimitivesInLeaf, std::vector<BvhBuildPrimitive>& prims,
+                              std::vector<LinearBvhNode>& nodes) {
+    auto key = bvhCache.enabled() ? BvhCache::key(prims, maxPrimitivesInLeaf) : 0;
+    BvhBuildStats stats;
+    if (key != 0 && bvhCache.load(key, prims, nodes, stats)) return stats;
+
+    stats = SahBvhBuilder(maxPrimitivesInLeaf).build(prims, nodes);
+    if (key != 0 && !nodes.empty()) bvhCache.store(key, prims, nodes, stats);
+    return stats;
+}
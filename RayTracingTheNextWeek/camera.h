@@ -1,18 +1,59 @@
 #pragma once
 
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
 #include "vec.h"
 #include "ray.h"
 #include "rtweekend.h"
 
+enum class Projection : uint32_t {
+    Perspective,      // pinhole or thin lens; vfov spans the image height
+    Orthographic,     // parallel rays; the view is as large as the perspective one at the focus
+    Fisheye,          // equidistant; vfov spans the image height, angle grows with radius
+    Equirectangular,  // the whole sphere: longitude across, latitude down; ignores vfov
+};
+
+// Film (s, t), lens (lensU, lensV) and shutter (timeU) coordinates of one camera ray, in [0, 1).
+// s runs left to right and t bottom to top.
+struct CameraSample {
+    Real s, t;
+    Real lensU, lensV;
+    Real timeU;
+};
+
+// Camera rays as structure of arrays, e.g. all primary rays of a tile. Each ray also has its
+// differentials: how origin and direction change one pixel to the right and one pixel up.
+struct CameraRays {
+    std::vector<Real> ox, oy, oz;
+    std::vector<Real> dx, dy, dz;
+    std::vector<Real> time;
+    std::vector<RayDifferential> differentials;
+
+    size_t size() const { return time.size(); }
+
+    void resize(size_t n) {
+        for (auto* v : {&ox, &oy, &oz, &dx, &dy, &dz, &time}) v->resize(n);
+        differentials.resize(n);
+    }
+
+    Ray ray(size_t i) const { return {{ox[i], oy[i], oz[i]}, {dx[i], dy[i], dz[i]}, time[i]}; }
+
+    RayCone cone(size_t i) const { return differentials[i].cone({dx[i], dy[i], dz[i]}); }
+};
+
 class Camera {
   public:
-    Camera(const Vec3& lookFrom, const Vec3& lookAt, const Vec3& vup, double vfov,
-           double aspectRatio, double aperture, double focusDistance, double timeStart,
-           double timeEnd) {
-        auto theta = toRadian(vfov);
-        auto viewportHeight = 2.0 * std::tan(theta / 2);
+    Camera(const Vec3& lookFrom, const Vec3& lookAt, const Vec3& vup, Real vfov,
+           Real aspectRatio, Real aperture, Real focusDistance, Real timeStart, Real timeEnd,
+           Projection projection = Projection::Perspective)
+        : projection{projection},
+          aspectRatio{aspectRatio},
+          halfFov{toRadian(vfov) / 2},
+          focusDistance{focusDistance} {
+        viewportHeight = 2 * std::tan(halfFov);
         auto viewportWidth = aspectRatio * viewportHeight;
-        [[maybe_unused]] auto focalLength = 1.0;
 
         w = normalized(lookFrom - lookAt);
         u = normalized(cross(vup, w));
@@ -28,20 +69,153 @@ class Camera {
         this->timeEnd = timeEnd;
     }
 
-    [[nodiscard]] Ray getRay(double s, double t) const {
-        Vec3 rd = lensRadius * gen.randomInUnitDisk();
-        Vec3 offset = u * rd.x() + v * rd.y();
-        return {origin + offset, lowerLeft + s * horizontal + t * vertical - origin - offset,
-                gen.randomDouble(timeStart, timeEnd)};
+    [[nodiscard]] Ray getRay(Real s, Real t) const {
+        auto lensU = hasLens() ? gen.randomDouble() : 0.5;
+        auto lensV = hasLens() ? gen.randomDouble() : 0.5;
+        auto timeU = hasShutter() ? gen.randomDouble() : 0.0;
+        return getRay(s, t, lensU, lensV, timeU);
+    }
+
+    Projection getProjection() const { return projection; }
+
+    // Ray for explicit lens (lensU, lensV) and shutter (timeU) samples in [0, 1).
+    [[nodiscard]] Ray getRay(Real s, Real t, Real lensU, Real lensV, Real timeU) const {
+        Vec3 o, d;
+        switch (projection) {
+            case Projection::Perspective: pinholeRay<Projection::Perspective>(s, t, o, d); break;
+            case Projection::Orthographic: pinholeRay<Projection::Orthographic>(s, t, o, d); break;
+            case Projection::Fisheye: pinholeRay<Projection::Fisheye>(s, t, o, d); break;
+            default: pinholeRay<Projection::Equirectangular>(s, t, o, d); break;
+        }
+        if (hasLens()) {
+            Vec3 rd = lensRadius * squareToUniformDisk(lensU, lensV);
+            Vec3 offset = u * rd.x() + v * rd.y();
+            o += offset;
+            d = d - offset;
+        }
+        return {o, d, hasShutter() ? lerp(timeStart, timeEnd, timeU) : timeStart};
+    }
+
+    // Rays for 'count' samples of an imageWidth x imageHeight image, into 'out'. The projection
+    // is chosen once for the batch, and lens and shutter are only sampled when they have an
+    // extent, so a pinhole camera spends no sines, square roots or branches per ray.
+    void generateRays(const CameraSample* samples, size_t count, int imageWidth, int imageHeight,
+                      CameraRays& out) const {
+        out.resize(count);
+        switch (projection) {
+            case Projection::Perspective:
+                generate<Projection::Perspective>(samples, count, imageWidth, imageHeight, out);
+                break;
+            case Projection::Orthographic:
+                generate<Projection::Orthographic>(samples, count, imageWidth, imageHeight, out);
+                break;
+            case Projection::Fisheye:
+                generate<Projection::Fisheye>(samples, count, imageWidth, imageHeight, out);
+                break;
+            default:
+                generate<Projection::Equirectangular>(samples, count, imageWidth, imageHeight,
+                                                      out);
+                break;
+        }
+
+        if (hasLens()) {
+            for (size_t i = 0; i < count; ++i) {
+                Vec3 rd = lensRadius * squareToUniformDisk(samples[i].lensU, samples[i].lensV);
+                Vec3 offset = u * rd.x() + v * rd.y();
+                out.ox[i] += offset.x();
+                out.oy[i] += offset.y();
+                out.oz[i] += offset.z();
+                out.dx[i] -= offset.x();
+                out.dy[i] -= offset.y();
+                out.dz[i] -= offset.z();
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            out.time[i] = hasShutter() ? lerp(timeStart, timeEnd, samples[i].timeU) : timeStart;
+        }
     }
 
   private:
+    bool hasLens() const { return lensRadius > 0; }
+    bool hasShutter() const { return timeEnd != timeStart; }
+
+    // Ray through film point (s, t) from the center of the lens. o + d lies on the surface in
+    // focus: the focus plane, or for the wide-angle projections the focus sphere.
+    template <Projection P>
+    void pinholeRay(Real s, Real t, Vec3& o, Vec3& d) const {
+        if constexpr (P == Projection::Perspective) {
+            o = origin;
+            d = lowerLeft + s * horizontal + t * vertical - origin;
+        } else if constexpr (P == Projection::Orthographic) {
+            o = origin + (s - 0.5) * horizontal + (t - 0.5) * vertical;
+            d = -focusDistance * w;
+        } else if constexpr (P == Projection::Fisheye) {
+            auto x = (2 * s - 1) * aspectRatio;
+            auto y = 2 * t - 1;
+            auto r = std::sqrt(x * x + y * y);
+            auto theta = r * halfFov;
+            auto k = r > 0 ? std::sin(theta) / r : halfFov;
+            o = origin;
+            d = focusDistance * (k * (x * u + y * v) - std::cos(theta) * w);
+        } else {
+            auto phi = (2 * s - 1) * pi;
+            auto lat = (t - 0.5) * pi;
+            auto c = std::cos(lat);
+            o = origin;
+            d = focusDistance * (c * (std::sin(phi) * u - std::cos(phi) * w) + std::sin(lat) * v);
+        }
+    }
+
+    template <Projection P>
+    void generate(const CameraSample* samples, size_t count, int imageWidth, int imageHeight,
+                  CameraRays& out) const {
+        auto ds = Real(1) / imageWidth;
+        auto dt = Real(1) / imageHeight;
+        // Both linear projections have the same differentials everywhere.
+        RayDifferential linear;
+        if constexpr (P == Projection::Perspective) {
+            linear.dDdx = ds * horizontal;
+            linear.dDdy = dt * vertical;
+        } else if constexpr (P == Projection::Orthographic) {
+            linear.dOdx = ds * horizontal;
+            linear.dOdy = dt * vertical;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            auto s = samples[i].s;
+            auto t = samples[i].t;
+            Vec3 o, d;
+            pinholeRay<P>(s, t, o, d);
+            out.ox[i] = o.x();
+            out.oy[i] = o.y();
+            out.oz[i] = o.z();
+            out.dx[i] = d.x();
+            out.dy[i] = d.y();
+            out.dz[i] = d.z();
+
+            if constexpr (P == Projection::Perspective || P == Projection::Orthographic) {
+                out.differentials[i] = linear;
+            } else {
+                // Forward differences; the origin does not move.
+                Vec3 ox, dx, oy, dy;
+                pinholeRay<P>(s + ds, t, ox, dx);
+                pinholeRay<P>(s, t + dt, oy, dy);
+                out.differentials[i] = {Vec3(), Vec3(), dx - d, dy - d};
+            }
+        }
+    }
+
+    Projection projection;
     Vec3 origin;
     Vec3 lowerLeft;
     Vec3 horizontal;
     Vec3 vertical;
     Vec3 u, v, w;
-    double lensRadius;
-    double timeStart;
-    double timeEnd;
-};
\ No newline at end of file
+    Real aspectRatio;
+    Real halfFov;
+    Real focusDistance;
+    Real viewportHeight;  // at unit distance
+    Real lensRadius;
+    Real timeStart;
+    Real timeEnd;
+};
@@ -5,19 +5,18 @@
 #include "vec.h"
 #include "rtweekend.h"
 
+// Display encoding of one linear channel: optional gamma 2, then quantized to [0, 255].
+inline int toByte(double c, bool gammaCorrection) {
+    if (gammaCorrection) c = std::sqrt(c);
+    return static_cast<int>(256 * clamp(c, 0.0, 0.999));
+}
+
 inline void writeColor(std::ostream& os, const Vec3& color, int samplesPerPixel,
                        bool gammaCorrection) {
     auto r = color.x() / samplesPerPixel;
     auto g = color.y() / samplesPerPixel;
     auto b = color.z() / samplesPerPixel;
 
-    if (gammaCorrection) {
-        r = std::sqrt(r);
-        g = std::sqrt(g);
-        b = std::sqrt(b);
-    }
-
-    os << static_cast<int>(256 * clamp(r, 0.0, 0.999)) << ' '
-       << static_cast<int>(256 * clamp(g, 0.0, 0.999)) << ' '
-       << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
-}
\ No newline at end of file
+    os << toByte(r, gammaCorrection) << ' ' << toByte(g, gammaCorrection) << ' '
+       << toByte(b, gammaCorrection) << '\n';
+}
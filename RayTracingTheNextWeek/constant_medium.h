@@ -1,5 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <functional>
+#include <memory>
+
 #include "rtweekend.h"
 #include "hittable.h"
 #include "material.h"
@@ -7,50 +11,130 @@
 #include "hittable_list.h"
 #include "box.h"
 
-class ConstantMedium : public Hittable {
+// A participating medium filling a closed boundary, scattering with an isotropic phase
+// function. hit() returns a sampled scattering point. The boundary span along a ray is solved
+// once, and rays that miss the boundary's box over the shutter [time0, time1] skip the boundary
+// entirely; rays from outside the shutter are not culled. Overlapping and nested
+// media need no bookkeeping: each samples its own free-flight distance and the closest hit
+// wins, which is exact because the densities of overlapping media add.
+class Medium : public Hittable {
   public:
-    ConstantMedium(const std::shared_ptr<Hittable>& b, double d, const std::shared_ptr<Texture>& a)
-        : boundary{b}, phaseFunction{std::make_shared<Isotropic>(a)}, negInvDensity{-1 / d} {}
+    Medium(const std::shared_ptr<Hittable>& boundary, const std::shared_ptr<Material>& phase,
+           Real time0, Real time1)
+        : boundary{boundary},
+          phaseFunctionId{materialTable.add(phase)},
+          time0{time0},
+          time1{time1} {
+        hasBox = boundary->boundingBox(time0, time1, box);
+    }
 
-    ConstantMedium(const std::shared_ptr<Hittable>& b, double d, const Vec3& color)
-        : boundary{b}, phaseFunction{std::make_shared<Isotropic>(color)}, negInvDensity{-1 / d} {}
+    bool boundingBox(Real time0, Real time1, AABB& outBox) const override {
+        return boundary->boundingBox(time0, time1, outBox);
+    }
 
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override {
-        HitRecord rec1;
-        if (!boundary->hit(r, -infinity, infinity, rec1)) return false;
+    bool motionBounds(Real time0, Real time1, AABB& box0, AABB& box1) const override {
+        return boundary->motionBounds(time0, time1, box0, box1);
+    }
 
-        HitRecord rec2;
-        if (!boundary->hit(r, rec1.t + 0.0001, infinity, rec2)) return false;
+  protected:
+    // The part [t0, t1] of [tmin, tmax] that lies inside the boundary.
+    bool span(const Ray& r, Real tmin, Real tmax, Real& t0, Real& t1) const {
+        STAT_INC(primitiveTests);
+        if (hasBox && r.time >= time0 && r.time <= time1 && !box.hit(r, tmin, tmax)) {
+            return false;
+        }
+        if (!boundary->interval(r, t0, t1)) return false;
+
+        t0 = std::max(t0, std::max<Real>(tmin, 0));
+        t1 = std::min(t1, tmax);
+        return t0 < t1;
+    }
 
-        if (rec1.t < tmin) rec1.t = tmin;
-        if (rec2.t > tmax) rec2.t = tmax;
-        if (rec1.t >= rec2.t) return false;
-        if (rec1.t < 0) rec1.t = 0;
+    void setScatteringHit(const Ray& r, Real t, HitRecord& rec) const {
+        STAT_INC(primitiveHits);
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.pError = 0;
+        rec.uvScale = 0;
+        rec.normal = {1, 0, 0};
+        rec.front = true;
+        rec.materialId = phaseFunctionId;
+    }
 
-        auto rayLength = r.d.length();
-        auto distInside = (rec2.t - rec1.t) * rayLength;
-        auto hitDist = negInvDensity * std::log(gen.randomDouble());
+  private:
+    std::shared_ptr<Hittable> boundary;
+    uint32_t phaseFunctionId;
+    Real time0;
+    Real time1;
+    bool hasBox;
+    AABB box;
+};
 
-        if (hitDist > distInside) return false;
+class ConstantMedium : public Medium {
+  public:
+    ConstantMedium(const std::shared_ptr<Hittable>& b, Real d, const std::shared_ptr<Texture>& a,
+                   Real time0 = 0, Real time1 = 1)
+        : Medium{b, std::make_shared<Isotropic>(a), time0, time1}, negInvDensity{-1 / d} {}
 
-        rec.t = rec1.t + hitDist / rayLength;
-        rec.p = r.at(rec.t);
+    ConstantMedium(const std::shared_ptr<Hittable>& b, Real d, const Vec3& color, Real time0 = 0,
+                   Real time1 = 1)
+        : Medium{b, std::make_shared<Isotropic>(color), time0, time1}, negInvDensity{-1 / d} {}
 
-        rec.normal = {1, 0, 0};
-        rec.front = true;
-        rec.material = phaseFunction;
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        Real t0, t1;
+        if (!span(r, tmin, tmax, t0, t1)) return false;
+
+        auto rayLength = r.d.length();
+        auto distInside = (t1 - t0) * rayLength;
+        auto hitDist = negInvDensity * std::log(gen.randomDouble());
+        if (hitDist > distInside) return false;
 
+        setScatteringHit(r, t0 + hitDist / rayLength, rec);
         return true;
     }
 
-    bool boundingBox(double time0, double time1, AABB& outBox) const override {
-        return boundary->boundingBox(time0, time1, outBox);
+  private:
+    Real negInvDensity;
+};
+
+// Medium whose density varies in space. Free-flight distances are sampled by delta tracking:
+// steps are drawn against the constant majorant maxDensity and each tentative collision is
+// real with probability density(p) / maxDensity. density() must stay within [0, maxDensity].
+class HeterogeneousMedium : public Medium {
+  public:
+    using DensityFunction = std::function<Real(const Vec3& p)>;
+
+    HeterogeneousMedium(const std::shared_ptr<Hittable>& b, DensityFunction density,
+                        Real maxDensity, const std::shared_ptr<Texture>& a, Real time0 = 0,
+                        Real time1 = 1)
+        : Medium{b, std::make_shared<Isotropic>(a), time0, time1},
+          density{std::move(density)},
+          maxDensity{maxDensity} {}
+
+    HeterogeneousMedium(const std::shared_ptr<Hittable>& b, DensityFunction density,
+                        Real maxDensity, const Vec3& color, Real time0 = 0, Real time1 = 1)
+        : Medium{b, std::make_shared<Isotropic>(color), time0, time1},
+          density{std::move(density)},
+          maxDensity{maxDensity} {}
+
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        Real t0, t1;
+        if (!span(r, tmin, tmax, t0, t1) || maxDensity <= 0) return false;
+
+        auto invMajorant = 1 / (maxDensity * r.d.length());
+        for (auto t = t0;;) {
+            t -= std::log(1 - gen.randomDouble()) * invMajorant;
+            if (t >= t1) return false;
+            if (gen.randomDouble() * maxDensity < density(r.at(t))) {
+                setScatteringHit(r, t, rec);
+                return true;
+            }
+        }
     }
 
   private:
-    std::shared_ptr<Hittable> boundary;
-    std::shared_ptr<Material> phaseFunction;
-    double negInvDensity;
+    DensityFunction density;
+    Real maxDensity;
 };
 
 HittableList cornellSmokeScene() {
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#if RT_OIDN
+#include <OpenImageDenoise/oidn.hpp>
+#endif
+
+#include "rtweekend.h"
+#include "vec.h"
+#include "framebuffer.h"
+#include "tile_queue.h"
+
+struct DenoiseSettings {
+    int iterations = 5;        // filter passes; pass k spaces its taps 2^k pixels apart
+    float sigmaLuminance = 4;  // luminance differences, in standard deviations of the noise
+    float sigmaNormal = 128;   // exponent of the cosine between normals
+    float sigmaDepth = 1;      // depth differences, relative to the depth's change per pixel
+    int tileSize = 64;
+    int threadCount = 0;   // 0 picks std::thread::hardware_concurrency()
+    bool external = true;  // use externalDenoiser when one is set
+};
+
+// A denoiser from outside, typically a library. Returns false to fall back to the built-in one.
+using ExternalDenoiser = std::function<bool(const Framebuffer& color,
+                                            const FeatureBuffers& features, Framebuffer& output)>;
+
+#if RT_OIDN
+// Intel Open Image Denoise's ray tracing filter on the CPU, guided by albedo and normals.
+inline bool oidnDenoise(const Framebuffer& color, const FeatureBuffers& features,
+                        Framebuffer& output) {
+    auto w = color.width();
+    auto h = color.height();
+    output = Framebuffer(w, h);
+    auto device = oidn::newDevice(oidn::DeviceType::CPU);
+    device.commit();
+
+    // OIDN only reads its inputs.
+    auto input = [](const Framebuffer& fb) { return const_cast<float*>(fb.data()); };
+    auto filter = device.newFilter("RT");
+    filter.setImage("color", input(color), oidn::Format::Float3, w, h);
+    filter.setImage("albedo", input(features.albedo), oidn::Format::Float3, w, h);
+    filter.setImage("normal", input(features.normal), oidn::Format::Float3, w, h);
+    filter.setImage("output", output.data(), oidn::Format::Float3, w, h);
+    filter.set("hdr", true);
+    filter.commit();
+    filter.execute();
+
+    const char* message;
+    if (device.getError(message) != oidn::Error::None) {
+        std::cerr << "OIDN: " << message << '\n';
+        return false;
+    }
+    return true;
+}
+
+inline ExternalDenoiser externalDenoiser = oidnDenoise;
+#else
+inline ExternalDenoiser externalDenoiser;
+#endif
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010) with the variance-guided
+// luminance weight of SVGF (Schied et al. 2017). The image is divided by the albedo first, so
+// the filter smooths lighting but not texture, and multiplied back at the end. Every pass blends
+// a 5x5 B3-spline kernel with taps 2^k pixels apart, stopping at differences in normal and
+// depth and at luminance differences the pixels' noise does not explain. The noise estimate is
+// filtered along with the image, so the wider passes blend less. Passes run on all threads, a
+// tile at a time.
+class ATrousDenoiser {
+  public:
+    ATrousDenoiser(const FeatureBuffers& features, const DenoiseSettings& settings)
+        : features{features}, settings{settings} {}
+
+    Framebuffer denoise(const Framebuffer& color) {
+        w = color.width();
+        h = color.height();
+        auto n = color.pixelCount();
+        irradiance.resize(n);
+        variance.resize(n);
+        normals.resize(n);
+        depthSlope.resize(n);
+        std::vector<Vec3> nextIrradiance(n);
+        std::vector<float> nextVariance(n);
+
+        auto tiles = makeTiles(w, h, settings.tileSize);
+        forEachTile(tiles, [&](const Tile& tile) { prepare(tile, color); });
+        for (int k = 0; k < settings.iterations; ++k) {
+            forEachTile(tiles, [&](const Tile& tile) {
+                filter(tile, 1 << k, nextIrradiance, nextVariance);
+            });
+            std::swap(irradiance, nextIrradiance);
+            std::swap(variance, nextVariance);
+        }
+
+        Framebuffer output(w, h);
+        for (size_t i = 0; i < n; ++i) {
+            output.set(i, irradiance[i] * albedo(i));
+        }
+        return output;
+    }
+
+  private:
+    static constexpr float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    static constexpr float minAlbedo = 1e-3f;
+
+    static float luminance(const Vec3& c) {
+        return static_cast<float>(0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z());
+    }
+
+    Vec3 albedo(size_t i) const {
+        auto a = features.albedo.get(i);
+        return {std::max<Real>(a.x(), minAlbedo), std::max<Real>(a.y(), minAlbedo),
+                std::max<Real>(a.z(), minAlbedo)};
+    }
+
+    size_t index(int x, int y) const { return static_cast<size_t>(y) * w + x; }
+
+    // Demodulates the tile and derives its normals and depth slopes. The slope takes the
+    // smaller one-sided difference along each axis, so it stays small next to silhouettes.
+    void prepare(const Tile& tile, const Framebuffer& color) {
+        const auto& depth = features.depth;
+        auto slope = [&](size_t i, int x, int y, int dx, int dy) {
+            auto d = infinity;
+            if (x - dx >= 0 && y - dy >= 0) d = std::abs(depth[i] - depth[index(x - dx, y - dy)]);
+            if (x + dx < w && y + dy < h) {
+                d = std::min<Real>(d, std::abs(depth[index(x + dx, y + dy)] - depth[i]));
+            }
+            return d == infinity ? 0.0f : static_cast<float>(d);
+        };
+
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                auto i = index(x, y);
+                auto a = albedo(i);
+                auto c = color.get(i);
+                irradiance[i] = {c.x() / a.x(), c.y() / a.y(), c.z() / a.z()};
+                auto scale = std::max(luminance(a), minAlbedo);
+                variance[i] = features.variance[i] / (scale * scale);
+                auto normal = features.normal.get(i);
+                normals[i] = normal.length() > 0.01 ? normalized(normal) : Vec3();
+                depthSlope[i] = std::max(slope(i, x, y, 1, 0), slope(i, x, y, 0, 1));
+            }
+        }
+    }
+
+    // One pass over the tile with taps 'step' pixels apart.
+    void filter(const Tile& tile, int step, std::vector<Vec3>& outIrradiance,
+                std::vector<float>& outVariance) const {
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int x = tile.x0; x < tile.x1; ++x) {
+                auto i = index(x, y);
+                auto sigmaL = settings.sigmaLuminance * std::sqrt(blurredVariance(x, y)) + 1e-6f;
+                auto l = luminance(irradiance[i]);
+                const auto& normal = normals[i];
+                auto depth = features.depth[i];
+                auto depthScale = std::max(depthSlope[i] * step, 1e-3f * depth);
+
+                Vec3 sum;
+                float weightSum = 0;
+                float varianceSum = 0;
+                for (int dy = -2; dy <= 2; ++dy) {
+                    auto qy = y + dy * step;
+                    if (qy < 0 || qy >= h) continue;
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        auto qx = x + dx * step;
+                        if (qx < 0 || qx >= w) continue;
+
+                        auto j = index(qx, qy);
+                        auto distance = std::sqrt(static_cast<float>(dx * dx + dy * dy));
+                        auto wl = std::abs(l - luminance(irradiance[j])) / sigmaL;
+                        auto wz = std::abs(depth - features.depth[j]) /
+                                  (settings.sigmaDepth * depthScale * distance + 1e-6f);
+                        auto weight = kernel[dx + 2] * kernel[dy + 2] * std::exp(-wl - wz) *
+                                      normalWeight(normal, normals[j]);
+                        sum += weight * irradiance[j];
+                        weightSum += weight;
+                        varianceSum += weight * weight * variance[j];
+                    }
+                }
+                outIrradiance[i] = sum / weightSum;
+                outVariance[i] = varianceSum / (weightSum * weightSum);
+            }
+        }
+    }
+
+    // Pixels whose rays all escaped have no normal; they only blend with each other.
+    float normalWeight(const Vec3& a, const Vec3& b) const {
+        auto aEscaped = a.lengthSquared() == 0;
+        auto bEscaped = b.lengthSquared() == 0;
+        if (aEscaped || bEscaped) return aEscaped && bEscaped ? 1.0f : 0.0f;
+        auto cosine = std::max<Real>(0, dot(a, b));
+        return static_cast<float>(std::pow(cosine, settings.sigmaNormal));
+    }
+
+    // 3x3 Gaussian of the variance around (x, y), a steadier estimate than the pixel's own.
+    float blurredVariance(int x, int y) const {
+        static constexpr float g[3] = {0.25f, 0.5f, 0.25f};
+        float sum = 0;
+        float weightSum = 0;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                auto qx = x + dx;
+                auto qy = y + dy;
+                if (qx < 0 || qx >= w || qy < 0 || qy >= h) continue;
+                sum += g[dx + 1] * g[dy + 1] * variance[index(qx, qy)];
+                weightSum += g[dx + 1] * g[dy + 1];
+            }
+        }
+        return sum / weightSum;
+    }
+
+    template <typename TileFunction>
+    void forEachTile(const std::vector<Tile>& tiles, TileFunction&& f) const {
+        runTiles(tiles, workerCountFor(settings.threadCount), f);
+    }
+
+    const FeatureBuffers& features;
+    DenoiseSettings settings;
+    int w = 0;
+    int h = 0;
+    std::vector<Vec3> irradiance;  // color divided by albedo
+    std::vector<float> variance;   // of the irradiance's luminance
+    std::vector<Vec3> normals;     // unit length, or zero where every ray escaped
+    std::vector<float> depthSlope;
+};
+
+// Denoises a rendered image with the help of its feature buffers: through externalDenoiser when
+// allowed and set, else, or when that fails, with ATrousDenoiser.
+inline Framebuffer denoise(const Framebuffer& color, const FeatureBuffers& features,
+                           const DenoiseSettings& settings = {}) {
+    if (settings.external && externalDenoiser) {
+        Framebuffer output;
+        if (externalDenoiser(color, features, output)) return output;
+    }
+    return ATrousDenoiser(features, settings).denoise(color);
+}
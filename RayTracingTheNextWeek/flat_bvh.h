@@ -0,0 +1,141 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "bvh_cache.h"
+#include "primitive_store.h"
+#include "stats.h"
+
+// BVH over a HittableList whose nodes live in one contiguous array in depth-first order.
+// Traversal is iterative with an explicit stack and visits the near child first. Occlusion
+// queries visit children in array order instead: any hit ends them, so the nearer one is not
+// worth finding, and the first child is the next node in memory.
+class FlatBvh : public Hittable {
+  public:
+    static const int maxPrimitivesInLeaf = 4;
+
+  public:
+    FlatBvh(const HittableList& list, Real t0, Real t1);
+
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override;
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override;
+    bool boundingBox(Real t0, Real t1, AABB& outBox) const override;
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        for (const auto& p : primitives) {
+            p->collectEmitters(emitters);
+        }
+    }
+
+    const BvhBuildStats& buildStats() const { return stats; }
+
+  private:
+    std::vector<LinearBvhNode> nodes;
+    std::vector<std::shared_ptr<Hittable>> primitives;  // owned; leaves go through 'refs'
+    PrimitiveStore store;
+    std::vector<PrimitiveRef> refs;
+    AABB box;
+    BvhBuildStats stats;
+};
+
+inline FlatBvh::FlatBvh(const HittableList& list, Real t0, Real t1) {
+    const auto& objects = list.objects;
+    std::vector<BvhBuildPrimitive> prims(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+        auto& p = prims[i];
+        if (!objects[i]->boundingBox(t0, t1, p.box)) {
+            p.box = AABB(Vec3(-infinity, -infinity, -infinity), Vec3(infinity, infinity, infinity));
+        }
+        p.centroid = p.box.centroid();
+        p.index = static_cast<uint32_t>(i);
+    }
+
+    stats = buildBvh(maxPrimitivesInLeaf, prims, nodes);
+    if (nodes.empty()) return;
+
+    primitives.reserve(prims.size());
+    for (const auto& p : prims) {
+        primitives.push_back(objects[p.index]);
+    }
+    storePrimitives(primitives, store, refs);
+    box = nodes.front().bounds();
+}
+
+inline bool FlatBvh::hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const {
+    if (nodes.empty()) return false;
+
+    PreparedRay pr(r);
+    const auto& dirIsNeg = pr.dirIsNeg;
+
+    uint32_t stack[SahBvhBuilder::maxDepth];
+    int stackSize = 0;
+    uint32_t current = 0;
+    PrimitiveRef closest{};
+    bool found = false;
+
+    while (true) {
+        const auto& node = nodes[current];
+        STAT_INC(nodeVisits);
+        if (node.hit(r.o, pr.invD, dirIsNeg, tmin, tmax)) {
+            if (node.primitiveCount > 0) {
+                found |= store.hitLeaf(&refs[node.primitiveOffset], node.primitiveCount, r, tmin,
+                                       tmax, rec, closest);
+                if (stackSize == 0) break;
+                current = stack[--stackSize];
+            } else if (dirIsNeg[node.axis]) {
+                stack[stackSize++] = current + 1;
+                current = node.secondChild;
+            } else {
+                stack[stackSize++] = node.secondChild;
+                current = current + 1;
+            }
+        } else {
+            if (stackSize == 0) break;
+            current = stack[--stackSize];
+        }
+    }
+
+    if (!found) return false;
+    store.completeHit(closest, rec);
+    return true;
+}
+
+inline bool FlatBvh::occluded(const Ray& r, Real tmin, Real tmax) const {
+    if (nodes.empty()) return false;
+
+    PreparedRay pr(r);
+    uint32_t stack[SahBvhBuilder::maxDepth];
+    int stackSize = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const auto& node = nodes[current];
+        STAT_INC(nodeVisits);
+        if (node.hit(r.o, pr.invD, pr.dirIsNeg, tmin, tmax)) {
+            if (node.primitiveCount == 0) {
+                stack[stackSize++] = node.secondChild;
+                current = current + 1;
+                continue;
+            }
+            if (store.occludedLeaf(&refs[node.primitiveOffset], node.primitiveCount, r, tmin,
+                                   tmax)) {
+                return true;
+            }
+        }
+        if (stackSize == 0) return false;
+        current = stack[--stackSize];
+    }
+}
+
+inline bool FlatBvh::boundingBox(Real t0, Real t1, AABB& outBox) const {
+    outBox = box;
+    return !nodes.empty();
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "vec.h"
+#include "color.h"
+
+// Linear float RGB image, row-major with the top row first. This is what the renderer produces
+// and what every image writer, denoiser or compositor downstream consumes.
+class Framebuffer {
+  public:
+    static const int channels = 3;
+
+  public:
+    Framebuffer() = default;
+    Framebuffer(int width, int height)
+        : w{width}, h{height}, pixels(static_cast<size_t>(width) * height * channels) {}
+
+    int width() const { return w; }
+    int height() const { return h; }
+    size_t pixelCount() const { return static_cast<size_t>(w) * h; }
+
+    float* data() { return pixels.data(); }
+    const float* data() const { return pixels.data(); }
+
+    void set(size_t index, const Vec3& color) {
+        auto p = &pixels[index * channels];
+        p[0] = static_cast<float>(color.x());
+        p[1] = static_cast<float>(color.y());
+        p[2] = static_cast<float>(color.z());
+    }
+
+    void set(int x, int y, const Vec3& color) { set(static_cast<size_t>(y) * w + x, color); }
+
+    Vec3 get(size_t index) const {
+        auto p = &pixels[index * channels];
+        return {p[0], p[1], p[2]};
+    }
+
+    Vec3 get(int x, int y) const { return get(static_cast<size_t>(y) * w + x); }
+
+    // 8-bit RGB for display formats, encoded the same way as writeColor.
+    std::vector<uint8_t> toBytes(bool gammaCorrection) const {
+        std::vector<uint8_t> bytes(pixels.size());
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            bytes[i] = static_cast<uint8_t>(toByte(pixels[i], gammaCorrection));
+        }
+        return bytes;
+    }
+
+  private:
+    int w = 0;
+    int h = 0;
+    std::vector<float> pixels;
+};
+
+// Per-pixel averages of what the camera rays hit first, rendered along with the image to guide
+// a denoiser. Pixels whose rays all escaped have white albedo, zero normal and zero depth.
+struct FeatureBuffers {
+    Framebuffer albedo;
+    Framebuffer normal;           // world space, facing the camera
+    std::vector<float> depth;     // distance along the ray
+    std::vector<float> variance;  // of the pixel's mean luminance: the noise left in it
+
+    FeatureBuffers() = default;
+    FeatureBuffers(int width, int height)
+        : albedo{width, height},
+          normal{width, height},
+          depth(albedo.pixelCount()),
+          variance(albedo.pixelCount()) {}
+};
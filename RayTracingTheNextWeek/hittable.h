@@ -1,347 +1,542 @@
 #pragma once
 
+#include <cstdint>
+#include <limits>
 #include <memory>
+#include <type_traits>
 #include <utility>
+#include <vector>
 #include <cmath>
 
 #include "vec.h"
 #include "ray.h"
 #include "rtweekend.h"
 #include "aabb.h"
-
-struct Material;
+#include "stats.h"
+#include "material_table.h"
 
 struct HitRecord {
     Vec3 p;
     Vec3 normal;
-    double t;
+    Real t;
+    Real u;
+    Real v;
+    Real pError;  // bound on the absolute error of each coordinate of p, beyond p's own ulps
+    Real uvScale;  // uv units per unit of distance along the surface at p, 0 without uvs
+    Real uvFootprint = 0;  // width in uv units of the area the ray covers, 0 to point-sample
+    uint32_t materialId;
     bool front;
 
-    std::shared_ptr<Material> material;
-
-    double u;
-    double v;
+    const Material& material() const { return materialTable[materialId]; }
 
     void setFaceNormal(const Ray& r, const Vec3& outwardNormal) {
         front = dot(r.d, outwardNormal) < 0;
         normal = front ? outwardNormal : -outwardNormal;
     }
+
+    // Sets uvFootprint from the cone of 'r', the ray that hit here: the cone's width at the hit,
+    // stretched by the angle of incidence.
+    void setFootprint(const Ray& r, const RayCone& cone) {
+        auto length = r.d.length();
+        auto cosine = std::abs(dot(r.d, normal)) / length;
+        uvFootprint = cone.widthAt(t * length) * uvScale / std::max<Real>(cosine, 0.1);
+    }
+
+    // Origin for a ray leaving the surface in 'direction'.
+    Vec3 spawnOrigin(const Vec3& direction) const {
+        return offsetRayOrigin(p, normal, direction, pError);
+    }
 };
 
+static_assert(std::is_trivially_copyable_v<HitRecord>);
+
+// hit() must leave 'rec' untouched when it returns false; containers write candidate hits
+// straight into the caller's record.
 struct Hittable {
-    virtual bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const = 0;
-    virtual bool boundingBox(double time0, double time1, AABB& outBox) const = 0;
-};
+    virtual bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const = 0;
+    virtual bool boundingBox(Real time0, Real time1, AABB& outBox) const = 0;
+
+    // Boxes at time0 and time1 whose blend at s bounds the object at time lerp(time0, time1, s),
+    // for BVHs over moving objects. The default, right for anything static, is the box over the
+    // whole interval at both ends.
+    virtual bool motionBounds(Real time0, Real time1, AABB& box0, AABB& box1) const {
+        if (!boundingBox(time0, time1, box0)) return false;
+        box1 = box0;
+        return true;
+    }
 
-struct Sphere : public Hittable {
-    Sphere(const Vec3& center, double radius, const std::shared_ptr<Material>& material)
-        : center{center}, radius{radius}, material{material} {}
-
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override {
-        // Check if ray hits this sphere
-        auto oc = r.o - center;
-        auto a = r.d.lengthSquared();
-        auto h = dot(r.d, oc);
-        auto c = oc.lengthSquared() - radius * radius;
-        auto discriminant = h * h - a * c;
-        if (discriminant < 0.0) {
-            return false;
-        }
+    // Like hit(), but may leave attributes that only the closest hit needs (UVs) to
+    // completeHit(). Containers call this for every candidate and complete only the winner.
+    virtual bool hitCandidate(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const {
+        return hit(r, tmin, tmax, rec);
+    }
+    virtual void completeHit(HitRecord& rec) const {}
 
-        auto t = -(h + std::sqrt(discriminant)) / a;
-        if (t < tmin || t > tmax) {
-            t = (-h + std::sqrt(discriminant)) / a;
-            if (t < tmin || t > tmax) return false;
+    // Whether anything lies on 'r' within [tmin, tmax], for shadow and visibility rays. Any hit
+    // answers it, so overrides stop at the first one and skip hit points, normals and UVs.
+    virtual bool occluded(const Ray& r, Real tmin, Real tmax) const {
+        HitRecord rec;
+        return hitCandidate(r, tmin, tmax, rec);
+    }
+
+    // Span [tEnter, tExit] of the whole line through 'r' inside a closed boundary; media call
+    // this once per ray. The default finds the first two hits; convex shapes solve it directly.
+    virtual bool interval(const Ray& r, Real& tEnter, Real& tExit) const {
+        HitRecord rec1;
+        if (!hit(r, -infinity, infinity, rec1)) return false;
+
+        HitRecord rec2;
+        if (!hit(r, rec1.t + 0.0001, infinity, rec2)) return false;
+
+        tEnter = rec1.t;
+        tExit = rec2.t;
+        return true;
+    }
+
+    // Next-event estimation. Containers gather the emitters below them; primitives that can be
+    // sampled add themselves when their material emits.
+    virtual void collectEmitters(std::vector<const Hittable*>& emitters) const {}
+
+    // Solid-angle density of sampleDirection() picking 'direction' from 'origin'.
+    virtual Real pdfValue(const Vec3& origin, const Vec3& direction) const { return 0; }
+
+    // Direction from 'origin' toward a random point of the surface, from (u1, u2) in [0, 1).
+    virtual Vec3 sampleDirection(const Vec3& origin, Real u1, Real u2) const {
+        return {1, 0, 0};
+    }
+
+    // Closest hit for every active ray of the packet. Acceleration structures override this to
+    // traverse the packet together.
+    virtual void hitPacket(const RayPacket& packet, Real tmin, Real tmax, HitRecord recs[],
+                           bool hits[]) const {
+        for (int i = 0; i < RayPacket::size; ++i) {
+            hits[i] = packet.active[i] && hit(packet.rays[i], tmin, tmax, recs[i]);
         }
+    }
+};
 
-        // Update hit record accordingly
-        rec.t = t;
-        rec.p = r.at(t);
-        auto outwardNormal = (rec.p - center) / radius;
-        rec.setFaceNormal(r, outwardNormal);
-        getSphereUV(outwardNormal, rec.u, rec.v);
-        rec.material = material;
+// Roots t0 <= t1 of |o + t d - center|^2 = radius^2, with oc = o - center. The discriminant is
+// taken from the ray's distance to the center rather than as h^2 - ac, and the roots from the
+// numerically stable quadratic formula; both matter in float, where the naive forms lose most
+// digits for large spheres such as the ground of the random scene.
+inline bool solveSphere(const Vec3& oc, const Vec3& d, Real radius, Real& t0, Real& t1) {
+    auto a = d.lengthSquared();
+    auto h = dot(d, oc);
+    auto l = oc - (h / a) * d;  // from the center to the closest point of the line
+    auto discriminant = a * (radius * radius - l.lengthSquared());
+    if (discriminant < 0) return false;
+
+    auto q = h > 0 ? -(h + std::sqrt(discriminant)) : -h + std::sqrt(discriminant);
+    auto c = oc.lengthSquared() - radius * radius;
+    t0 = c / q;
+    t1 = q / a;
+    if (t0 > t1) std::swap(t0, t1);
+    return true;
+}
+
+// Error bound of hit points on a sphere. The test works relative to the center, so its rounding
+// grows with the center's distance from the origin as well as with the radius.
+inline Real sphereError(const Vec3& center, Real radius) {
+    return 8 * std::numeric_limits<Real>::epsilon() * (center.maxAbs() + std::abs(radius));
+}
+
+inline void sphereUV(const Vec3& p, Real& outU, Real& outV) {
+    const auto& [x, y, z] = std::make_tuple(p.x(), p.y(), p.z());
+
+    // Cartesian to spherical coordinates
+    auto theta = std::acos(-y);         // polar angle
+    auto phi = std::atan2(-z, x) + pi;  // azimuthal angle
+
+    // Normalized spherical coordinates to get u-v coordinates
+    outU = phi / (2 * pi);
+    outV = theta / pi;
+}
+
+// Sphere intersection without the UVs, which completeSphereHit() adds. Free functions, so that
+// Sphere, MovingSphere and the arrays of PrimitiveStore share them.
+inline bool hitSphere(const Vec3& center, Real radius, uint32_t materialId, const Ray& r,
+                      Real tmin, Real tmax, HitRecord& rec) {
+    STAT_INC(primitiveTests);
+    // Check if ray hits this sphere
+    Real near, far;
+    if (!solveSphere(r.o - center, r.d, radius, near, far)) return false;
+
+    auto t = near;
+    if (t < tmin || t > tmax) {
+        t = far;
+        if (t < tmin || t > tmax) return false;
+    }
+
+    // Update hit record accordingly
+    STAT_INC(primitiveHits);
+    rec.t = t;
+    // Projected back onto the sphere, which keeps the point within a few ulps of the surface;
+    // r.at(t) can be much further off at grazing angles.
+    auto offset = r.at(t) - center;
+    rec.p = center + offset * (std::abs(radius) / offset.length());
+    rec.pError = sphereError(center, radius);
+    auto outwardNormal = (rec.p - center) / radius;
+    rec.setFaceNormal(r, outwardNormal);
+    rec.materialId = materialId;
+    return true;
+}
+
+// hitSphere() as an occlusion test.
+inline bool occludesSphere(const Vec3& center, Real radius, const Ray& r, Real tmin, Real tmax) {
+    STAT_INC(primitiveTests);
+    Real near, far;
+    if (!solveSphere(r.o - center, r.d, radius, near, far)) return false;
+    if ((near < tmin || near > tmax) && (far < tmin || far > tmax)) return false;
+    STAT_INC(primitiveHits);
+    return true;
+}
+
+inline void completeSphereHit(const Vec3& center, Real radius, HitRecord& rec) {
+    sphereUV((rec.p - center) / radius, rec.u, rec.v);
+    // u runs around a circle of radius r sin(theta), v along half a great circle.
+    auto sinTheta = std::max<Real>(std::sin(pi * rec.v), 0.001);
+    rec.uvScale = 1 / (pi * std::abs(radius) * std::sqrt(2 * sinTheta));
+}
+
+struct Sphere : public Hittable {
+    Sphere(const Vec3& center, Real radius, const std::shared_ptr<Material>& material)
+        : center{center}, radius{radius}, materialId{materialTable.add(material)} {}
+
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        if (!hitCandidate(r, tmin, tmax, rec)) return false;
+        completeHit(rec);
         return true;
     }
 
-    static void getSphereUV(const Vec3& p, double& outU, double& outV) {
-        const auto& [x, y, z] = std::make_tuple(p.x(), p.y(), p.z());
+    bool hitCandidate(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        return hitSphere(center, radius, materialId, r, tmin, tmax, rec);
+    }
 
-        // Cartesian to spherical coordinates
-        auto theta = std::acos(-y);         // polar angle
-        auto phi = std::atan2(-z, x) + pi;  // azimuthal angle
+    void completeHit(HitRecord& rec) const override { completeSphereHit(center, radius, rec); }
 
-        // Normalized spherical coordinates to get u-v coordinates
-        outU = phi / (2 * pi);
-        outV = theta / pi;
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override {
+        return occludesSphere(center, radius, r, tmin, tmax);
     }
 
-    bool boundingBox(double time0, double time1, AABB& outBox) const override {
+    static void getSphereUV(const Vec3& p, Real& outU, Real& outV) { sphereUV(p, outU, outV); }
+
+    bool boundingBox(Real time0, Real time1, AABB& outBox) const override {
         const auto& v = Vec3(radius, radius, radius);
         outBox = {center - v, center + v};
         return true;
     }
 
+    bool interval(const Ray& r, Real& tEnter, Real& tExit) const override {
+        return solveSphere(r.o - center, r.d, radius, tEnter, tExit) && tEnter < tExit;
+    }
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        if (materialTable.emits(materialId)) emitters.push_back(this);
+    }
+
+    // Uniform over the cone of directions the sphere subtends from 'origin'.
+    Real pdfValue(const Vec3& origin, const Vec3& direction) const override {
+        HitRecord rec;
+        if (!hitCandidate(Ray(origin, direction), 0, infinity, rec)) return 0;
+
+        // sampleDirection() does not sample from inside the sphere.
+        auto distanceSquared = (center - origin).lengthSquared();
+        if (distanceSquared <= radius * radius) return 0;
+
+        auto cosThetaMax = std::sqrt(1 - radius * radius / distanceSquared);
+        return 1 / (2 * pi * (1 - cosThetaMax));
+    }
+
+    Vec3 sampleDirection(const Vec3& origin, Real u1, Real u2) const override {
+        auto toCenter = center - origin;
+        auto distanceSquared = toCenter.lengthSquared();
+        if (distanceSquared <= radius * radius) return toCenter;
+
+        auto cosThetaMax = std::sqrt(1 - radius * radius / distanceSquared);
+        auto z = 1 + u2 * (cosThetaMax - 1);
+        auto r = std::sqrt(std::max<Real>(0, 1 - z * z));
+        auto phi = 2 * pi * u1;
+        Vec3 local(r * std::cos(phi), r * std::sin(phi), z);
+        return fromLocal(local, toCenter / std::sqrt(distanceSquared));
+    }
+
     Vec3 center;
-    double radius;
-    std::shared_ptr<Material> material;
+    Real radius;
+    uint32_t materialId;
 };
 
 class MovingSphere : public Hittable {
   public:
-    MovingSphere(const Vec3& c0, const Vec3& c1, double t0, double t1, double radius,
+    MovingSphere(const Vec3& c0, const Vec3& c1, Real t0, Real t1, Real radius,
                  const std::shared_ptr<Material>& material)
-        : c0{c0}, c1{c1}, t0{t0}, t1{t1}, radius{radius}, material{material} {}
-
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override {
-        auto oc = r.o - centerAtTime(r.time);
-        auto a = r.d.lengthSquared();
-        auto h = dot(r.d, oc);
-        auto c = oc.lengthSquared() - radius * radius;
-        auto discriminant = h * h - a * c;
-        if (discriminant < 0.0) {
-            return false;
-        }
-
-        auto t = -(h + std::sqrt(discriminant)) / a;
-        if (t < tmin || t > tmax) {
-            t = (-h + std::sqrt(discriminant)) / a;
-            if (t < tmin || t > tmax) return false;
-        }
-
-        rec.t = t;
-        rec.p = r.at(t);
-        auto outwardNormal = (rec.p - centerAtTime(r.time)) / radius;
-        rec.setFaceNormal(r, outwardNormal);
-        rec.material = material;
+        : c0{c0},
+          c1{c1},
+          t0{t0},
+          t1{t1},
+          radius{radius},
+          materialId{materialTable.add(material)} {}
+
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        if (!hitSphere(centerAtTime(r.time), radius, materialId, r, tmin, tmax, rec)) return false;
+        rec.uvScale = 0;
         return true;
     }
 
-    Vec3 centerAtTime(double t) const { return lerp(c0, c1, (t - t0) / (t1 - t0)); }
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override {
+        return occludesSphere(centerAtTime(r.time), radius, r, tmin, tmax);
+    }
+
+    Vec3 centerAtTime(Real t) const { return lerp(c0, c1, (t - t0) / (t1 - t0)); }
 
-    bool boundingBox(double time0, double time1, AABB& outBox) const override {
+    bool boundingBox(Real time0, Real time1, AABB& outBox) const override {
         const auto& v = Vec3(radius, radius, radius);
         const auto& c0 = centerAtTime(time0);
         const auto& c1 = centerAtTime(time1);
-        const auto& box0 = AABB(c0 + v, c0 - v);
-        const auto& box1 = AABB(c1 + v, c1 - v);
+        const auto& box0 = AABB(c0 - v, c0 + v);
+        const auto& box1 = AABB(c1 - v, c1 + v);
         outBox = surroundingBox(box0, box1);
         return true;
     }
 
+    // The center moves linearly, so the boxes at the two ends bound it in between.
+    bool motionBounds(Real time0, Real time1, AABB& box0, AABB& box1) const override {
+        const auto& v = Vec3(radius, radius, radius);
+        const auto& c0 = centerAtTime(time0);
+        const auto& c1 = centerAtTime(time1);
+        box0 = AABB(c0 - v, c0 + v);
+        box1 = AABB(c1 - v, c1 + v);
+        return true;
+    }
+
   private:
+    friend class PrimitiveStore;
+
     Vec3 c0;
     Vec3 c1;
-    double t0;
-    double t1;
-    double radius;
-    std::shared_ptr<Material> material;
+    Real t0;
+    Real t1;
+    Real radius;
+    uint32_t materialId;
 };
 
+// Intersection of a rectangle perpendicular to 'axis' at coordinate k, spanning [a0, a1] x
+// [b0, b1] along the other two axes in order, without the UVs that completeRectHit() adds.
+inline bool hitRect(int axis, Real k, Real a0, Real a1, Real b0, Real b1, uint32_t materialId,
+                    const Ray& r, Real tmin, Real tmax, HitRecord& rec) {
+    STAT_INC(primitiveTests);
+    auto t = (k - r.o[axis]) / r.d[axis];
+    if (t < tmin || t > tmax) return false;
+
+    auto p = r.at(t);
+    auto a = p[axis == 0 ? 1 : 0];
+    auto b = p[axis == 2 ? 1 : 2];
+    if (a < a0 || a > a1 || b < b0 || b > b1) return false;
+
+    STAT_INC(primitiveHits);
+    rec.t = t;
+    rec.p = p;
+    rec.p[axis] = k;  // exactly on the plane, so p has no error beyond its own ulps
+    rec.pError = 0;
+    Vec3 normal;
+    normal[axis] = 1;
+    rec.setFaceNormal(r, normal);
+    rec.materialId = materialId;
+    return true;
+}
+
+// hitRect() as an occlusion test.
+inline bool occludesRect(int axis, Real k, Real a0, Real a1, Real b0, Real b1, const Ray& r,
+                         Real tmin, Real tmax) {
+    STAT_INC(primitiveTests);
+    auto t = (k - r.o[axis]) / r.d[axis];
+    if (t < tmin || t > tmax) return false;
+
+    auto a = r.o[axis == 0 ? 1 : 0] + t * r.d[axis == 0 ? 1 : 0];
+    auto b = r.o[axis == 2 ? 1 : 2] + t * r.d[axis == 2 ? 1 : 2];
+    if (a < a0 || a > a1 || b < b0 || b > b1) return false;
+    STAT_INC(primitiveHits);
+    return true;
+}
+
+inline void completeRectHit(int axis, Real a0, Real a1, Real b0, Real b1, HitRecord& rec) {
+    rec.u = (rec.p[axis == 0 ? 1 : 0] - a0) / (a1 - a0);
+    rec.v = (rec.p[axis == 2 ? 1 : 2] - b0) / (b1 - b0);
+    rec.uvScale = 1 / std::sqrt((a1 - a0) * (b1 - b0));
+}
+
 class XYRect : public Hittable {
   public:
-    XYRect(double x0, double x1, double y0, double y1, double k, std::shared_ptr<Material> mat)
-        : x0{x0}, x1{x1}, y0{y0}, y1{y1}, k{k}, material{std::move(mat)} {}
-
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override {
-        auto t = (k - r.o.z()) / r.d.z();
-        if (t < tmin || t > tmax) return false;
-
-        auto x = r.at(t).x();
-        auto y = r.at(t).y();
-        if (x < x0 || x > x1 || y < y0 || y > y1) return false;
+    XYRect(Real x0, Real x1, Real y0, Real y1, Real k, std::shared_ptr<Material> mat)
+        : x0{x0}, x1{x1}, y0{y0}, y1{y1}, k{k}, materialId{materialTable.add(mat)} {}
 
-        rec.u = (x - x0) / (x1 - x0);
-        rec.v = (y - y0) / (y1 - y0);
-        rec.t = t;
-        rec.p = r.at(t);
-        rec.setFaceNormal(r, {0, 0, 1});
-        rec.material = material;
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        if (!hitCandidate(r, tmin, tmax, rec)) return false;
+        completeHit(rec);
         return true;
     }
 
-    bool boundingBox(double time0, double time1, AABB& outBox) const override {
-        outBox = AABB(Vec3{x0, y0, k - 0.0001}, Vec3{x1, y1, k + 0.0001});
-        return true;
+    bool hitCandidate(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        return hitRect(2, k, x0, x1, y0, y1, materialId, r, tmin, tmax, rec);
     }
 
-  private:
-    double x0;
-    double x1;
-    double y0;
-    double y1;
-    double k;
-    std::shared_ptr<Material> material;
-};
+    void completeHit(HitRecord& rec) const override {
+        completeRectHit(2, x0, x1, y0, y1, rec);
+    }
 
-class XZRect : public Hittable {
-  public:
-    XZRect(double x0, double x1, double z0, double z1, double k, std::shared_ptr<Material> mat)
-        : x0{x0}, x1{x1}, z0{z0}, z1{z1}, k{k}, material{std::move(mat)} {}
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override {
+        return occludesRect(2, k, x0, x1, y0, y1, r, tmin, tmax);
+    }
 
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override {
-        auto t = (k - r.o.y()) / r.d.y();
-        if (t < tmin || t > tmax) return false;
+    bool boundingBox(Real time0, Real time1, AABB& outBox) const override {
+        outBox = AABB(Vec3(x0, y0, k - 0.0001), Vec3(x1, y1, k + 0.0001));
+        return true;
+    }
 
-        auto x = r.at(t).x();
-        auto z = r.at(t).z();
-        if (x < x0 || x > x1 || z < z0 || z > z1) return false;
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        if (materialTable.emits(materialId)) emitters.push_back(this);
+    }
 
-        rec.u = (x - x0) / (x1 - x0);
-        rec.v = (z - z0) / (z1 - z0);
-        rec.t = t;
-        rec.p = r.at(t);
-        rec.setFaceNormal(r, {0, 1, 0});
-        rec.material = material;
-        return true;
+    // Uniform over the area, converted to solid angle at 'origin'.
+    Real pdfValue(const Vec3& origin, const Vec3& direction) const override {
+        HitRecord rec;
+        if (!hitCandidate(Ray(origin, direction), 0, infinity, rec)) return 0;
+
+        auto area = (x1 - x0) * (y1 - y0);
+        auto distanceSquared = rec.t * rec.t * direction.lengthSquared();
+        auto cosine = std::abs(direction.z()) / direction.length();
+        return distanceSquared / (cosine * area);
     }
 
-    bool boundingBox(double time0, double time1, AABB& outBox) const override {
-        outBox = AABB(Vec3{x0, k - 0.0001, z0}, Vec3{x1, k + 0.0001, z1});
-        return true;
+    Vec3 sampleDirection(const Vec3& origin, Real u1, Real u2) const override {
+        Vec3 point(x0 + u1 * (x1 - x0), y0 + u2 * (y1 - y0), k);
+        return point - origin;
     }
 
   private:
-    double x0;
-    double x1;
-    double z0;
-    double z1;
-    double k;
-    std::shared_ptr<Material> material;
+    friend class PrimitiveStore;
+
+    Real x0;
+    Real x1;
+    Real y0;
+    Real y1;
+    Real k;
+    uint32_t materialId;
 };
 
-class YZRect : public Hittable {
+class XZRect : public Hittable {
   public:
-    YZRect(double y0, double y1, double z0, double z1, double k, std::shared_ptr<Material> mat)
-        : y0{y0}, y1{y1}, z0{z0}, z1{z1}, k{k}, material{std::move(mat)} {}
+    XZRect(Real x0, Real x1, Real z0, Real z1, Real k, std::shared_ptr<Material> mat)
+        : x0{x0}, x1{x1}, z0{z0}, z1{z1}, k{k}, materialId{materialTable.add(mat)} {}
 
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override {
-        auto t = (k - r.o.x()) / r.d.x();
-        if (t < tmin || t > tmax) return false;
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        if (!hitCandidate(r, tmin, tmax, rec)) return false;
+        completeHit(rec);
+        return true;
+    }
 
-        auto y = r.at(t).y();
-        auto z = r.at(t).z();
-        if (y < y0 || y > y1 || z < z0 || z > z1) return false;
+    bool hitCandidate(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        return hitRect(1, k, x0, x1, z0, z1, materialId, r, tmin, tmax, rec);
+    }
 
-        rec.u = (y - y0) / (y1 - y0);
-        rec.v = (z - z0) / (z1 - z0);
-        rec.t = t;
-        rec.p = r.at(t);
-        rec.setFaceNormal(r, {1, 0, 0});
-        rec.material = material;
-        return true;
+    void completeHit(HitRecord& rec) const override {
+        completeRectHit(1, x0, x1, z0, z1, rec);
     }
 
-    bool boundingBox(double time0, double time1, AABB& outBox) const override {
-        outBox = AABB(Vec3{k - 0.0001, y0, z0}, Vec3{k + 0.0001, y0, z1});
-        return true;
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override {
+        return occludesRect(1, k, x0, x1, z0, z1, r, tmin, tmax);
     }
 
-  private:
-    double y0;
-    double y1;
-    double z0;
-    double z1;
-    double k;
-    std::shared_ptr<Material> material;
-};
+    bool boundingBox(Real time0, Real time1, AABB& outBox) const override {
+        outBox = AABB(Vec3(x0, k - 0.0001, z0), Vec3(x1, k + 0.0001, z1));
+        return true;
+    }
 
-class Translate : public Hittable {
-  public:
-    Translate(const std::shared_ptr<Hittable>& p, const Vec3& offset) : ptr{p}, offset{offset} {}
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        if (materialTable.emits(materialId)) emitters.push_back(this);
+    }
 
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override {
-        Ray movedRay(r.o - offset, r.d, r.time);
-        if (!ptr->hit(movedRay, tmin, tmax, rec)) return false;
+    // Uniform over the area, converted to solid angle at 'origin'.
+    Real pdfValue(const Vec3& origin, const Vec3& direction) const override {
+        HitRecord rec;
+        if (!hitCandidate(Ray(origin, direction), 0, infinity, rec)) return 0;
 
-        rec.p += offset;
-        rec.setFaceNormal(movedRay, rec.normal);
-        return true;
+        auto area = (x1 - x0) * (z1 - z0);
+        auto distanceSquared = rec.t * rec.t * direction.lengthSquared();
+        auto cosine = std::abs(direction.y()) / direction.length();
+        return distanceSquared / (cosine * area);
     }
 
-    bool boundingBox(double time0, double time1, AABB& outBox) const override {
-        if (!ptr->boundingBox(time0, time1, outBox)) return false;
-        outBox.a += offset;
-        outBox.b += offset;
-        return true;
+    Vec3 sampleDirection(const Vec3& origin, Real u1, Real u2) const override {
+        Vec3 point(x0 + u1 * (x1 - x0), k, z0 + u2 * (z1 - z0));
+        return point - origin;
     }
 
   private:
-    std::shared_ptr<Hittable> ptr;
-    Vec3 offset;
+    friend class PrimitiveStore;
+
+    Real x0;
+    Real x1;
+    Real z0;
+    Real z1;
+    Real k;
+    uint32_t materialId;
 };
 
-class RotateY : public Hittable {
+class YZRect : public Hittable {
   public:
-    RotateY(const std::shared_ptr<Hittable>& p, double angle) : ptr{p} {
-        auto rad = toRadian(angle);
-        sinTheta = std::sin(rad);
-        cosTheta = std::cos(rad);
-        hasBox = ptr->boundingBox(0, 1, bbox);
-
-        Vec3 min(infinity, infinity, infinity);
-        Vec3 max(-infinity, -infinity, -infinity);
-
-        for (int i = 0; i < 2; ++i) {
-            for (int j = 0; j < 2; ++j) {
-                for (int k = 0; k < 2; ++k) {
-                    auto x = i * bbox.b.x() + (1 - i) * bbox.a.x();
-                    auto y = j * bbox.b.y() + (1 - j) * bbox.a.y();
-                    auto z = k * bbox.b.z() + (1 - k) * bbox.a.z();
-
-                    auto newx = cosTheta * x + sinTheta * z;
-                    auto newz = -sinTheta * x + cosTheta * z;
-
-                    Vec3 tester(newx, y, newz);
-
-                    for (int c = 0; c < 3; ++c) {
-                        min[c] = std::min(min[c], tester[c]);
-                        max[c] = std::max(max[c], tester[c]);
-                    }
-                }
-            }
-        }
-        bbox = AABB(min, max);
-    }
-
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override {
-        auto origin = r.o;
-        auto direction = r.d;
-
-        origin[0] = cosTheta * r.o[0] - sinTheta * r.o[2];
-        origin[2] = sinTheta * r.o[0] + cosTheta * r.o[2];
+    YZRect(Real y0, Real y1, Real z0, Real z1, Real k, std::shared_ptr<Material> mat)
+        : y0{y0}, y1{y1}, z0{z0}, z1{z1}, k{k}, materialId{materialTable.add(mat)} {}
 
-        direction[0] = cosTheta * r.d[0] - sinTheta * r.d[2];
-        direction[2] = sinTheta * r.d[0] + cosTheta * r.d[2];
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        if (!hitCandidate(r, tmin, tmax, rec)) return false;
+        completeHit(rec);
+        return true;
+    }
 
-        Ray rotatedRay(origin, direction, r.time);
+    bool hitCandidate(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        return hitRect(0, k, y0, y1, z0, z1, materialId, r, tmin, tmax, rec);
+    }
 
-        if (!ptr->hit(rotatedRay, tmin, tmax, rec)) return false;
+    void completeHit(HitRecord& rec) const override {
+        completeRectHit(0, y0, y1, z0, z1, rec);
+    }
 
-        auto p = rec.p;
-        auto normal = rec.normal;
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override {
+        return occludesRect(0, k, y0, y1, z0, z1, r, tmin, tmax);
+    }
 
-        p[0] = cosTheta * rec.p[0] + sinTheta * rec.p[2];
-        p[2] = -sinTheta * rec.p[0] + cosTheta * rec.p[2];
+    bool boundingBox(Real time0, Real time1, AABB& outBox) const override {
+        outBox = AABB(Vec3(k - 0.0001, y0, z0), Vec3(k + 0.0001, y1, z1));
+        return true;
+    }
 
-        normal[0] = cosTheta * rec.normal[0] + sinTheta * rec.normal[2];
-        normal[2] = -sinTheta * rec.normal[0] + cosTheta * rec.normal[2];
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        if (materialTable.emits(materialId)) emitters.push_back(this);
+    }
 
-        rec.p = p;
-        rec.setFaceNormal(rotatedRay, normal);
+    // Uniform over the area, converted to solid angle at 'origin'.
+    Real pdfValue(const Vec3& origin, const Vec3& direction) const override {
+        HitRecord rec;
+        if (!hitCandidate(Ray(origin, direction), 0, infinity, rec)) return 0;
 
-        return true;
+        auto area = (y1 - y0) * (z1 - z0);
+        auto distanceSquared = rec.t * rec.t * direction.lengthSquared();
+        auto cosine = std::abs(direction.x()) / direction.length();
+        return distanceSquared / (cosine * area);
     }
 
-    bool boundingBox(double time0, double time1, AABB& outBox) const override {
-        outBox = bbox;
-        return hasBox;
+    Vec3 sampleDirection(const Vec3& origin, Real u1, Real u2) const override {
+        Vec3 point(k, y0 + u1 * (y1 - y0), z0 + u2 * (z1 - z0));
+        return point - origin;
     }
 
   private:
-    std::shared_ptr<Hittable> ptr;
-    double sinTheta;
-    double cosTheta;
-    bool hasBox;
-    AABB bbox;
+    friend class PrimitiveStore;
+
+    Real y0;
+    Real y1;
+    Real z0;
+    Real z1;
+    Real k;
+    uint32_t materialId;
 };
@@ -16,28 +16,43 @@ class HittableList : public Hittable {
     void clear() { objects.clear(); }
     void add(const std::shared_ptr<Hittable>& object) { objects.push_back(object); }
 
-    bool hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const override;
-    bool boundingBox(double time0, double time1, AABB& outputBox) const override;
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override;
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override;
+    bool boundingBox(Real time0, Real time1, AABB& outputBox) const override;
+    bool motionBounds(Real time0, Real time1, AABB& box0, AABB& box1) const override;
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        for (const auto& p : objects) {
+            p->collectEmitters(emitters);
+        }
+    }
 
     std::vector<std::shared_ptr<Hittable>> objects;
 };
 
-inline bool HittableList::hit(const Ray& r, double tmin, double tmax, HitRecord& rec) const {
-    HitRecord tempRec;
-    bool hitAnything = false;
+inline bool HittableList::hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const {
+    const Hittable* closest = nullptr;
 
     for (const auto& p : objects) {
-        if (p->hit(r, tmin, tmax, tempRec)) {
-            hitAnything = true;
-            tmax = tempRec.t;
-            rec = tempRec;
+        if (p->hitCandidate(r, tmin, tmax, rec)) {
+            closest = p.get();
+            tmax = rec.t;
         }
     }
 
-    return hitAnything;
+    if (!closest) return false;
+    closest->completeHit(rec);
+    return true;
+}
+
+inline bool HittableList::occluded(const Ray& r, Real tmin, Real tmax) const {
+    for (const auto& p : objects) {
+        if (p->occluded(r, tmin, tmax)) return true;
+    }
+    return false;
 }
 
-inline bool HittableList::boundingBox(double time0, double time1, AABB& outputBox) const {
+inline bool HittableList::boundingBox(Real time0, Real time1, AABB& outputBox) const {
     bool first = true;
     for (const auto& p : objects) {
         if (AABB box; p->boundingBox(time0, time1, box)) {
@@ -48,6 +63,19 @@ inline bool HittableList::boundingBox(double time0, double time1, AABB& outputBo
     return true;
 }
 
+// A blend of unions contains the union of the blends.
+inline bool HittableList::motionBounds(Real time0, Real time1, AABB& box0, AABB& box1) const {
+    bool first = true;
+    for (const auto& p : objects) {
+        if (AABB b0, b1; p->motionBounds(time0, time1, b0, b1)) {
+            box0 = first ? b0 : surroundingBox(b0, box0);
+            box1 = first ? b1 : surroundingBox(b1, box1);
+            first = false;
+        }
+    }
+    return !first;
+}
+
 HittableList randomScene() {
     using std::make_shared;
     using std::shared_ptr;
@@ -60,8 +88,8 @@ HittableList randomScene() {
     for (int a = -4; a < 4; ++a) {
         for (int b = -4; b < 4; ++b) {
             auto dice{gen.randomDouble()};
-            Vec3 center{a + 0.9 * gen.randomDouble(), 0.2, b + 0.9 * gen.randomDouble()};
-            Vec3 center2{center + Vec3{0, gen.randomDouble(0, 0.5), 0}};
+            Vec3 center(a + 0.9 * gen.randomDouble(), 0.2, b + 0.9 * gen.randomDouble());
+            Vec3 center2 = center + Vec3(0, gen.randomDouble(0, 0.5), 0);
 
             if ((center - Vec3(4, 0.2, 0)).length() > 0.9) {
                 shared_ptr<Material> mat;
@@ -106,11 +134,16 @@ HittableList twoSpheresScene() {
     return world;
 }
 
-HittableList twoPerlinSpheres() {
+// With bakeResolution > 0, turbulence around the small sphere is looked up in a baked volume of
+// that many samples per axis (NoiseTexture::bake).
+HittableList twoPerlinSpheres(int bakeResolution = 0) {
     using std::make_shared;
     HittableList world;
 
     auto noiseTexture = std::make_shared<NoiseTexture>(4);
+    if (bakeResolution > 0) {
+        noiseTexture->bake(AABB(Vec3(-2, 0, -2), Vec3(2, 4, 2)), bakeResolution);
+    }
 
     world.add(make_shared<Sphere>(Vec3{0, -1000, 0}, 1000, make_shared<Lambertian>(noiseTexture)));
     world.add(make_shared<Sphere>(Vec3{0, 2, 0}, 2, make_shared<Lambertian>(noiseTexture)));
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <string>
+
+#ifdef _MSC_VER
+    #pragma warning (push, 0)
+#endif
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#ifdef _MSC_VER
+    #pragma warning (pop)
+#endif
+
+#include "framebuffer.h"
+
+enum class ImageFormat {
+    PpmAscii,   // P3, the original text output
+    PpmBinary,  // P6
+    Png,
+    Hdr,  // Radiance RGBE, keeps the float range
+    Pfm,  // portable float map, lossless 32-bit float
+};
+
+inline ImageFormat formatFromPath(const std::string& path) {
+    auto dot = path.rfind('.');
+    auto ext = dot == std::string::npos ? std::string{} : path.substr(dot + 1);
+    if (ext == "png") return ImageFormat::Png;
+    if (ext == "hdr") return ImageFormat::Hdr;
+    if (ext == "pfm") return ImageFormat::Pfm;
+    return ImageFormat::PpmBinary;
+}
+
+inline bool writePpm(std::ostream& os, const Framebuffer& fb, ImageFormat format,
+                     bool gammaCorrection) {
+    auto bytes = fb.toBytes(gammaCorrection);
+    if (format == ImageFormat::PpmAscii) {
+        os << "P3\n" << fb.width() << ' ' << fb.height() << "\n255\n";
+        for (size_t i = 0; i < bytes.size(); i += 3) {
+            os << int(bytes[i]) << ' ' << int(bytes[i + 1]) << ' ' << int(bytes[i + 2]) << '\n';
+        }
+    } else {
+        os << "P6\n" << fb.width() << ' ' << fb.height() << "\n255\n";
+        os.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    }
+    return static_cast<bool>(os);
+}
+
+// PFM rows run bottom to top; a negative scale marks little-endian data.
+inline bool writePfm(const std::string& path, const Framebuffer& fb) {
+    std::ofstream os(path, std::ios::binary);
+    os << "PF\n" << fb.width() << ' ' << fb.height() << "\n-1.0\n";
+    auto rowFloats = static_cast<size_t>(fb.width()) * Framebuffer::channels;
+    auto rowBytes = static_cast<std::streamsize>(rowFloats * sizeof(float));
+    for (int y = fb.height() - 1; y >= 0; --y) {
+        auto row = fb.data() + static_cast<size_t>(y) * rowFloats;
+        os.write(reinterpret_cast<const char*>(row), rowBytes);
+    }
+    return static_cast<bool>(os);
+}
+
+// Writes the framebuffer in the format given by the file extension (.png, .hdr, .pfm, else P6).
+// Display formats get gamma correction; float formats keep linear values.
+inline bool writeImage(const std::string& path, const Framebuffer& fb,
+                       bool gammaCorrection = true) {
+    bool ok = false;
+    switch (formatFromPath(path)) {
+        case ImageFormat::Png: {
+            auto bytes = fb.toBytes(gammaCorrection);
+            ok = stbi_write_png(path.c_str(), fb.width(), fb.height(), Framebuffer::channels,
+                                bytes.data(), fb.width() * Framebuffer::channels) != 0;
+            break;
+        }
+        case ImageFormat::Hdr:
+            ok = stbi_write_hdr(path.c_str(), fb.width(), fb.height(), Framebuffer::channels,
+                                fb.data()) != 0;
+            break;
+        case ImageFormat::Pfm:
+            ok = writePfm(path, fb);
+            break;
+        default: {
+            std::ofstream os(path, std::ios::binary);
+            ok = writePpm(os, fb, ImageFormat::PpmBinary, gammaCorrection);
+            break;
+        }
+    }
+    if (!ok) std::cerr << "ERROR: could not write image file: " << path << "\n";
+    return ok;
+}
+
+// Writes images on a background thread so rendering can go on. Each write takes its own copy
+// of the framebuffer; a new write first waits for the previous one, so files land in order.
+class AsyncImageWriter {
+  public:
+    ~AsyncImageWriter() { wait(); }
+
+    void write(const std::string& path, Framebuffer fb, bool gammaCorrection = true) {
+        wait();
+        pending = std::async(std::launch::async, [path, fb = std::move(fb), gammaCorrection] {
+            return writeImage(path, fb, gammaCorrection);
+        });
+    }
+
+    bool wait() {
+        if (!pending.valid()) return true;
+        return pending.get();
+    }
+
+  private:
+    std::future<bool> pending;
+};
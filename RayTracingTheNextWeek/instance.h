@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "transform.h"
+
+// A shared object placed in the world by an affine transform. Many instances can point at one
+// object, typically a BVH built once, so memory grows with the unique geometry and the top-level
+// BVH only holds the instances. Both directions of the transform are cached. A moving instance
+// blends between two transforms over [t0, t1] and inverts the blend per ray. A static instance
+// passes the emitters of its object to next-event estimation as instances of their own.
+class Instance : public Hittable {
+  public:
+    Instance(const std::shared_ptr<Hittable>& object, const Affine& objectToWorld)
+        : Instance{object, objectToWorld, objectToWorld, 0, 1} {}
+
+    Instance(const std::shared_ptr<Hittable>& object, const Affine& start, const Affine& end,
+             Real t0, Real t1)
+        : object{object}, t0{t0}, t1{t1} {
+        toWorld[0] = start;
+        toWorld[1] = end;
+
+        // An instance of a static instance is one transform.
+        if (auto inner = std::dynamic_pointer_cast<Instance>(object); inner && !inner->moving()) {
+            this->object = inner->object;
+            toWorld[0] = toWorld[0] * inner->toWorld[0];
+            toWorld[1] = toWorld[1] * inner->toWorld[0];
+        }
+
+        toObject[0] = toWorld[0].inverse();
+        toObject[1] = toWorld[1].inverse();
+        isMoving = std::memcmp(&toWorld[0], &toWorld[1], sizeof(Affine)) != 0;
+    }
+
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override {
+        Affine blendedToWorld, blendedToObject;
+        const auto& [w, o] = transformsAt(r.time, blendedToWorld, blendedToObject);
+
+        Ray local(o.point(r.o), o.vector(r.d), r.time);
+        if (!object->hit(local, tmin, tmax, rec)) return false;
+
+        auto outwardNormal = rec.front ? rec.normal : -rec.normal;
+        rec.pError = w.pointError(rec.p, rec.pError);
+        rec.p = w.point(rec.p);
+        rec.uvScale /= w.lengthScale();
+        rec.setFaceNormal(r, normalized(o.transposedVector(outwardNormal)));
+        return true;
+    }
+
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override {
+        Affine blendedToWorld, blendedToObject;
+        const auto& o = transformsAt(r.time, blendedToWorld, blendedToObject).second;
+        return object->occluded(Ray(o.point(r.o), o.vector(r.d), r.time), tmin, tmax);
+    }
+
+    bool boundingBox(Real time0, Real time1, AABB& outBox) const override {
+        AABB box;
+        if (!object->boundingBox(time0, time1, box)) return false;
+
+        // Points move linearly between the two transforms, so the end boxes bound every time.
+        outBox = toWorld[0].box(box);
+        if (isMoving) outBox = surroundingBox(outBox, toWorld[1].box(box));
+        return true;
+    }
+
+    // Every point of the object moves linearly while the blend of transforms is linear in time,
+    // that is while [time0, time1] lies within [t0, t1], and the object itself moves linearly
+    // or the transform does not move. Other cases get the whole-interval box at both ends.
+    bool motionBounds(Real time0, Real time1, AABB& box0, AABB& box1) const override {
+        AABB object0, object1;
+        if (!object->motionBounds(time0, time1, object0, object1)) return false;
+        bool objectMoving = std::memcmp(&object0, &object1, sizeof(AABB)) != 0;
+        bool linear = !isMoving || (!objectMoving && t0 <= time0 && time1 <= t1);
+        if (!linear) return Hittable::motionBounds(time0, time1, box0, box1);
+
+        Affine blendedToWorld, blendedToObject;
+        box0 = transformsAt(time0, blendedToWorld, blendedToObject).first.box(object0);
+        box1 = transformsAt(time1, blendedToWorld, blendedToObject).first.box(object1);
+        return true;
+    }
+
+    bool interval(const Ray& r, Real& tEnter, Real& tExit) const override {
+        Affine blendedToWorld, blendedToObject;
+        const auto& o = transformsAt(r.time, blendedToWorld, blendedToObject).second;
+        return object->interval(Ray(o.point(r.o), o.vector(r.d), r.time), tEnter, tExit);
+    }
+
+    // Each emitter of the object, placed by this transform. Light samples carry no time, so a
+    // moving instance has none.
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        if (isMoving) return;
+        std::call_once(emittersCollected, [this] {
+            std::vector<const Hittable*> objectEmitters;
+            object->collectEmitters(objectEmitters);
+            for (auto emitter : objectEmitters) {
+                // Shares ownership of the object, which owns the emitter.
+                std::shared_ptr<Hittable> alias(object, const_cast<Hittable*>(emitter));
+                placedEmitters.push_back(std::make_unique<Instance>(alias, toWorld[0]));
+            }
+        });
+        for (const auto& emitter : placedEmitters) {
+            emitters.push_back(emitter.get());
+        }
+    }
+
+    // The object's density of the direction in object space, times the ratio of object to world
+    // solid angle there: |det| / |v|^3 of the inverse transform and v the unit direction mapped.
+    Real pdfValue(const Vec3& origin, const Vec3& direction) const override {
+        const auto& o = toObject[0];
+        auto localDirection = o.vector(direction);
+        auto pdf = object->pdfValue(o.point(origin), localDirection);
+        auto scale = direction.length() / localDirection.length();
+        return pdf * std::abs(o.determinant()) * scale * scale * scale;
+    }
+
+    Vec3 sampleDirection(const Vec3& origin, Real u1, Real u2) const override {
+        return toWorld[0].vector(object->sampleDirection(toObject[0].point(origin), u1, u2));
+    }
+
+    bool moving() const { return isMoving; }
+
+  private:
+    // The cached transforms when static; otherwise the blend at 'time', written to the scratch
+    // arguments.
+    std::pair<const Affine&, const Affine&> transformsAt(Real time, Affine& blendedToWorld,
+                                                         Affine& blendedToObject) const {
+        if (!isMoving) return {toWorld[0], toObject[0]};
+
+        auto s = clamp<Real>((time - t0) / (t1 - t0), 0, 1);
+        blendedToWorld = blend(toWorld[0], toWorld[1], s);
+        blendedToObject = blendedToWorld.inverse();
+        return {blendedToWorld, blendedToObject};
+    }
+
+    std::shared_ptr<Hittable> object;
+    Affine toWorld[2];
+    Affine toObject[2];
+    Real t0;
+    Real t1;
+    bool isMoving;
+    mutable std::once_flag emittersCollected;
+    mutable std::vector<std::unique_ptr<Instance>> placedEmitters;
+};
+
+class Translate : public Instance {
+  public:
+    Translate(const std::shared_ptr<Hittable>& p, const Vec3& offset)
+        : Instance{p, Affine::translation(offset)} {}
+};
+
+class RotateY : public Instance {
+  public:
+    RotateY(const std::shared_ptr<Hittable>& p, Real angle)
+        : Instance{p, Affine::rotation({0, 1, 0}, angle)} {}
+};
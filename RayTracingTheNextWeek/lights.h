@@ -0,0 +1,82 @@
+#pragma once
+
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "stats.h"
+
+inline Real powerHeuristic(Real pdf, Real otherPdf) {
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+// The emitters of a scene, for next-event estimation. Each light sample picks one emitter
+// uniformly and counts only if that emitter is the first surface in its direction, so the
+// density of a direction is that of the emitter it reaches, over the emitter count. Light
+// sampling and BSDF sampling are combined with the power heuristic. Emitters under a static
+// instance are collected in world space. Those that are not (under a moving instance, or in a
+// medium) have density 0 here, so BSDF sampling alone still finds them with full weight.
+class LightList {
+  public:
+    explicit LightList(const Hittable& world) { world.collectEmitters(emitters); }
+
+    bool empty() const { return emitters.empty(); }
+    size_t size() const { return emitters.size(); }
+
+    // Density of a light sample from 'origin' in 'direction' that reaches the surface at 't'
+    // along it: 0 unless the first emitter in that direction lies there.
+    Real pdf(const Vec3& origin, const Vec3& direction, Real t) const {
+        Ray r(origin, direction);
+        const Hittable* first = nullptr;
+        Real firstT = infinity;
+        for (auto emitter : emitters) {
+            HitRecord rec;
+            if (emitter->hitCandidate(r, 0, firstT, rec)) {
+                first = emitter;
+                firstT = rec.t;
+            }
+        }
+        if (!first || firstT > t * (1 + 1e-4)) return 0;
+        return first->pdfValue(origin, direction) / emitters.size();
+    }
+
+    // Light arriving at 'rec' from one sampled emitter point, times the scattering toward
+    // 'incident', with its MIS weight. Zero when the shadow ray is blocked.
+    Vec3 sampleDirect(const Hittable& world, const Ray& incident, const HitRecord& rec,
+                      const Material& material) const {
+        if (emitters.empty()) return {0, 0, 0};
+
+        const auto& emitter = *emitters[gen.randomInt(0, static_cast<int>(size()) - 1)];
+        auto direction = emitter.sampleDirection(rec.p, gen.randomDouble(), gen.randomDouble());
+        Ray shadowRay(rec.spawnOrigin(direction), direction, incident.time);
+
+        HitRecord lightRec;
+        if (!emitter.hit(shadowRay, 0, infinity, lightRec)) return {0, 0, 0};
+
+        Vec3 f;
+        Real bsdfPdf;
+        if (!material.evalScattering(incident, rec, direction, f, bsdfPdf) || f.nearZero()) {
+            return {0, 0, 0};
+        }
+
+        STAT_INC(rays);
+        if (world.occluded(shadowRay, 0, lightRec.t * shadowRayEnd)) return {0, 0, 0};
+
+        auto lightPdf = emitter.pdfValue(rec.p, direction) / emitters.size();
+        if (lightPdf <= 0) return {0, 0, 0};
+
+        auto emitted = lightRec.material().emitted(lightRec.u, lightRec.v, lightRec.p);
+        return f * emitted * (powerHeuristic(lightPdf, bsdfPdf) / lightPdf);
+    }
+
+    // MIS weight of emission at 't' along a BSDF sample of density bsdfPdf taken at 'origin'.
+    // bsdfPdf is 0 when that vertex did not sample lights, and the emission counts fully.
+    Real emissionWeight(const Vec3& origin, const Vec3& direction, Real t, Real bsdfPdf) const {
+        if (bsdfPdf <= 0) return 1;
+        return powerHeuristic(bsdfPdf, pdf(origin, direction, t));
+    }
+
+  private:
+    std::vector<const Hittable*> emitters;
+};
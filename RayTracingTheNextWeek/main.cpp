@@ -1,216 +1,97 @@
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "rtweekend.h"
-#include "color.h"
-#include "hittable.h"
-#include "hittable_list.h"
-#include "camera.h"
-#include "box.h"
-#include "constant_medium.h"
+#include "scenes.h"
+#include "scene_file.h"
 #include "bvh.h"
+#include "render.h"
+#include "denoise.h"
+#include "image_io.h"
+#include "stats.h"
 
 using namespace std;
 
-Vec3 rayColor(const Ray& r, const Vec3& backgroundColor, const HittableList& world, int maxDepth) {
-    if (maxDepth <= 0) return {0, 0, 0};
-
-    HitRecord rec;
-    if (!world.hit(r, 0.001, infinity, rec)) return backgroundColor;
-
-    Ray scattered;
-    Vec3 attenuation;
-    Vec3 emitted = rec.material->emitted(rec.u, rec.v, rec.p);
-    if (rec.material->scatter(r, rec, attenuation, scattered)) {
-        return emitted + attenuation * rayColor(scattered, backgroundColor, world, maxDepth - 1);
-    } else {
-        return emitted;
-    }
-}
-
-HittableList final_scene() {
-    HittableList objects;
-
-    HittableList boxes1;
-    auto ground = make_shared<Lambertian>(Vec3(0.48, 0.83, 0.53));
-
-    const int boxes_per_side = 20;
-    for (int i = 0; i < boxes_per_side; i++) {
-        for (int j = 0; j < boxes_per_side; j++) {
-            auto w = 100.0;
-            auto x0 = -1000.0 + i * w;
-            auto z0 = -1000.0 + j * w;
-            auto y0 = 0.0;
-            auto x1 = x0 + w;
-            auto y1 = gen.randomDouble(1, 101);
-            auto z1 = z0 + w;
-
-            boxes1.add(make_shared<Box>(Vec3(x0, y0, z0), Vec3(x1, y1, z1), ground));
+// Usage: rt2 [--bvh-cache dir] [--denoise] [output [scene]]. The extension picks the format
+// (.png, .hdr, .pfm, else binary PPM); "-" writes binary PPM to stdout. The scene is one of
+// sceneNames(), "final" by default, or a scene file (scene_file.h). With a BVH cache directory,
+// BVHs built once are loaded from there on later runs. --denoise renders feature buffers too
+// and writes the denoised image (denoise.h).
+int main(int argc, char* argv[]) {
+    std::vector<std::string> args;
+    bool denoiseOutput = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--bvh-cache" && i + 1 < argc) {
+            bvhCache.setDirectory(argv[++i]);
+        } else if (arg == "--denoise") {
+            denoiseOutput = true;
+        } else {
+            args.push_back(arg);
         }
     }
-
-    objects.add(make_shared<BvhNode>(boxes1, 0.0, 1.0));
-
-    auto light = make_shared<DiffuseLight>(Vec3(7, 7, 7));
-    objects.add(make_shared<XZRect>(123, 423, 147, 412, 554, light));
-
-    auto center1 = Vec3(400, 400, 200);
-    auto center2 = center1 + Vec3(30, 0, 0);
-    auto moving_sphere_material = make_shared<Lambertian>(Vec3(0.7, 0.3, 0.1));
-    objects.add(make_shared<MovingSphere>(center1, center2, 0, 1, 50, moving_sphere_material));
-
-    objects.add(make_shared<Sphere>(Vec3(260, 150, 45), 50, make_shared<Dielectric>(1.5)));
-    objects.add(
-        make_shared<Sphere>(Vec3(0, 150, 145), 50, make_shared<Metal>(Vec3(0.8, 0.8, 0.9), 1.0)));
-
-    auto boundary = make_shared<Sphere>(Vec3(360, 150, 145), 70, make_shared<Dielectric>(1.5));
-    objects.add(boundary);
-    objects.add(make_shared<ConstantMedium>(boundary, 0.2, Vec3(0.2, 0.4, 0.9)));
-    boundary = make_shared<Sphere>(Vec3(0, 0, 0), 5000, make_shared<Dielectric>(1.5));
-    objects.add(make_shared<ConstantMedium>(boundary, .0001, Vec3(1, 1, 1)));
-
-    auto emat = make_shared<Lambertian>(make_shared<ImageTexture>("earthmap.jpg"));
-    objects.add(make_shared<Sphere>(Vec3(400, 200, 400), 100, emat));
-    auto pertext = make_shared<NoiseTexture>(0.1);
-    objects.add(make_shared<Sphere>(Vec3(220, 280, 300), 80, make_shared<Lambertian>(pertext)));
-
-    HittableList lotsOfSpheres;
-    auto white = make_shared<Lambertian>(Vec3(0.73, 0.73, 0.73));
-    int ns = 1000;
-    for (int j = 0; j < ns; j++) {
-        lotsOfSpheres.add(make_shared<Sphere>(gen.randomVec3(0, 165), 10, white));
+    std::string outputPath = args.size() > 0 ? args[0] : "image.png";
+    std::string sceneName = args.size() > 1 ? args[1] : "final";
+
+    uint64_t seed = 0;
+    SceneConfig config;
+    if (auto id = sceneId(sceneName)) {
+        config = makeScene(id, seed);
+    } else if (!loadSceneFile(sceneName, config, seed)) {
+        cerr << "ERROR: unknown scene: " << sceneName << '\n';
+        return 1;
     }
 
-    objects.add(
-        make_shared<Translate>(
-            make_shared<RotateY>(
-                make_shared<BvhNode>(lotsOfSpheres, 0.0, 1.0), 15
-            ), 
-            Vec3(-100, 270, 395)
-        )
-    );
-
-    return objects;
-}
-
-int main() {
-    // Image
-    double aspectRatio = 16.0 / 9.0;
-    int imageWidth = 400;
-    int imageHeight = static_cast<int>(imageWidth / aspectRatio);
-    int samplesPerPixel = 32;
-    int maxDepth = 32;
-
-    // Objects
-    HittableList world;
-    Vec3 backgroundColor = {0, 0, 0};
-
-    // Camera
-    Vec3 lookFrom;
-    Vec3 lookAt = {0, 0, 0};
-    Vec3 vup = {0, 1, 0};
-    double vFov = 40.0;
-    auto distToFocus = 10.0;
-    auto aperture = 0.0;
-    const auto& [t0, t1] = std::make_tuple(0.0, 1.0);
-
-    switch (8) {
-        case 1:
-            world = randomScene();
-            lookFrom = {13, 2, 3};
-            lookAt = {0, 0, 0};
-            vFov = 20.0;
-            aperture = 0.1;
-            backgroundColor = {0.7, 0.8, 1.0};
-            break;
-
-        case 2:
-            world = twoSpheresScene();
-            lookFrom = {13, 2, 3};
-            lookAt = {0, 0, 0};
-            vFov = 20.0;
-            backgroundColor = {0.7, 0.8, 1.0};
-            break;
-
-        case 3:
-            world = twoPerlinSpheres();
-            lookFrom = {13, 2, 3};
-            lookAt = {0, 0, 0};
-            vFov = 20.0;
-            backgroundColor = {0.7, 0.8, 1.0};
-            break;
-
-        case 4:
-            world = earthScene();
-            lookFrom = {13, 2, 3};
-            lookAt = {0, 0, 0};
-            vFov = 20.0;
-            backgroundColor = {0.7, 0.8, 1.0};
-            break;
-
-        case 5:
-            world = simpleLightScene();
-            lookFrom = {26, 3, 6};
-            lookAt = {0, 2, 0};
-            samplesPerPixel = 200;
-            vFov = 20.0;
-            backgroundColor = {0.0, 0.0, 0.0};
-            break;
-
-        case 6:
-            world = cornellBox();
-            aspectRatio = 1.0;
-            imageWidth = 600;
-            imageHeight = static_cast<int>(imageWidth / aspectRatio);
-            samplesPerPixel = 200;
-            backgroundColor = {0, 0, 0};
-            lookFrom = {278, 278, -800};
-            lookAt = {278, 278, 0};
-            vFov = 40.0;
-            break;
-
-        case 7:
-            world = cornellSmokeScene();
-            aspectRatio = 1.0;
-            imageWidth = 600;
-            imageHeight = static_cast<int>(imageWidth / aspectRatio);
-            samplesPerPixel = 200;
-            backgroundColor = {0, 0, 0};
-            lookFrom = {278, 278, -800};
-            lookAt = {278, 278, 0};
-            vFov = 40.0;
-            break;
-
-        case 8:
-            world = final_scene();
-            aspectRatio = 1.0;
-            imageWidth = 600;
-            imageHeight = static_cast<int>(imageWidth / aspectRatio);
-            samplesPerPixel = 1000;
-            backgroundColor = {0, 0, 0};
-            lookFrom = {478, 278, -600};
-            lookAt = {278, 278, 0};
-            vFov = 40.0;
-            break;
+    // The whole scene goes under one top-level BVH; the layout is chosen by defaultBvhLayout.
+    auto scene = makeBvh(config.world, config.t0, config.t1);
+    if (auto flat = dynamic_cast<const FlatBvh*>(scene.get())) {
+        cerr << "BVH: " << flat->buildStats() << '\n';
+    } else if (auto wide = dynamic_cast<const Bvh4*>(scene.get())) {
+        cerr << "BVH4: " << wide->buildStats() << '\n';
     }
 
-    Camera cam{lookFrom, lookAt, vup, vFov, aspectRatio, aperture, distToFocus, t0, t1};
+    auto cam = config.camera();
 
     // Render
-    cout << "P3\n" << imageWidth << ' ' << imageHeight << "\n255\n";
-
-    for (int j = imageHeight - 1; j >= 0; --j) {
-        cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-        for (int i = 0; i < imageWidth; ++i) {
-            Vec3 color(0, 0, 0);
-            for (int s = 0; s < samplesPerPixel; ++s) {
-                auto u = (i + gen.randomDouble()) / imageWidth;
-                auto v = (j + gen.randomDouble()) / imageHeight;
-                Ray r = cam.getRay(u, v);
-                color += rayColor(r, backgroundColor, world, maxDepth);
-            }
-
-            writeColor(cout, color, samplesPerPixel, true);
-        }
+    RenderSettings settings;
+    settings.imageWidth = config.imageWidth;
+    settings.imageHeight = config.imageHeight();
+    settings.samplesPerPixel = config.samplesPerPixel;
+    settings.maxDepth = 32;
+    settings.backgroundColor = config.backgroundColor;
+    settings.seed = seed;
+    settings.integrator = IntegratorType::Wavefront;
+    settings.progressive = true;
+    settings.samplesPerPass = 32;
+    settings.errorThreshold = 0.01;
+
+    // Every pass rewrites a preview in the background, so long renders can be inspected and
+    // cut short.
+    AsyncImageWriter previewWriter;
+    auto writePreview = [&](const Framebuffer& image, const PassInfo& info) {
+        cerr << "\rPass " << info.pass << ": " << info.maxSamplesPerPixel << " spp, "
+             << info.activePixels << " pixels active, " << info.seconds << " s\n";
+        previewWriter.write("preview.png", image);
+    };
+
+    std::vector<float> traversalCost;
+    FeatureBuffers features;
+    auto image = Renderer(*scene, cam, settings)
+                     .render(writePreview, &traversalCost, denoiseOutput ? &features : nullptr);
+    previewWriter.wait();
+    if (denoiseOutput) image = denoise(image, features);
+
+#if RT_STATS
+    cerr << "\nStats: " << collectRayStats() << '\n';
+    auto heatmap = heatmapImage(traversalCost, settings.imageWidth, settings.imageHeight);
+    writeImage("heatmap.png", heatmap, false);
+#endif
+
+    if (outputPath == "-") {
+        writePpm(cout, image, ImageFormat::PpmBinary, true);
+    } else {
+        writeImage(outputPath, image);
     }
     cerr << "\nDone.\n";
-}
\ No newline at end of file
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Read-only bytes of a whole file. Where the OS supports it the file is memory-mapped, so
+// opening costs nothing until pages are touched and processes reading one file share its pages;
+// elsewhere the file is read into memory. The data is at least 8-byte aligned either way.
+class MappedFile {
+  public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Returns false if the file cannot be read.
+    bool open(const std::string& path) {
+        close();
+#if defined(__unix__) || defined(__APPLE__)
+        auto fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info {};
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return false;
+        }
+        length = static_cast<size_t>(info.st_size);
+        if (length > 0) {
+            auto* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                length = 0;
+                return false;
+            }
+            mapping = p;
+            bytes = static_cast<const uint8_t*>(p);
+        }
+        ::close(fd);
+        return true;
+#else
+        auto file = std::fopen(path.c_str(), "rb");
+        if (!file) return false;
+        std::fseek(file, 0, SEEK_END);
+        auto size = std::ftell(file);
+        std::fseek(file, 0, SEEK_SET);
+        buffer.resize(size > 0 ? static_cast<size_t>(size + 7) / 8 : 0);
+        length = size > 0 ? static_cast<size_t>(size) : 0;
+        auto ok = std::fread(buffer.data(), 1, length, file) == length;
+        std::fclose(file);
+        if (!ok) {
+            close();
+            return false;
+        }
+        bytes = reinterpret_cast<const uint8_t*>(buffer.data());
+        return true;
+#endif
+    }
+
+    void close() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapping) munmap(mapping, length);
+        mapping = nullptr;
+#else
+        buffer = {};
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+
+  private:
+    const uint8_t* bytes = nullptr;
+    size_t length = 0;
+#if defined(__unix__) || defined(__APPLE__)
+    void* mapping = nullptr;
+#else
+    std::vector<uint64_t> buffer;
+#endif
+};
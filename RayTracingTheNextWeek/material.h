@@ -3,109 +3,187 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "texture.h"
+#include "stats.h"
 
 struct HitRecord;
 
 static Vec3 reflect(const Vec3& incident, const Vec3& normal);
-static Vec3 refract(const Vec3& incidentDirection, const Vec3& normal, double relativeIndex);
+static Vec3 refract(const Vec3& incidentDirection, const Vec3& normal, Real relativeIndex);
+
+// Concrete material types, so batched shading can sort hits by type and call each type's
+// scatter() without virtual dispatch. Other covers materials defined outside this file.
+enum class MaterialKind : uint8_t {
+    Lambertian,
+    Metal,
+    Dielectric,
+    DiffuseLight,
+    Isotropic,
+    Other,
+};
+
+constexpr int materialKindCount = static_cast<int>(MaterialKind::Other) + 1;
+
+// Cone of the ray scattered where 'cone' hit a material of 'kind', 'distance' from its origin.
+// Mirrors and glass keep the spread, as if the surface were flat; other materials scatter into
+// a wide lobe, and the textures seen along it may as well come from coarse mip levels.
+inline RayCone scatteredCone(const RayCone& cone, Real distance, MaterialKind kind) {
+    constexpr Real diffuseSpread = 0.125;
+    auto specular = kind == MaterialKind::Metal || kind == MaterialKind::Dielectric;
+    return {cone.widthAt(distance), specular ? cone.spread : std::max(cone.spread, diffuseSpread)};
+}
 
 struct Material {
     virtual bool scatter(const Ray& incident, const HitRecord& rec, Vec3& attenuation,
                          Ray& scattered) const = 0;
-    virtual Vec3 emitted(double u, double v, const Vec3& p) const { return {0, 0, 0}; }
+    virtual Vec3 emitted(Real u, Real v, const Vec3& p) const { return {0, 0, 0}; }
+    virtual MaterialKind kind() const { return MaterialKind::Other; }
+    virtual bool isEmissive() const { return false; }
+
+    // Fraction of light reflected at 'rec', regardless of direction: the albedo feature buffer
+    // of the denoiser. Materials that tint nothing, glass and lights among them, return white.
+    virtual Vec3 albedoAt(const HitRecord& rec) const { return {1, 1, 1}; }
+
+    // For light sampling: 'f' is the scattering from 'incident' into 'direction', cosine
+    // included, and 'pdf' the solid-angle density of scatter() picking that direction. Returns
+    // false for materials whose scattering is (near) specular; those never sample lights.
+    virtual bool evalScattering(const Ray& incident, const HitRecord& rec, const Vec3& direction,
+                                Vec3& f, Real& pdf) const {
+        return false;
+    }
 };
 
-struct Lambertian : public Material {
+struct Lambertian final : public Material {
     Lambertian(const Vec3& color) : Lambertian{std::make_shared<SolidColor>(color)} {}
     Lambertian(std::shared_ptr<Texture> texture) : albedo{std::move(texture)} {}
 
     bool scatter(const Ray& incident, const HitRecord& rec, Vec3& attenuation,
                  Ray& scattered) const override {
+        STAT_INC(scatters);
         scattered.time = incident.time;
-        scattered.o = rec.p;
         scattered.d = rec.normal + gen.randomVec3OnUnitSphere();
         if (scattered.d.nearZero()) scattered.d = rec.normal;
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        scattered.o = rec.spawnOrigin(scattered.d);
+        attenuation = albedo->filtered(rec.u, rec.v, rec.p, rec.uvFootprint);
+        return true;
+    }
+
+    MaterialKind kind() const override { return MaterialKind::Lambertian; }
+
+    Vec3 albedoAt(const HitRecord& rec) const override {
+        return albedo->filtered(rec.u, rec.v, rec.p, rec.uvFootprint);
+    }
+
+    // scatter() picks normal + a point on the unit sphere, which is cosine-distributed.
+    bool evalScattering(const Ray& incident, const HitRecord& rec, const Vec3& direction, Vec3& f,
+                        Real& pdf) const override {
+        auto cosine = std::max<Real>(0, dot(rec.normal, normalized(direction)));
+        pdf = cosine / pi;
+        f = albedo->filtered(rec.u, rec.v, rec.p, rec.uvFootprint) * pdf;
         return true;
     }
 
     std::shared_ptr<Texture> albedo;
 };
 
-struct Metal : public Material {
-    Metal(const Vec3& albedo, double roughness = 0.0)
-        : albedo(albedo), roughness(clamp(roughness, 0.0, 1.0)) {}
+struct Metal final : public Material {
+    Metal(const Vec3& albedo, Real roughness = 0.0)
+        : albedo(albedo), roughness(clamp<Real>(roughness, 0, 1)) {}
 
     bool scatter(const Ray& incident, const HitRecord& rec, Vec3& attenuation,
                  Ray& scattered) const override {
+        STAT_INC(scatters);
         scattered.time = incident.time;
-        scattered.o = rec.p;
         scattered.d = reflect(incident.d, rec.normal) + roughness * gen.randomVec3OnUnitSphere();
+        scattered.o = rec.spawnOrigin(scattered.d);
         attenuation = albedo;
         return dot(scattered.d, rec.normal) > 0;
     }
 
+    MaterialKind kind() const override { return MaterialKind::Metal; }
+    Vec3 albedoAt(const HitRecord& rec) const override { return albedo; }
+
     Vec3 albedo;
-    double roughness;
+    Real roughness;
 };
 
-struct Dielectric : public Material {
-    Dielectric(double refractiveIndex) : refractiveIndex(refractiveIndex) {}
+struct Dielectric final : public Material {
+    Dielectric(Real refractiveIndex) : refractiveIndex(refractiveIndex) {}
 
     bool scatter(const Ray& incident, const HitRecord& rec, Vec3& attenuation,
                  Ray& scattered) const override {
-        double airIndex = 1.0;
-        double relativeIndex = rec.front ? airIndex / refractiveIndex : refractiveIndex / airIndex;
+        STAT_INC(scatters);
+        Real airIndex = 1.0;
+        Real relativeIndex = rec.front ? airIndex / refractiveIndex : refractiveIndex / airIndex;
 
         const auto& I = normalized(incident.d);
         const auto& N = normalized(rec.normal);
-        double costheta = std::min(dot(-I, N), 1.0);
-        double sintheta = std::sqrt(1 - costheta * costheta);
+        Real costheta = std::min<Real>(dot(-I, N), 1);
+        Real sintheta = std::sqrt(1 - costheta * costheta);
 
         scattered.time = incident.time;
-        scattered.o = rec.p;
         bool totalReflection = relativeIndex * sintheta > 1.0;
         scattered.d = totalReflection || reflectance(costheta, relativeIndex) > gen.randomDouble()
                           ? reflect(I, N)
                           : refract(I, N, relativeIndex);
+        scattered.o = rec.spawnOrigin(scattered.d);
         attenuation = Vec3(1, 1, 1);
         return true;
     }
 
-    static double reflectance(double cosine, double refractiveIndex) {
+    MaterialKind kind() const override { return MaterialKind::Dielectric; }
+
+    static Real reflectance(Real cosine, Real refractiveIndex) {
         auto r0 = (1 - refractiveIndex) / (1 + refractiveIndex);
         r0 = r0 * r0;
         return r0 + (1 - r0) * std::pow(1 - cosine, 5);
     }
 
-    double refractiveIndex;
+    Real refractiveIndex;
 };
 
-class DiffuseLight : public Material {
+class DiffuseLight final : public Material {
   public:
     DiffuseLight(std::shared_ptr<Texture> emit) : emit{std::move(emit)} {}
     DiffuseLight(const Vec3& color) : emit(std::make_shared<SolidColor>(color)) {}
 
     bool scatter(const Ray& incident, const HitRecord& rec, Vec3& attenuation,
                  Ray& scattered) const override {
+        STAT_INC(scatters);
         return false;
     }
 
-    Vec3 emitted(double u, double v, const Vec3& p) const override { return emit->value(u, v, p); }
+    Vec3 emitted(Real u, Real v, const Vec3& p) const override { return emit->value(u, v, p); }
+
+    MaterialKind kind() const override { return MaterialKind::DiffuseLight; }
+    bool isEmissive() const override { return true; }
 
   private:
     std::shared_ptr<Texture> emit;
 };
 
-class Isotropic : public Material {
+class Isotropic final : public Material {
   public:
     Isotropic(const Vec3& color) : albedo{std::make_shared<SolidColor>(color)} {}
     Isotropic(const std::shared_ptr<Texture>& a) : albedo{a} {}
 
     bool scatter(const Ray& incident, const HitRecord& rec, Vec3& attenuation,
                  Ray& scattered) const override {
+        STAT_INC(scatters);
         scattered = Ray(rec.p, gen.randomVec3OnUnitSphere(), incident.time);
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        attenuation = albedo->filtered(rec.u, rec.v, rec.p, rec.uvFootprint);
+        return true;
+    }
+
+    MaterialKind kind() const override { return MaterialKind::Isotropic; }
+
+    Vec3 albedoAt(const HitRecord& rec) const override {
+        return albedo->filtered(rec.u, rec.v, rec.p, rec.uvFootprint);
+    }
+
+    bool evalScattering(const Ray& incident, const HitRecord& rec, const Vec3& direction, Vec3& f,
+                        Real& pdf) const override {
+        pdf = 1 / (4 * pi);
+        f = albedo->filtered(rec.u, rec.v, rec.p, rec.uvFootprint) * pdf;
         return true;
     }
 
@@ -113,16 +191,20 @@ class Isotropic : public Material {
     std::shared_ptr<Texture> albedo;
 };
 
+inline bool MaterialTable::emits(uint32_t id) const {
+    return (*this)[id].isEmissive();
+}
+
 static Vec3 reflect(const Vec3& incident, const Vec3& normal) {
     const auto& d = normalized(incident);
     const auto& n = normalized(normal);
     return d - 2 * dot(d, n) * n;
 }
 
-static Vec3 refract(const Vec3& incidentDirection, const Vec3& normal, double relativeIndex) {
+static Vec3 refract(const Vec3& incidentDirection, const Vec3& normal, Real relativeIndex) {
     const auto& I = normalized(incidentDirection);
     const auto& N = normalized(normal);
-    double IdotN = std::min(dot(I, N), 1.0);
+    Real IdotN = std::min<Real>(dot(I, N), 1);
     auto tangentPart = relativeIndex * (I - IdotN * N);
     auto normalPart = -N * std::sqrt(1 - relativeIndex * relativeIndex * (1 - IdotN * IdotN));
     return tangentPart + normalPart;
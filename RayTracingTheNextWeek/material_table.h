@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+struct Material;
+
+// Owns every material in the scene. Hit records refer to materials by their 32-bit id instead
+// of holding a shared_ptr, so recording a hit never touches a reference count. Materials are
+// registered while the scene is built and only read while rendering.
+class MaterialTable {
+  public:
+    uint32_t add(const std::shared_ptr<Material>& material) {
+        auto [it, inserted] = ids.try_emplace(material.get(), static_cast<uint32_t>(size()));
+        if (inserted) materials.push_back(material);
+        return it->second;
+    }
+
+    // Releases every material, and the textures only they hold, before the next scene is built.
+    // Ids handed out earlier become invalid, so no hittable of the old scene may be used after.
+    void clear() {
+        materials.clear();
+        ids.clear();
+    }
+
+    const Material& operator[](uint32_t id) const { return *materials[id]; }
+
+    // Whether material 'id' emits light. Defined in material.h, where Material is complete.
+    bool emits(uint32_t id) const;
+
+    size_t size() const { return materials.size(); }
+
+  private:
+    std::vector<std::shared_ptr<Material>> materials;
+    std::unordered_map<const Material*, uint32_t> ids;
+};
+
+inline MaterialTable materialTable;
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "aabb.h"
+#include "bvh_builder.h"
+#include "bvh_cache.h"
+#include "stats.h"
+
+// Vertex attributes shared by all triangles of a mesh, one array per component. Triangles index
+// positions, normals and UVs separately (as OBJ files do); normal and UV indices are -1 when the
+// triangle has none.
+struct MeshData {
+    std::vector<float> px, py, pz;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> u, v;
+
+    std::vector<uint32_t> positionIndices;  // 3 per triangle
+    std::vector<int32_t> normalIndices;     // 3 per triangle
+    std::vector<int32_t> uvIndices;         // 3 per triangle
+
+    size_t triangleCount() const { return positionIndices.size() / 3; }
+    size_t vertexCount() const { return px.size(); }
+
+    Vec3 position(uint32_t i) const { return {px[i], py[i], pz[i]}; }
+    Vec3 normal(int32_t i) const { return {nx[i], ny[i], nz[i]}; }
+};
+
+// Per-ray constants of the watertight ray/triangle test of Woop, Benthin and Wald (2013). The
+// ray is sheared so that it runs along +z; triangles are then tested in 2D with edge functions
+// that are exact on shared edges, so rays never slip between neighbouring triangles.
+struct WatertightRay {
+    explicit WatertightRay(const Ray& r) : o{r.o} {
+        auto ax = std::abs(r.d.x());
+        auto ay = std::abs(r.d.y());
+        auto az = std::abs(r.d.z());
+        kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (r.d[kz] < 0) std::swap(kx, ky);
+
+        sx = r.d[kx] / r.d[kz];
+        sy = r.d[ky] / r.d[kz];
+        sz = 1 / r.d[kz];
+    }
+
+    // On a hit inside (tmin, tmax) sets t and the barycentric weights of v1 and v2.
+    bool intersect(const Vec3& v0, const Vec3& v1, const Vec3& v2, Real tmin, Real tmax,
+                   Real& t, Real& b1, Real& b2) const {
+        auto a = v0 - o;
+        auto b = v1 - o;
+        auto c = v2 - o;
+
+        auto axs = a[kx] - sx * a[kz];
+        auto ays = a[ky] - sy * a[kz];
+        auto bxs = b[kx] - sx * b[kz];
+        auto bys = b[ky] - sy * b[kz];
+        auto cxs = c[kx] - sx * c[kz];
+        auto cys = c[ky] - sy * c[kz];
+
+        auto e0 = cxs * bys - cys * bxs;
+        auto e1 = axs * cys - ays * cxs;
+        auto e2 = bxs * ays - bys * axs;
+        if constexpr (std::is_same_v<Real, float>) {
+            // A zero edge function may be float rounding; such rays are decided in double, as
+            // in the paper, so they cannot slip through the shared edge.
+            if (e0 == 0 || e1 == 0 || e2 == 0) {
+                auto edge = [](double px, double py, double qx, double qy) {
+                    return static_cast<Real>(px * qy - py * qx);
+                };
+                e0 = edge(cxs, cys, bxs, bys);
+                e1 = edge(axs, ays, cxs, cys);
+                e2 = edge(bxs, bys, axs, ays);
+            }
+        }
+        if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) return false;
+
+        auto det = e0 + e1 + e2;
+        if (det == 0) return false;
+
+        auto scaledT = e0 * sz * a[kz] + e1 * sz * b[kz] + e2 * sz * c[kz];
+        auto hitT = scaledT / det;
+        if (hitT <= tmin || hitT >= tmax) return false;
+
+        t = hitT;
+        b1 = e1 / det;
+        b2 = e2 / det;
+        return true;
+    }
+
+    Vec3 o;
+    int kx, ky, kz;
+    Real sx, sy, sz;
+};
+
+// Triangle mesh with its own BVH, built once by the SAH builder. The mesh owns its data and
+// stores the triangles in BVH leaf order, so a leaf's triangles are contiguous; place copies
+// with Instance rather than building a second mesh. UVs are interpolated from the mesh's UVs
+// when it has them and are the barycentric coordinates otherwise.
+class TriangleMesh : public Hittable {
+  public:
+    static const int maxPrimitivesInLeaf = 4;
+
+  public:
+    TriangleMesh(MeshData data, const std::shared_ptr<Material>& material);
+
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override;
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override;
+
+    bool boundingBox(Real time0, Real time1, AABB& outBox) const override {
+        outBox = box;
+        return !nodes.empty();
+    }
+
+    const MeshData& data() const { return mesh; }
+    const BvhBuildStats& buildStats() const { return stats; }
+
+  private:
+    void vertices(uint32_t triangle, Vec3& v0, Vec3& v1, Vec3& v2) const {
+        const auto* index = &mesh.positionIndices[3 * triangle];
+        v0 = mesh.position(index[0]);
+        v1 = mesh.position(index[1]);
+        v2 = mesh.position(index[2]);
+    }
+
+    void fillHit(const Ray& r, uint32_t triangle, Real t, Real b1, Real b2,
+                 HitRecord& rec) const;
+
+    MeshData mesh;
+    uint32_t materialId;
+    std::vector<LinearBvhNode> nodes;
+    AABB box;
+    BvhBuildStats stats;
+};
+
+inline TriangleMesh::TriangleMesh(MeshData data, const std::shared_ptr<Material>& material)
+    : mesh{std::move(data)}, materialId{materialTable.add(material)} {
+    auto count = mesh.triangleCount();
+    std::vector<BvhBuildPrimitive> prims(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        Vec3 v0, v1, v2;
+        vertices(i, v0, v1, v2);
+        // Padded like the rects, so axis-aligned triangles still have a volume.
+        Vec3 pad(0.0001, 0.0001, 0.0001);
+        auto& p = prims[i];
+        p.box = AABB(Vec3(std::min({v0.x(), v1.x(), v2.x()}), std::min({v0.y(), v1.y(), v2.y()}),
+                          std::min({v0.z(), v1.z(), v2.z()})) - pad,
+                     Vec3(std::max({v0.x(), v1.x(), v2.x()}), std::max({v0.y(), v1.y(), v2.y()}),
+                          std::max({v0.z(), v1.z(), v2.z()})) + pad);
+        p.centroid = p.box.centroid();
+        p.index = i;
+    }
+
+    stats = buildBvh(maxPrimitivesInLeaf, prims, nodes);
+    if (nodes.empty()) return;
+    box = nodes.front().bounds();
+
+    // Reorder the triangles into leaf order.
+    auto reorder = [&](auto& indices) {
+        if (indices.empty()) return;
+        auto old = indices;
+        for (size_t i = 0; i < count; ++i) {
+            std::copy_n(&old[3 * prims[i].index], 3, &indices[3 * i]);
+        }
+    };
+    reorder(mesh.positionIndices);
+    reorder(mesh.normalIndices);
+    reorder(mesh.uvIndices);
+}
+
+inline bool TriangleMesh::hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const {
+    if (nodes.empty()) return false;
+
+    PreparedRay pr(r);
+    WatertightRay wr(r);
+
+    uint32_t stack[SahBvhBuilder::maxDepth];
+    int stackSize = 0;
+    uint32_t current = 0;
+
+    bool found = false;
+    uint32_t closest = 0;
+    Real closestB1 = 0, closestB2 = 0;
+
+    while (true) {
+        const auto& node = nodes[current];
+        STAT_INC(nodeVisits);
+        if (node.hit(r.o, pr.invD, pr.dirIsNeg, tmin, tmax)) {
+            if (node.primitiveCount > 0) {
+                STAT_ADD(primitiveTests, node.primitiveCount);
+                for (uint32_t i = 0; i < node.primitiveCount; ++i) {
+                    auto triangle = node.primitiveOffset + i;
+                    Vec3 v0, v1, v2;
+                    vertices(triangle, v0, v1, v2);
+                    Real t, b1, b2;
+                    if (wr.intersect(v0, v1, v2, tmin, tmax, t, b1, b2)) {
+                        STAT_INC(primitiveHits);
+                        found = true;
+                        closest = triangle;
+                        closestB1 = b1;
+                        closestB2 = b2;
+                        tmax = t;
+                    }
+                }
+                if (stackSize == 0) break;
+                current = stack[--stackSize];
+            } else if (pr.dirIsNeg[node.axis]) {
+                stack[stackSize++] = current + 1;
+                current = node.secondChild;
+            } else {
+                stack[stackSize++] = node.secondChild;
+                current = current + 1;
+            }
+        } else {
+            if (stackSize == 0) break;
+            current = stack[--stackSize];
+        }
+    }
+
+    if (!found) return false;
+    fillHit(r, closest, tmax, closestB1, closestB2, rec);
+    return true;
+}
+
+// As FlatBvh::occluded(): children in array order, done at the first triangle hit.
+inline bool TriangleMesh::occluded(const Ray& r, Real tmin, Real tmax) const {
+    if (nodes.empty()) return false;
+
+    PreparedRay pr(r);
+    WatertightRay wr(r);
+    uint32_t stack[SahBvhBuilder::maxDepth];
+    int stackSize = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const auto& node = nodes[current];
+        STAT_INC(nodeVisits);
+        if (node.hit(r.o, pr.invD, pr.dirIsNeg, tmin, tmax)) {
+            if (node.primitiveCount == 0) {
+                stack[stackSize++] = node.secondChild;
+                current = current + 1;
+                continue;
+            }
+            for (uint32_t i = 0; i < node.primitiveCount; ++i) {
+                STAT_INC(primitiveTests);
+                Vec3 v0, v1, v2;
+                vertices(node.primitiveOffset + i, v0, v1, v2);
+                Real t, b1, b2;
+                if (wr.intersect(v0, v1, v2, tmin, tmax, t, b1, b2)) {
+                    STAT_INC(primitiveHits);
+                    return true;
+                }
+            }
+        }
+        if (stackSize == 0) return false;
+        current = stack[--stackSize];
+    }
+}
+
+inline void TriangleMesh::fillHit(const Ray& r, uint32_t triangle, Real t, Real b1, Real b2,
+                                  HitRecord& rec) const {
+    auto b0 = 1 - b1 - b2;
+    Vec3 v0, v1, v2;
+    vertices(triangle, v0, v1, v2);
+
+    rec.t = t;
+    rec.p = b0 * v0 + b1 * v1 + b2 * v2;
+    rec.pError = 8 * std::numeric_limits<Real>::epsilon() *
+                 std::max({v0.maxAbs(), v1.maxAbs(), v2.maxAbs()});
+    rec.materialId = materialId;
+
+    // Shading normals when the mesh has them, else the geometric normal (counterclockwise
+    // winding faces outward).
+    const auto* n = mesh.normalIndices.empty() ? nullptr : &mesh.normalIndices[3 * triangle];
+    if (n && n[0] >= 0 && n[1] >= 0 && n[2] >= 0) {
+        auto shading = b0 * mesh.normal(n[0]) + b1 * mesh.normal(n[1]) + b2 * mesh.normal(n[2]);
+        rec.setFaceNormal(r, normalized(shading));
+    } else {
+        rec.setFaceNormal(r, normalized(cross(v1 - v0, v2 - v0)));
+    }
+
+    const auto* uv = mesh.uvIndices.empty() ? nullptr : &mesh.uvIndices[3 * triangle];
+    Real uvArea = 1;  // twice the uv area; barycentric uvs span half the unit square
+    if (uv && uv[0] >= 0 && uv[1] >= 0 && uv[2] >= 0) {
+        rec.u = b0 * mesh.u[uv[0]] + b1 * mesh.u[uv[1]] + b2 * mesh.u[uv[2]];
+        rec.v = b0 * mesh.v[uv[0]] + b1 * mesh.v[uv[1]] + b2 * mesh.v[uv[2]];
+        auto du1 = mesh.u[uv[1]] - mesh.u[uv[0]], dv1 = mesh.v[uv[1]] - mesh.v[uv[0]];
+        auto du2 = mesh.u[uv[2]] - mesh.u[uv[0]], dv2 = mesh.v[uv[2]] - mesh.v[uv[0]];
+        uvArea = std::abs(du1 * dv2 - du2 * dv1);
+    } else {
+        rec.u = b1;
+        rec.v = b2;
+    }
+    // Ratio of the triangle's area in uv space to its area in space, as a length scale.
+    auto area = cross(v1 - v0, v2 - v0).length();
+    rec.uvScale = area > 0 ? std::sqrt(uvArea / area) : 0;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "hittable_list.h"
+#include "material.h"
+#include "instance.h"
+#include "mesh.h"
+
+// Streaming reader for the geometry of Wavefront OBJ files: v, vt, vn and f records. Polygons
+// are triangulated as fans and negative indices count back from the last vertex; every other
+// record (groups, materials, smoothing) is skipped. The file is read in large blocks and parsed
+// in place with std::from_chars, so there is no per-line allocation.
+class ObjLoader {
+  public:
+    static const size_t blockSize = 1 << 22;
+
+  public:
+    // Returns false if the file cannot be read.
+    bool load(const std::string& path, MeshData& out) {
+        auto file = std::fopen(path.c_str(), "rb");
+        if (!file) {
+            std::cerr << "ERROR: could not load mesh file: " << path << "\n";
+            return false;
+        }
+
+        mesh = &out;
+        *mesh = MeshData{};
+        std::vector<char> buffer(blockSize);
+        size_t carry = 0;
+        while (true) {
+            auto n = std::fread(buffer.data() + carry, 1, buffer.size() - carry, file);
+            auto end = carry + n;
+            if (n == 0) {
+                parseLine(buffer.data(), buffer.data() + end);
+                break;
+            }
+
+            // Parse the complete lines; keep the partial last line for the next block.
+            auto last = end;
+            while (last > 0 && buffer[last - 1] != '\n') --last;
+            if (last == 0) {
+                buffer.resize(buffer.size() * 2);  // a line longer than the buffer
+                carry = end;
+                continue;
+            }
+            parseLines(buffer.data(), buffer.data() + last);
+            std::copy(buffer.begin() + last, buffer.begin() + end, buffer.begin());
+            carry = end - last;
+        }
+        std::fclose(file);
+
+        if (!mesh->normalIndices.empty() && mesh->nx.empty()) mesh->normalIndices.clear();
+        if (!mesh->uvIndices.empty() && mesh->u.empty()) mesh->uvIndices.clear();
+        return true;
+    }
+
+  private:
+    void parseLines(const char* begin, const char* end) {
+        while (begin < end) {
+            auto lineEnd = begin;
+            while (lineEnd < end && *lineEnd != '\n') ++lineEnd;
+            parseLine(begin, lineEnd);
+            begin = lineEnd + 1;
+        }
+    }
+
+    void parseLine(const char* p, const char* end) {
+        p = skipSpaces(p, end);
+        if (end - p < 2) return;
+
+        if (p[0] == 'v' && p[1] == ' ') {
+            float x = 0, y = 0, z = 0;
+            p = parseFloat(p + 2, end, x);
+            p = parseFloat(p, end, y);
+            parseFloat(p, end, z);
+            mesh->px.push_back(x);
+            mesh->py.push_back(y);
+            mesh->pz.push_back(z);
+        } else if (p[0] == 'v' && p[1] == 'n') {
+            float x = 0, y = 0, z = 0;
+            p = parseFloat(p + 2, end, x);
+            p = parseFloat(p, end, y);
+            parseFloat(p, end, z);
+            mesh->nx.push_back(x);
+            mesh->ny.push_back(y);
+            mesh->nz.push_back(z);
+        } else if (p[0] == 'v' && p[1] == 't') {
+            float u = 0, v = 0;
+            p = parseFloat(p + 2, end, u);
+            parseFloat(p, end, v);
+            mesh->u.push_back(u);
+            mesh->v.push_back(v);
+        } else if (p[0] == 'f' && p[1] == ' ') {
+            parseFace(p + 2, end);
+        }
+    }
+
+    // Corners are "v", "v/vt", "v//vn" or "v/vt/vn".
+    void parseFace(const char* p, const char* end) {
+        corners.clear();
+        while (true) {
+            p = skipSpaces(p, end);
+            if (p >= end || *p == '#' || *p == '\r') break;
+
+            Corner c;
+            int value = 0;
+            p = std::from_chars(p, end, value).ptr;
+            c.position = resolve(value, mesh->px.size());
+            if (p < end && *p == '/') {
+                ++p;
+                if (p < end && *p != '/') {
+                    p = std::from_chars(p, end, value).ptr;
+                    c.uv = resolve(value, mesh->u.size());
+                }
+                if (p < end && *p == '/') {
+                    p = std::from_chars(p + 1, end, value).ptr;
+                    c.normal = resolve(value, mesh->nx.size());
+                }
+            }
+            if (c.position < 0) return;  // malformed face
+            corners.push_back(c);
+            while (p < end && *p != ' ' && *p != '\t') ++p;
+        }
+
+        for (size_t i = 2; i < corners.size(); ++i) {
+            for (auto corner : {corners[0], corners[i - 1], corners[i]}) {
+                mesh->positionIndices.push_back(static_cast<uint32_t>(corner.position));
+                mesh->normalIndices.push_back(corner.normal);
+                mesh->uvIndices.push_back(corner.uv);
+            }
+        }
+    }
+
+    // OBJ indices start at 1; negative ones are relative to the current end.
+    static int32_t resolve(int index, size_t count) {
+        auto resolved = index > 0 ? index - 1 : static_cast<int64_t>(count) + index;
+        return resolved >= 0 && resolved < static_cast<int64_t>(count)
+                   ? static_cast<int32_t>(resolved)
+                   : -1;
+    }
+
+    static const char* skipSpaces(const char* p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t')) ++p;
+        return p;
+    }
+
+    static const char* parseFloat(const char* p, const char* end, float& value) {
+        p = skipSpaces(p, end);
+        if (p < end && *p == '+') ++p;
+        return std::from_chars(p, end, value).ptr;
+    }
+
+    struct Corner {
+        int32_t position = -1;
+        int32_t uv = -1;
+        int32_t normal = -1;
+    };
+
+    MeshData* mesh = nullptr;
+    std::vector<Corner> corners;
+};
+
+inline bool loadObj(const std::string& path, MeshData& out) {
+    return ObjLoader().load(path, out);
+}
+
+HittableList cornellTeapotScene() {
+    using std::make_shared;
+    HittableList world;
+
+    auto red = make_shared<Lambertian>(Vec3{0.65, 0.05, 0.05});
+    auto white = make_shared<Lambertian>(Vec3{0.73, 0.73, 0.73});
+    auto green = make_shared<Lambertian>(Vec3{0.12, 0.45, 0.15});
+    auto light = make_shared<DiffuseLight>(Vec3{15, 15, 15});
+
+    world.add(make_shared<YZRect>(0, 555, 0, 555, 555, green));
+    world.add(make_shared<YZRect>(0, 555, 0, 555, 0, red));
+    world.add(make_shared<XZRect>(213, 343, 227, 332, 554, light));
+    world.add(make_shared<XZRect>(0, 555, 0, 555, 0, white));
+    world.add(make_shared<XZRect>(0, 555, 0, 555, 555, white));
+    world.add(make_shared<XYRect>(0, 555, 0, 555, 555, white));
+
+    MeshData teapot;
+    if (loadObj("../opengl/3_modeling/model/teapot/teapot.obj", teapot)) {
+        auto mesh = make_shared<TriangleMesh>(std::move(teapot),
+                                              make_shared<Metal>(Vec3{0.8, 0.85, 0.88}, 0.1));
+        auto placement = Affine::translation({278, 0, 300}) * Affine::rotation({0, 1, 0}, 60) *
+                         Affine::scaling({50, 50, 50});
+        world.add(make_shared<Instance>(mesh, placement));
+    }
+
+    return world;
+}
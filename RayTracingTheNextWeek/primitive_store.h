@@ -0,0 +1,345 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <typeinfo>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "box.h"
+
+enum class PrimitiveKind : uint32_t { Sphere, MovingSphere, Rect, Box, Other };
+
+// A primitive in a PrimitiveStore: its kind in the top three bits, its index among the
+// primitives of that kind below.
+struct PrimitiveRef {
+    static constexpr int indexBits = 29;
+
+    uint32_t bits;
+
+    static PrimitiveRef make(PrimitiveKind kind, uint32_t index) {
+        return {static_cast<uint32_t>(kind) << indexBits | index};
+    }
+    PrimitiveKind kind() const { return static_cast<PrimitiveKind>(bits >> indexBits); }
+    uint32_t index() const { return bits & ((1u << indexBits) - 1); }
+};
+
+// The primitives of a BVH's leaves, copied into one structure of arrays per kind, so leaves walk
+// contiguous arrays and dispatch on a tag instead of following a pointer and a vtable per
+// primitive. Shapes the store does not know, user-defined Hittables among them, are kept as
+// pointers of kind Other; the BVH owns them. Types are matched exactly, so subclasses of the
+// known shapes keep their own hit().
+class PrimitiveStore {
+  public:
+    static PrimitiveKind kindOf(const Hittable& object) {
+        const auto& type = typeid(object);
+        if (type == typeid(Sphere)) return PrimitiveKind::Sphere;
+        if (type == typeid(MovingSphere)) return PrimitiveKind::MovingSphere;
+        if (type == typeid(XYRect) || type == typeid(XZRect) || type == typeid(YZRect)) {
+            return PrimitiveKind::Rect;
+        }
+        if (type == typeid(Box)) return PrimitiveKind::Box;
+        return PrimitiveKind::Other;
+    }
+
+    PrimitiveRef add(const Hittable& object) {
+        switch (kindOf(object)) {
+            case PrimitiveKind::Sphere: {
+                const auto& s = static_cast<const Sphere&>(object);
+                spheres.add(s.center, s.radius, s.materialId);
+                return PrimitiveRef::make(PrimitiveKind::Sphere, spheres.size() - 1);
+            }
+            case PrimitiveKind::MovingSphere: {
+                const auto& s = static_cast<const MovingSphere&>(object);
+                movingSpheres.add(s.c0, s.c1, s.t0, s.t1, s.radius, s.materialId);
+                return PrimitiveRef::make(PrimitiveKind::MovingSphere, movingSpheres.size() - 1);
+            }
+            case PrimitiveKind::Rect:
+                if (auto r = dynamic_cast<const XYRect*>(&object)) {
+                    rects.add(2, r->k, r->x0, r->x1, r->y0, r->y1, r->materialId);
+                } else if (auto r = dynamic_cast<const XZRect*>(&object)) {
+                    rects.add(1, r->k, r->x0, r->x1, r->z0, r->z1, r->materialId);
+                } else if (auto r = dynamic_cast<const YZRect*>(&object)) {
+                    rects.add(0, r->k, r->y0, r->y1, r->z0, r->z1, r->materialId);
+                }
+                return PrimitiveRef::make(PrimitiveKind::Rect, rects.size() - 1);
+            case PrimitiveKind::Box: {
+                const auto& b = static_cast<const Box&>(object);
+                boxes.add(b.min, b.max, b.materialId);
+                return PrimitiveRef::make(PrimitiveKind::Box, boxes.size() - 1);
+            }
+            default:
+                others.push_back(&object);
+                return PrimitiveRef::make(PrimitiveKind::Other,
+                                          static_cast<uint32_t>(others.size() - 1));
+        }
+    }
+
+    // Candidate hits of a leaf's primitives, as Hittable::hitCandidate(). On a hit, lowers tmax
+    // to it, sets 'closest' and returns true. A leaf is runs of one kind with consecutive
+    // indices (see storePrimitives()), and each run goes to its kind's loop.
+    bool hitLeaf(const PrimitiveRef* refs, uint32_t count, const Ray& r, Real tmin, Real& tmax,
+                 HitRecord& rec, PrimitiveRef& closest) const {
+        bool found = false;
+        for (uint32_t i = 0; i < count;) {
+            auto kind = refs[i].kind();
+            auto first = refs[i].index();
+            uint32_t n = 1;
+            while (i + n < count && refs[i + n].kind() == kind) ++n;
+            i += n;
+
+            uint32_t hit;
+            bool runHit;
+            switch (kind) {
+                case PrimitiveKind::Sphere:
+                    runHit = spheres.hit(first, n, r, tmin, tmax, rec, hit);
+                    break;
+                case PrimitiveKind::MovingSphere:
+                    runHit = movingSpheres.hit(first, n, r, tmin, tmax, rec, hit);
+                    break;
+                case PrimitiveKind::Rect:
+                    runHit = rects.hit(first, n, r, tmin, tmax, rec, hit);
+                    break;
+                case PrimitiveKind::Box:
+                    runHit = boxes.hit(first, n, r, tmin, tmax, rec, hit);
+                    break;
+                default:
+                    runHit = false;
+                    for (auto j = first; j < first + n; ++j) {
+                        if (others[j]->hitCandidate(r, tmin, tmax, rec)) {
+                            tmax = rec.t;
+                            hit = j;
+                            runHit = true;
+                        }
+                    }
+            }
+            if (runHit) {
+                closest = PrimitiveRef::make(kind, hit);
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    // Hittable::occluded() over a leaf's primitives; stops at the first that blocks the ray.
+    bool occludedLeaf(const PrimitiveRef* refs, uint32_t count, const Ray& r, Real tmin,
+                      Real tmax) const {
+        for (uint32_t i = 0; i < count; ++i) {
+            auto j = refs[i].index();
+            bool blocked;
+            switch (refs[i].kind()) {
+                case PrimitiveKind::Sphere:
+                    blocked = occludesSphere(spheres.center(j), spheres.radius[j], r, tmin, tmax);
+                    break;
+                case PrimitiveKind::MovingSphere:
+                    blocked = movingSpheres.occluded(j, r, tmin, tmax);
+                    break;
+                case PrimitiveKind::Rect:
+                    blocked = occludesRect(rects.axis[j], rects.k[j], rects.a0[j], rects.a1[j],
+                                           rects.b0[j], rects.b1[j], r, tmin, tmax);
+                    break;
+                case PrimitiveKind::Box:
+                    blocked = occludesBox(boxes.min(j), boxes.max(j), r, tmin, tmax);
+                    break;
+                default:
+                    blocked = others[j]->occluded(r, tmin, tmax);
+            }
+            if (blocked) return true;
+        }
+        return false;
+    }
+
+    // Hittable::completeHit() of the closest candidate.
+    void completeHit(PrimitiveRef ref, HitRecord& rec) const {
+        auto i = ref.index();
+        switch (ref.kind()) {
+            case PrimitiveKind::Sphere:
+                completeSphereHit(spheres.center(i), spheres.radius[i], rec);
+                break;
+            case PrimitiveKind::Rect:
+                completeRectHit(rects.axis[i], rects.a0[i], rects.a1[i], rects.b0[i],
+                                rects.b1[i], rec);
+                break;
+            case PrimitiveKind::Other:
+                others[i]->completeHit(rec);
+                break;
+            default:  // moving spheres and boxes complete their hits right away
+                break;
+        }
+    }
+
+  private:
+    struct Spheres {
+        std::vector<Real> cx, cy, cz, radius;
+        std::vector<uint32_t> materialId;
+
+        void add(const Vec3& c, Real r, uint32_t material) {
+            cx.push_back(c.x());
+            cy.push_back(c.y());
+            cz.push_back(c.z());
+            radius.push_back(r);
+            materialId.push_back(material);
+        }
+        uint32_t size() const { return static_cast<uint32_t>(radius.size()); }
+        Vec3 center(uint32_t i) const { return {cx[i], cy[i], cz[i]}; }
+
+        bool hit(uint32_t first, uint32_t n, const Ray& r, Real tmin, Real& tmax, HitRecord& rec,
+                 uint32_t& closest) const {
+            bool found = false;
+            for (auto i = first; i < first + n; ++i) {
+                if (hitSphere(center(i), radius[i], materialId[i], r, tmin, tmax, rec)) {
+                    tmax = rec.t;
+                    closest = i;
+                    found = true;
+                }
+            }
+            return found;
+        }
+    };
+
+    struct MovingSpheres {
+        std::vector<Real> c0x, c0y, c0z, c1x, c1y, c1z;
+        std::vector<Real> t0, duration, radius;
+        std::vector<uint32_t> materialId;
+
+        void add(const Vec3& c0, const Vec3& c1, Real time0, Real time1, Real r,
+                 uint32_t material) {
+            c0x.push_back(c0.x());
+            c0y.push_back(c0.y());
+            c0z.push_back(c0.z());
+            c1x.push_back(c1.x());
+            c1y.push_back(c1.y());
+            c1z.push_back(c1.z());
+            t0.push_back(time0);
+            duration.push_back(time1 - time0);
+            radius.push_back(r);
+            materialId.push_back(material);
+        }
+        uint32_t size() const { return static_cast<uint32_t>(radius.size()); }
+        Vec3 centerAtTime(uint32_t i, Real time) const {
+            auto s = (time - t0[i]) / duration[i];
+            return lerp(Vec3(c0x[i], c0y[i], c0z[i]), Vec3(c1x[i], c1y[i], c1z[i]), s);
+        }
+
+        // As MovingSphere::hit(), complete.
+        bool hit(uint32_t first, uint32_t n, const Ray& r, Real tmin, Real& tmax, HitRecord& rec,
+                 uint32_t& closest) const {
+            bool found = false;
+            for (auto i = first; i < first + n; ++i) {
+                auto center = centerAtTime(i, r.time);
+                if (hitSphere(center, radius[i], materialId[i], r, tmin, tmax, rec)) {
+                    rec.uvScale = 0;
+                    tmax = rec.t;
+                    closest = i;
+                    found = true;
+                }
+            }
+            return found;
+        }
+
+        bool occluded(uint32_t i, const Ray& r, Real tmin, Real tmax) const {
+            return occludesSphere(centerAtTime(i, r.time), radius[i], r, tmin, tmax);
+        }
+    };
+
+    // XY, XZ and YZ rectangles, told apart by the axis they are perpendicular to.
+    struct Rects {
+        std::vector<uint8_t> axis;
+        std::vector<Real> k, a0, a1, b0, b1;
+        std::vector<uint32_t> materialId;
+
+        void add(int normalAxis, Real plane, Real lo0, Real hi0, Real lo1, Real hi1,
+                 uint32_t material) {
+            axis.push_back(static_cast<uint8_t>(normalAxis));
+            k.push_back(plane);
+            a0.push_back(lo0);
+            a1.push_back(hi0);
+            b0.push_back(lo1);
+            b1.push_back(hi1);
+            materialId.push_back(material);
+        }
+        uint32_t size() const { return static_cast<uint32_t>(k.size()); }
+
+        bool hit(uint32_t first, uint32_t n, const Ray& r, Real tmin, Real& tmax, HitRecord& rec,
+                 uint32_t& closest) const {
+            bool found = false;
+            for (auto i = first; i < first + n; ++i) {
+                if (hitRect(axis[i], k[i], a0[i], a1[i], b0[i], b1[i], materialId[i], r, tmin,
+                            tmax, rec)) {
+                    tmax = rec.t;
+                    closest = i;
+                    found = true;
+                }
+            }
+            return found;
+        }
+    };
+
+    // As Box::hit(), complete: the six faces in the order Box adds them.
+    struct Boxes {
+        std::vector<Real> minX, minY, minZ, maxX, maxY, maxZ;
+        std::vector<uint32_t> materialId;
+
+        void add(const Vec3& lo, const Vec3& hi, uint32_t material) {
+            minX.push_back(lo.x());
+            minY.push_back(lo.y());
+            minZ.push_back(lo.z());
+            maxX.push_back(hi.x());
+            maxY.push_back(hi.y());
+            maxZ.push_back(hi.z());
+            materialId.push_back(material);
+        }
+        uint32_t size() const { return static_cast<uint32_t>(materialId.size()); }
+        Vec3 min(uint32_t i) const { return {minX[i], minY[i], minZ[i]}; }
+        Vec3 max(uint32_t i) const { return {maxX[i], maxY[i], maxZ[i]}; }
+
+        bool hit(uint32_t first, uint32_t n, const Ray& r, Real tmin, Real& tmax, HitRecord& rec,
+                 uint32_t& closest) const {
+            bool found = false;
+            for (auto i = first; i < first + n; ++i) {
+                const Real face[6][5] = {
+                    {maxZ[i], minX[i], maxX[i], minY[i], maxY[i]},
+                    {minZ[i], minX[i], maxX[i], minY[i], maxY[i]},
+                    {maxY[i], minX[i], maxX[i], minZ[i], maxZ[i]},
+                    {minY[i], minX[i], maxX[i], minZ[i], maxZ[i]},
+                    {maxX[i], minY[i], maxY[i], minZ[i], maxZ[i]},
+                    {minX[i], minY[i], maxY[i], minZ[i], maxZ[i]},
+                };
+                int hitFace = -1;
+                for (int f = 0; f < 6; ++f) {
+                    const auto* q = face[f];
+                    if (hitRect(2 - f / 2, q[0], q[1], q[2], q[3], q[4], materialId[i], r, tmin,
+                                tmax, rec)) {
+                        tmax = rec.t;
+                        hitFace = f;
+                    }
+                }
+                if (hitFace < 0) continue;
+                const auto* q = face[hitFace];
+                completeRectHit(2 - hitFace / 2, q[1], q[2], q[3], q[4], rec);
+                closest = i;
+                found = true;
+            }
+            return found;
+        }
+    };
+
+    Spheres spheres;
+    MovingSpheres movingSpheres;
+    Rects rects;
+    Boxes boxes;
+    std::vector<const Hittable*> others;
+};
+
+// Fills 'store' and 'refs' with 'primitives', a BVH's primitives in leaf order. Same-kind
+// neighbours get consecutive store indices, so a leaf is runs of one kind each. Leaves are not
+// sorted by kind: a medium draws random numbers in its hit test, so test order shows in images.
+inline void storePrimitives(const std::vector<std::shared_ptr<Hittable>>& primitives,
+                            PrimitiveStore& store, std::vector<PrimitiveRef>& refs) {
+    refs.clear();
+    refs.reserve(primitives.size());
+    for (const auto& p : primitives) {
+        refs.push_back(store.add(*p));
+    }
+}
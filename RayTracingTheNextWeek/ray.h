@@ -1,15 +1,101 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
 #include "vec.h"
 
 struct Ray {
   public:
     Ray() = default;
-    Ray(const Vec3& o, const Vec3& d, double time = 0.0) : o{o}, d{d}, time{time} {}
+    Ray(const Vec3& o, const Vec3& d, Real time = 0.0) : o{o}, d{d}, time{time} {}
 
-    Vec3 at(double t) const { return o + t * d; }
+    Vec3 at(Real t) const { return o + t * d; }
 
     Vec3 o;  // origin
     Vec3 d;  // direction
-    double time;
-};
\ No newline at end of file
+    Real time;
+};
+
+// Moves 'p', a point on a surface with normal 'n', off the surface to the side 'd' points to,
+// so rays spawned there need no tmin epsilon to skip the surface they leave. 'error' bounds the
+// absolute error of each coordinate of p that comes from the primitive (a sphere far from the
+// origin, say); p first moves that far along the normal. Each coordinate then moves by a fixed
+// number of ulps (a fixed distance near the origin), which covers the rounding error of p
+// itself at any scale (Waechter and Binder, Ray Tracing Gems, chapter 6).
+inline Vec3 offsetRayOrigin(const Vec3& p, const Vec3& n, const Vec3& d, Real error = 0) {
+    using Bits = std::conditional_t<std::is_same_v<Real, float>, int32_t, int64_t>;
+    constexpr Real nearOrigin = 1.0 / 32;
+    constexpr Real nearOriginScale = 1.0 / 65536;
+    constexpr Real ulpScale = 256;
+
+    auto side = dot(n, d) < 0 ? -n : n;
+    auto moved = p + error * (std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z())) * side;
+    Vec3 result;
+    for (int i = 0; i < 3; ++i) {
+        if (std::abs(moved[i]) < nearOrigin) {
+            result[i] = moved[i] + nearOriginScale * side[i];
+            continue;
+        }
+        Bits bits;
+        std::memcpy(&bits, &moved[i], sizeof(bits));
+        auto ulps = static_cast<Bits>(ulpScale * side[i]);
+        bits += moved[i] < 0 ? -ulps : ulps;
+        std::memcpy(&result[i], &bits, sizeof(bits));
+    }
+    return result;
+}
+
+// Footprint of a ray as a cone: 'width' across at the origin, widening by 'spread' per unit of
+// distance (ray cones, Akenine-Moller et al., Ray Tracing Gems, chapter 20). Texture lookups
+// use it to pick a mip level.
+struct RayCone {
+    Real width = 0;
+    Real spread = 0;
+
+    Real widthAt(Real distance) const { return width + spread * distance; }
+};
+
+// How a camera ray's origin and direction change from one pixel to the next, in x and y.
+struct RayDifferential {
+    Vec3 dOdx, dOdy;
+    Vec3 dDdx, dDdy;
+
+    // Cone of a ray with direction 'd' as wide as the larger of the pixel's two footprints: the
+    // origin offsets give its width, the direction offsets across 'd' its spread.
+    RayCone cone(const Vec3& d) const {
+        auto across = [&](const Vec3& dD) {
+            return (dD - d * (dot(dD, d) / d.lengthSquared())).length();
+        };
+        auto width = std::max(dOdx.length(), dOdy.length());
+        auto spread = std::max(across(dDdx), across(dDdy)) / d.length();
+        return {width, spread};
+    }
+};
+
+// Shadow rays end this fraction of the way to the light, so the light never occludes itself.
+constexpr Real shadowRayEnd = 1 - 64 * std::numeric_limits<Real>::epsilon();
+
+// Values that every box test along one ray reuses: the inverse direction and which direction
+// components are negative, so slab tests neither divide nor branch on the sign.
+struct PreparedRay {
+    explicit PreparedRay(const Ray& r)
+        : invD{1 / r.d.x(), 1 / r.d.y(), 1 / r.d.z()},
+          dirIsNeg{invD.x() < 0, invD.y() < 0, invD.z() < 0} {}
+
+    Vec3 invD;
+    int dirIsNeg[3];
+};
+
+// A small group of coherent rays (e.g. primary rays of a 2x2 pixel quad) traced together.
+// Inactive lanes are ignored by traversal.
+struct RayPacket {
+    static const int size = 4;
+
+    Ray rays[size];
+    bool active[size] = {};
+};
@@ -0,0 +1,556 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "camera.h"
+#include "lights.h"
+#include "sampler.h"
+#include "tile_queue.h"
+#include "wavefront.h"
+#include "framebuffer.h"
+#include "stats.h"
+
+// With 'lights', diffuse surfaces also sample an emitter directly (next-event estimation);
+// bsdfPdf is the density with which 'r' was scattered, 0 if its origin sampled no light. 'cone'
+// is the footprint of 'r', for texture filtering. With 'features', also returns those of the
+// first hit.
+inline Vec3 rayColor(const Ray& r, const Vec3& backgroundColor, const Hittable& world,
+                     int maxDepth, const LightList* lights = nullptr, Real bsdfPdf = 0,
+                     const RayCone& cone = {}, PixelFeatures* features = nullptr);
+
+// Radiance leaving the surface hit by 'r', given its closest hit with the footprint set.
+inline Vec3 shadeHit(const Ray& r, const HitRecord& rec, const Vec3& backgroundColor,
+                     const Hittable& world, int maxDepth, const LightList* lights = nullptr,
+                     Real bsdfPdf = 0, const RayCone& cone = {}) {
+    Ray scattered;
+    Vec3 attenuation;
+    const auto& material = rec.material();
+    Vec3 emitted = material.emitted(rec.u, rec.v, rec.p);
+    if (lights && bsdfPdf > 0 && !emitted.nearZero()) {
+        emitted *= lights->emissionWeight(r.o, r.d, rec.t, bsdfPdf);
+    }
+    if (!material.scatter(r, rec, attenuation, scattered)) {
+        STAT_INC(pathsAbsorbed);
+        return emitted;
+    }
+
+    Vec3 direct;
+    Real scatteredPdf = 0;
+    Vec3 f;
+    if (lights && maxDepth > 1 &&
+        material.evalScattering(r, rec, scattered.d, f, scatteredPdf)) {
+        direct = lights->sampleDirect(world, r, rec, material);
+    }
+    auto nextCone = scatteredCone(cone, rec.t * r.d.length(), material.kind());
+    return emitted + direct +
+           attenuation * rayColor(scattered, backgroundColor, world, maxDepth - 1, lights,
+                                  scatteredPdf, nextCone);
+}
+
+inline Vec3 rayColor(const Ray& r, const Vec3& backgroundColor, const Hittable& world,
+                     int maxDepth, const LightList* lights, Real bsdfPdf, const RayCone& cone,
+                     PixelFeatures* features) {
+    if (maxDepth <= 0) {
+        STAT_INC(pathsMaxDepth);
+        return {0, 0, 0};
+    }
+
+    HitRecord rec;
+    STAT_INC(rays);
+    if (!world.hit(r, 0, infinity, rec)) {
+        STAT_INC(pathsEscaped);
+        return backgroundColor;
+    }
+    STAT_INC(hits);
+    rec.setFootprint(r, cone);
+    if (features) *features = hitFeatures(r, rec);
+    return shadeHit(r, rec, backgroundColor, world, maxDepth, lights, bsdfPdf, cone);
+}
+
+enum class IntegratorType {
+    Recursive,  // rayColor() per sample
+    Wavefront,  // WavefrontIntegrator over the samples of a tile; ignores packetPrimaryRays
+};
+
+struct RenderSettings {
+    int imageWidth = 400;
+    int imageHeight = 225;
+    int samplesPerPixel = 32;  // upper bound per pixel in progressive mode
+    int maxDepth = 32;
+    Vec3 backgroundColor;
+
+    int tileSize = 16;
+    // Trace primary rays of 2x2 pixel quads as one packet. Matches the recursive path except in
+    // media hit by primary rays, whose distances come from a stream per packet.
+    bool packetPrimaryRays = false;
+    int threadCount = 0;  // 0 picks std::thread::hardware_concurrency()
+    uint64_t seed = 0;
+    SamplerType sampler = SamplerType::Halton;  // pixel, lens and time dimensions
+    IntegratorType integrator = IntegratorType::Recursive;
+    int wavefrontSize = 1024;      // paths traced together, wavefront only
+    int russianRouletteDepth = 3;  // wavefront only
+    bool nextEventEstimation = true;  // sample emitters directly at diffuse surfaces
+
+    // Progressive mode renders in passes of samplesPerPass. A pixel stops once the relative
+    // standard error of its luminance drops below errorThreshold (0 disables this), and a tile
+    // stops once all of its pixels have. Either budget ends the render early (0 = unlimited).
+    bool progressive = false;
+    int samplesPerPass = 16;
+    int minSamplesPerPixel = 16;
+    double errorThreshold = 0.0;
+    double timeBudgetSeconds = 0.0;
+    uint64_t sampleBudget = 0;
+};
+
+struct PassInfo {
+    int pass;
+    int maxSamplesPerPixel;
+    size_t activePixels;  // pixels still sampling after this pass
+    uint64_t totalSamples;
+    double seconds;
+};
+
+// Receives the mean color of every pixel after each pass.
+using PassCallback = std::function<void(const Framebuffer& image, const PassInfo& info)>;
+
+// Renders the image in tiles on all worker threads. Every pixel sample takes its camera
+// dimensions from the sampler and reseeds the calling thread's generator from (seed, pixel,
+// sample index), so the result is identical for any thread count, tile size or pass split.
+class Renderer {
+  public:
+    Renderer(const Hittable& world, const Camera& cam, const RenderSettings& settings)
+        : world{world},
+          cam{cam},
+          settings{settings},
+          lights{world} {}
+
+    // Returns the mean color per pixel. With RT_STATS, 'traversalCost' receives the mean number
+    // of intersection tests per sample of every pixel, for heatmapImage(). 'features' receives
+    // the feature buffers of a denoiser; they cost a texture lookup per sample.
+    Framebuffer render(const PassCallback& onPass = nullptr,
+                       std::vector<float>* traversalCost = nullptr,
+                       FeatureBuffers* features = nullptr) const {
+        using Clock = std::chrono::steady_clock;
+        auto startTime = Clock::now();
+
+        const auto& [width, height] = std::make_tuple(settings.imageWidth, settings.imageHeight);
+        std::vector<PixelStats> pixels(static_cast<size_t>(width) * height);
+
+        auto tiles = makeTiles(width, height, settings.tileSize);
+        std::vector<char> tileActive(tiles.size(), 1);
+        auto workerCount = workerCountFor(settings.threadCount);
+
+        auto samplesPerPass = settings.progressive
+                                  ? std::max(1, std::min(settings.samplesPerPass,
+                                                         settings.samplesPerPixel))
+                                  : settings.samplesPerPixel;
+        auto passCount = (settings.samplesPerPixel + samplesPerPass - 1) / samplesPerPass;
+
+        uint64_t totalSamples = 0;
+        int maxSamplesPerPixel = 0;
+        size_t activePixels = pixels.size();
+        Framebuffer image(width, height);
+
+        for (int pass = 0; pass < passCount && activePixels > 0; ++pass) {
+            auto n = std::min(samplesPerPass, settings.samplesPerPixel - pass * samplesPerPass);
+            if (settings.sampleBudget > 0) {
+                auto left = settings.sampleBudget - totalSamples;
+                auto perPixel = std::max<uint64_t>(1, left / activePixels);
+                n = static_cast<int>(std::min<uint64_t>(n, perPixel));
+            }
+
+            maxSamplesPerPixel += n;
+
+            std::vector<Tile> passTiles;
+            for (const auto& tile : tiles) {
+                if (tileActive[tile.index]) passTiles.push_back(tile);
+            }
+            std::atomic<int> tilesRemaining{static_cast<int>(passTiles.size())};
+            std::mutex progressMutex;
+            auto renderOne = [&](const Tile& tile) {
+                tileActive[tile.index] = renderTile(tile, n, pixels, features != nullptr);
+
+                auto remaining = --tilesRemaining;
+                std::lock_guard lock(progressMutex);
+                std::cerr << "\rTiles remaining: " << remaining << ' ' << std::flush;
+            };
+            runTiles(passTiles, workerCount, renderOne, flushRayStats);
+
+            activePixels = 0;
+            for (const auto& p : pixels) {
+                totalSamples += p.lastPassSamples;
+                activePixels += !p.converged;
+            }
+
+            auto seconds = std::chrono::duration<double>(Clock::now() - startTime).count();
+            auto outOfTime =
+                settings.timeBudgetSeconds > 0 && seconds >= settings.timeBudgetSeconds;
+            auto outOfSamples =
+                settings.sampleBudget > 0 && totalSamples >= settings.sampleBudget;
+            if (outOfTime || outOfSamples) activePixels = 0;
+
+            resolve(pixels, image);
+            if (onPass) {
+                onPass(image, {pass, maxSamplesPerPixel, activePixels, totalSamples, seconds});
+            }
+        }
+
+        if (traversalCost) {
+            traversalCost->assign(pixels.size(), 0.0f);
+            for (size_t i = 0; i < pixels.size(); ++i) {
+                const auto& p = pixels[i];
+                if (p.samples > 0) {
+                    (*traversalCost)[i] = static_cast<float>(p.traversalCost) / p.samples;
+                }
+            }
+        }
+        if (features) resolveFeatures(pixels, *features);
+        return image;
+    }
+
+  private:
+    struct PixelStats {
+        Vec3 sum;
+        double luminanceSum = 0.0;
+        double luminanceSumSquared = 0.0;
+        int samples = 0;
+        int lastPassSamples = 0;
+        uint64_t traversalCost = 0;  // intersection tests of all samples, counted with RT_STATS
+        bool converged = false;
+        Vec3 albedoSum;  // features of all samples, when they are recorded
+        Vec3 normalSum;
+        double depthSum = 0.0;
+
+        void add(const Vec3& color) {
+            auto y = luminance(color);
+            sum += color;
+            luminanceSum += y;
+            luminanceSumSquared += y * y;
+            ++samples;
+        }
+
+        void addFeatures(const PixelFeatures& f) {
+            albedoSum += f.albedo;
+            normalSum += f.normal;
+            depthSum += f.depth;
+        }
+
+        // Variance of the mean luminance, estimated from the samples; needs two of them.
+        double meanVariance() const {
+            auto mean = luminanceSum / samples;
+            auto sumOfSquares = luminanceSumSquared - samples * mean * mean;
+            return std::max(0.0, sumOfSquares / (samples - 1)) / samples;
+        }
+
+        // Standard error of the mean luminance relative to the mean. The small bias in the
+        // denominator keeps very dark pixels from never converging.
+        double relativeError() const {
+            if (samples < 2) return infinity;
+            return std::sqrt(meanVariance()) / (luminanceSum / samples + 1e-3);
+        }
+
+        static double luminance(const Vec3& c) {
+            return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+        }
+    };
+
+    // Camera rays of the next n samples of every unconverged pixel of a tile, generated in one
+    // batch. A pixel's rays are consecutive, starting at first[tilePixel()]; the first of them
+    // is sample firstSample[tilePixel()] of the pixel, and its bounces are seeded from the same
+    // index.
+    struct TileRays {
+        CameraRays rays;
+        std::vector<int> first;
+        std::vector<int> firstSample;
+    };
+
+    static void resolve(const std::vector<PixelStats>& pixels, Framebuffer& image) {
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            if (pixels[i].samples > 0) image.set(i, pixels[i].sum / pixels[i].samples);
+        }
+    }
+
+    // Means of the recorded features. A pixel with one sample has no variance estimate and is
+    // taken to be as noisy as it is bright.
+    void resolveFeatures(const std::vector<PixelStats>& pixels, FeatureBuffers& out) const {
+        out = FeatureBuffers(settings.imageWidth, settings.imageHeight);
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            const auto& p = pixels[i];
+            if (p.samples == 0) continue;
+            out.albedo.set(i, p.albedoSum / p.samples);
+            out.normal.set(i, p.normalSum / p.samples);
+            out.depth[i] = static_cast<float>(p.depthSum / p.samples);
+            auto mean = p.luminanceSum / p.samples;
+            out.variance[i] = static_cast<float>(p.samples > 1 ? p.meanVariance() : mean * mean);
+        }
+    }
+
+    // Adds up to 'n' samples to every unconverged pixel of the tile, and with 'features' their
+    // first-hit features. Returns whether any pixel of the tile still needs samples.
+    bool renderTile(const Tile& tile, int n, std::vector<PixelStats>& pixels,
+                    bool features) const {
+        auto sampler = makeSampler(settings.sampler, settings.seed);
+        TileRays rays;
+        primaryRays(tile, n, pixels, *sampler, rays);
+        if (settings.integrator == IntegratorType::Wavefront) {
+            renderTileWavefront(tile, n, pixels, rays, features);
+        } else if (settings.packetPrimaryRays) {
+            renderTilePackets(tile, n, pixels, rays, features);
+        } else {
+            for (int y = tile.y0; y < tile.y1; ++y) {
+                for (int i = tile.x0; i < tile.x1; ++i) {
+                    auto& pixel = pixelAt(pixels, i, y);
+                    pixel.lastPassSamples = 0;
+                    if (pixel.converged) continue;
+
+                    auto first = rays.first[tilePixel(tile, i, y)];
+                    auto firstSample = rays.firstSample[tilePixel(tile, i, y)];
+                    for (int s = 0; s < n; ++s) {
+                        seedPath(i, y, firstSample + s);
+                        StatsProbe probe;
+                        PixelFeatures f;
+                        pixel.add(rayColor(rays.rays.ray(first + s), settings.backgroundColor,
+                                           world, settings.maxDepth, lightList(), 0,
+                                           rays.rays.cone(first + s), features ? &f : nullptr));
+                        if (features) pixel.addFeatures(f);
+                        STAT_PATH_DEPTH(probe.pathVertices());
+                        pixel.traversalCost += probe.traversalCost();
+                    }
+                    pixel.lastPassSamples = n;
+                }
+            }
+        }
+
+        bool active = false;
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                auto& pixel = pixelAt(pixels, i, y);
+                if (settings.errorThreshold > 0 && pixel.samples >= settings.minSamplesPerPixel &&
+                    pixel.relativeError() < settings.errorThreshold) {
+                    pixel.converged = true;
+                }
+                if (pixel.samples >= settings.samplesPerPixel) pixel.converged = true;
+                active |= !pixel.converged;
+            }
+        }
+        return active;
+    }
+
+    void renderTilePackets(const Tile& tile, int n, std::vector<PixelStats>& pixels,
+                           const TileRays& rays, bool features) const {
+        for (int y = tile.y0; y < tile.y1; y += 2) {
+            for (int x = tile.x0; x < tile.x1; x += 2) {
+                PixelStats* quad[RayPacket::size] = {};
+                int first[RayPacket::size] = {};
+                int firstSample[RayPacket::size] = {};
+                for (int lane = 0; lane < RayPacket::size; ++lane) {
+                    auto i = x + lane % 2;
+                    auto row = y + lane / 2;
+                    if (i >= tile.x1 || row >= tile.y1) continue;
+
+                    auto& pixel = pixelAt(pixels, i, row);
+                    pixel.lastPassSamples = 0;
+                    if (!pixel.converged) quad[lane] = &pixel;
+                    first[lane] = rays.first[tilePixel(tile, i, row)];
+                    firstSample[lane] = rays.firstSample[tilePixel(tile, i, row)];
+                }
+
+                for (int s = 0; s < n; ++s) {
+                    RayPacket packet;
+                    RayCone cones[RayPacket::size];
+                    int activeLanes = 0;
+                    for (int lane = 0; lane < RayPacket::size; ++lane) {
+                        if (!quad[lane]) continue;
+                        packet.rays[lane] = rays.rays.ray(first[lane] + s);
+                        cones[lane] = rays.rays.cone(first[lane] + s);
+                        packet.active[lane] = true;
+                        ++activeLanes;
+                    }
+
+                    HitRecord recs[RayPacket::size];
+                    bool hits[RayPacket::size];
+                    StatsProbe packetProbe;
+                    if (settings.maxDepth > 0 && activeLanes > 0) {
+                        // Media draw from the generator while they are intersected, so the
+                        // packet gets a stream of its own before the lanes get theirs.
+                        seedPacket(x, y, quad, firstSample, s);
+                        STAT_ADD(rays, activeLanes);
+                        world.hitPacket(packet, 0, infinity, recs, hits);
+                    }
+                    auto packetCost = packetProbe.traversalCost() / std::max(activeLanes, 1);
+
+                    for (int lane = 0; lane < RayPacket::size; ++lane) {
+                        if (!quad[lane]) continue;
+                        seedPath(x + lane % 2, y + lane / 2, firstSample[lane] + s);
+                        StatsProbe probe;
+                        Vec3 color;
+                        PixelFeatures f;
+                        if (settings.maxDepth <= 0) {
+                            STAT_INC(pathsMaxDepth);
+                        } else if (hits[lane]) {
+                            STAT_INC(hits);
+                            recs[lane].setFootprint(packet.rays[lane], cones[lane]);
+                            if (features) f = hitFeatures(packet.rays[lane], recs[lane]);
+                            color = shadeHit(packet.rays[lane], recs[lane],
+                                             settings.backgroundColor, world, settings.maxDepth,
+                                             lightList(), 0, cones[lane]);
+                        } else {
+                            STAT_INC(pathsEscaped);
+                            color = settings.backgroundColor;
+                        }
+                        STAT_PATH_DEPTH(probe.pathVertices());
+                        quad[lane]->traversalCost += packetCost + probe.traversalCost();
+                        quad[lane]->add(color);
+                        if (features) quad[lane]->addFeatures(f);
+                    }
+                }
+
+                for (auto pixel : quad) {
+                    if (pixel) pixel->lastPassSamples = n;
+                }
+            }
+        }
+    }
+
+    // Starts n paths in every unconverged pixel of the tile and traces them in wavefronts of
+    // at most wavefrontSize paths. Paths finish in an order that depends on where wavefronts are
+    // cut, so they are kept by sample and added to their pixels in sample order once the tile
+    // is done; neither the sample indices nor the sums then depend on the wavefront size.
+    void renderTileWavefront(const Tile& tile, int n, std::vector<PixelStats>& pixels,
+                             const TileRays& rays, bool features) const {
+        WavefrontIntegrator integrator(world, settings.backgroundColor, settings.maxDepth,
+                                       settings.russianRouletteDepth, lightList(), features);
+        struct FinishedPath {
+            Vec3 radiance;
+            uint64_t traversalCost;
+            PixelFeatures features;
+        };
+        std::vector<FinishedPath> finished(rays.rays.size());
+        auto finish = [&](const PathState& path) {
+            STAT_PATH_DEPTH(path.depth);
+            finished[path.target] = {path.radiance, path.traversalCost, path.features};
+        };
+
+        std::vector<PathState> paths;
+        paths.reserve(settings.wavefrontSize);
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                const auto& pixel = pixelAt(pixels, i, y);
+                if (pixel.converged) continue;
+
+                auto first = rays.first[tilePixel(tile, i, y)];
+                auto firstSample = rays.firstSample[tilePixel(tile, i, y)];
+                for (int s = 0; s < n; ++s) {
+                    PathState path;
+                    path.ray = rays.rays.ray(first + s);
+                    path.cone = rays.rays.cone(first + s);
+                    seedPath(i, y, firstSample + s);
+                    path.rng = gen;
+                    path.target = static_cast<uint32_t>(first + s);
+                    paths.push_back(path);
+                    if (static_cast<int>(paths.size()) >= settings.wavefrontSize) {
+                        integrator.trace(paths, finish);
+                    }
+                }
+            }
+        }
+        integrator.trace(paths, finish);
+
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                auto& pixel = pixelAt(pixels, i, y);
+                pixel.lastPassSamples = 0;
+                if (pixel.converged) continue;
+
+                auto first = rays.first[tilePixel(tile, i, y)];
+                for (int s = 0; s < n; ++s) {
+                    const auto& path = finished[first + s];
+                    pixel.traversalCost += path.traversalCost;
+                    pixel.add(path.radiance);
+                    if (features) pixel.addFeatures(path.features);
+                }
+                pixel.lastPassSamples = n;
+            }
+        }
+    }
+
+    int tilePixel(const Tile& tile, int i, int y) const {
+        return (y - tile.y0) * (tile.x1 - tile.x0) + i - tile.x0;
+    }
+
+    void primaryRays(const Tile& tile, int n, std::vector<PixelStats>& pixels, Sampler& sampler,
+                     TileRays& out) const {
+        std::vector<CameraSample> samples;
+        out.first.assign(static_cast<size_t>(tile.x1 - tile.x0) * (tile.y1 - tile.y0), 0);
+        out.firstSample.assign(out.first.size(), 0);
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            for (int i = tile.x0; i < tile.x1; ++i) {
+                const auto& pixel = pixelAt(pixels, i, y);
+                if (pixel.converged) continue;
+                out.first[tilePixel(tile, i, y)] = static_cast<int>(samples.size());
+                out.firstSample[tilePixel(tile, i, y)] = pixel.samples;
+                for (int s = 0; s < n; ++s) {
+                    samples.push_back(cameraSample(sampler, i, y, pixel.samples + s));
+                }
+            }
+        }
+        cam.generateRays(samples.data(), samples.size(), settings.imageWidth,
+                         settings.imageHeight, out.rays);
+    }
+
+    // Film, lens and shutter coordinates of sample 'index' of pixel column i, image row y (row 0
+    // is the top).
+    CameraSample cameraSample(Sampler& sampler, int i, int y, int index) const {
+        sampler.startPixelSample(i, y, index);
+
+        double jitterX, jitterY, lensU, lensV;
+        sampler.get2D(jitterX, jitterY);
+        sampler.get2D(lensU, lensV);
+        auto timeU = sampler.get1D();
+
+        auto j = settings.imageHeight - 1 - y;
+        return {static_cast<Real>((i + jitterX) / settings.imageWidth),
+                static_cast<Real>((j + jitterY) / settings.imageHeight), static_cast<Real>(lensU),
+                static_cast<Real>(lensV), static_cast<Real>(timeU)};
+    }
+
+    // Reseeds the thread's generator for the bounces of sample 'index' of pixel (i, y).
+    void seedPath(int i, int y, int index) const {
+        gen.seed(mixSeed(pixelSampleKey(settings.seed, i, y, index), 1));
+    }
+
+    // Reseeds the thread's generator for the primary rays of a quad's packet of sample 's',
+    // from the sample index of its first unconverged pixel.
+    void seedPacket(int x, int y, PixelStats* const quad[RayPacket::size],
+                    const int firstSample[RayPacket::size], int s) const {
+        for (int lane = 0; lane < RayPacket::size; ++lane) {
+            if (!quad[lane]) continue;
+            auto key = pixelSampleKey(settings.seed, x + lane % 2, y + lane / 2,
+                                      firstSample[lane] + s);
+            gen.seed(mixSeed(key, 2));
+            return;
+        }
+    }
+
+    const LightList* lightList() const {
+        return settings.nextEventEstimation && !lights.empty() ? &lights : nullptr;
+    }
+
+    PixelStats& pixelAt(std::vector<PixelStats>& pixels, int i, int y) const {
+        return pixels[static_cast<size_t>(y) * settings.imageWidth + i];
+    }
+
+    const Hittable& world;
+    const Camera& cam;
+    RenderSettings settings;
+    LightList lights;
+};
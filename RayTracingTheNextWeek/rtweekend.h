@@ -1,22 +1,23 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
-#include <random>
 
 #include "ray.h"
 #include "vec.h"
 
-constexpr double infinity = std::numeric_limits<double>::infinity();
-const double pi = std::acos(-1.0);
+constexpr Real infinity = std::numeric_limits<Real>::infinity();
+const Real pi = std::acos(-1.0);
 
 template <typename T>
-T lerp(const T& a, const T& b, double t) {
+T lerp(const T& a, const T& b, Real t) {
     return (1 - t) * a + t * b;
 }
 
-inline double toRadian(double deg) {
+inline Real toRadian(Real deg) {
     return deg * pi / 180.0;
 }
 
@@ -25,41 +26,115 @@ T clamp(const T& x, const T& min, const T& max) {
     return x < min ? min : (x > max ? max : x);
 }
 
+// SplitMix64 finalizer, used to derive well-spread seeds from (seed, index) pairs.
+inline uint64_t mixSeed(uint64_t seed, uint64_t index) {
+    uint64_t z = seed + 0x9e3779b97f4a7c15ull * (index + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Closed-form warps of uniform [0, 1) numbers; no rejection loops.
+
+// Shirley-Chiu concentric mapping of the square onto the unit disk (z = 0).
+inline Vec3 squareToUniformDisk(Real u1, Real u2) {
+    auto a = 2 * u1 - 1;
+    auto b = 2 * u2 - 1;
+    if (a == 0 && b == 0) return {0, 0, 0};
+
+    Real r, phi;
+    if (std::abs(a) > std::abs(b)) {
+        r = a;
+        phi = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        phi = pi / 2 - (pi / 4) * (a / b);
+    }
+    return {r * std::cos(phi), r * std::sin(phi), 0};
+}
+
+inline Vec3 squareToUniformSphere(Real u1, Real u2) {
+    auto z = 1 - 2 * u1;
+    auto r = std::sqrt(std::max<Real>(0, 1 - z * z));
+    auto phi = 2 * pi * u2;
+    return {r * std::cos(phi), r * std::sin(phi), z};
+}
+
+inline Vec3 squareToUniformBall(Real u1, Real u2, Real u3) {
+    return std::cbrt(u3) * squareToUniformSphere(u1, u2);
+}
+
+// Hemisphere around +z.
+inline Vec3 squareToUniformHemisphere(Real u1, Real u2) {
+    auto d = squareToUniformSphere(u1, u2);
+    return {d.x(), d.y(), std::abs(d.z())};
+}
+
+// Hemisphere around +z with pdf cos(theta) / pi (Malley's method).
+inline Vec3 squareToCosineHemisphere(Real u1, Real u2) {
+    auto d = squareToUniformDisk(u1, u2);
+    return {d.x(), d.y(), std::sqrt(std::max<Real>(0, 1 - d.x() * d.x() - d.y() * d.y()))};
+}
+
+// Rotates 'local' (z up) into the frame whose z axis is the unit vector w.
+inline Vec3 fromLocal(const Vec3& local, const Vec3& w) {
+    auto a = std::abs(w.x()) > 0.9 ? Vec3(0, 1, 0) : Vec3(1, 0, 0);
+    auto v = normalized(cross(w, a));
+    auto u = cross(w, v);
+    return local.x() * u + local.y() * v + local.z() * w;
+}
+
+// xoshiro256+ (Blackman and Vigna), seeded through SplitMix64. Fast, tiny state, and every
+// seed gives a reproducible stream.
 struct RandomGenerator {
-    std::random_device rd;
-    std::mt19937 gen = std::mt19937(rd());
+    RandomGenerator() { seed(0); }
+    explicit RandomGenerator(uint64_t s) { seed(s); }
+
+    void seed(uint64_t s) {
+        for (int i = 0; i < 4; ++i) {
+            state[i] = mixSeed(s, i);
+        }
+    }
 
+    uint64_t next() {
+        auto result = state[0] + state[3];
+        auto t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = (state[3] << 45) | (state[3] >> 19);
+        return result;
+    }
+
+    // Uniform in [min, max], by Lemire's multiply-shift range reduction.
     int randomInt(int min, int max) {
-        std::uniform_int_distribution<int> dist(min, max);
-        return dist(gen);
+        auto range = static_cast<uint64_t>(max - min) + 1;
+        return min + static_cast<int>(((next() >> 32) * range) >> 32);
     }
 
     double randomDouble(double min = 0.0, double maxExcluded = 1.0) {
-        std::uniform_real_distribution<double> dist(min, maxExcluded);
-        return dist(gen);
+        auto u = static_cast<double>(next() >> 11) * 0x1.0p-53;
+        return min + (maxExcluded - min) * u;
     }
 
     Vec3 randomVec3(double a = 0.0, double bExcluded = 1.0) {
-        return {randomDouble(a, bExcluded), randomDouble(a, bExcluded), randomDouble(a, bExcluded)};
+        return Vec3(randomDouble(a, bExcluded), randomDouble(a, bExcluded),
+                    randomDouble(a, bExcluded));
     }
 
     Vec3 randomVec3InUnitSphere() {
-        while (true) {
-            auto v = randomVec3(-1.0, 1.0);
-            if (v.lengthSquared() >= 1) continue;
-            return v;
-        }
+        return squareToUniformBall(randomDouble(), randomDouble(), randomDouble());
     }
 
-    Vec3 randomVec3OnUnitSphere() { return normalized(randomVec3InUnitSphere()); }
+    Vec3 randomVec3OnUnitSphere() { return squareToUniformSphere(randomDouble(), randomDouble()); }
 
-    Vec3 randomInUnitDisk() {
-        while (true) {
-            auto p = Vec3(randomDouble(), randomDouble(), 0.0);
-            if (p.length() >= 1) continue;
-            return p;
-        }
-    }
+    Vec3 randomInUnitDisk() { return squareToUniformDisk(randomDouble(), randomDouble()); }
+
+    uint64_t state[4];
 };
 
-static RandomGenerator gen;
+// One generator per thread. The renderer reseeds it for every pixel sample (Renderer::seedPath)
+// so images do not depend on which thread rendered which tile.
+inline thread_local RandomGenerator gen;
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+#include "rtweekend.h"
+
+enum class SamplerType {
+    Independent,  // uniform random numbers
+    Halton,       // low-discrepancy, randomized per pixel
+};
+
+// Hands out the sample values of one pixel sample, dimension by dimension. Values depend only
+// on (seed, pixel, sample index, dimension), never on which thread or tile asks for them.
+class Sampler {
+  public:
+    virtual ~Sampler() = default;
+
+    // Moves to sample 'index' of pixel (x, y) and restarts at dimension 0.
+    virtual void startPixelSample(int x, int y, int index) = 0;
+
+    // Next dimension, in [0, 1).
+    virtual double get1D() = 0;
+
+    void get2D(double& u1, double& u2) {
+        u1 = get1D();
+        u2 = get1D();
+    }
+};
+
+// Key of one pixel sample, shared by the samplers and the per-sample generator reseeding.
+inline uint64_t pixelSampleKey(uint64_t seed, int x, int y, int index) {
+    auto pixel = (static_cast<uint64_t>(static_cast<uint32_t>(y)) << 32) |
+                 static_cast<uint32_t>(x);
+    return mixSeed(mixSeed(seed, pixel), static_cast<uint64_t>(index));
+}
+
+inline double toUnitDouble(uint64_t bits) {
+    return static_cast<double>(bits >> 11) * 0x1.0p-53;
+}
+
+class IndependentSampler : public Sampler {
+  public:
+    explicit IndependentSampler(uint64_t seed) : seed{seed} {}
+
+    void startPixelSample(int x, int y, int index) override {
+        rng.seed(pixelSampleKey(seed, x, y, index));
+    }
+
+    double get1D() override { return rng.randomDouble(); }
+
+  private:
+    uint64_t seed;
+    RandomGenerator rng;
+};
+
+// Halton sequence, one prime base per dimension, shared by all pixels. Each pixel shifts every
+// dimension by its own random offset (Cranley-Patterson rotation), which keeps the stratification
+// within a pixel but decorrelates neighbours. Dimensions past the prime table fall back to
+// independent random numbers.
+class HaltonSampler : public Sampler {
+  public:
+    static const int maxDimensions = 16;
+
+  public:
+    explicit HaltonSampler(uint64_t seed) : seed{seed} {}
+
+    void startPixelSample(int x, int y, int index) override {
+        pixelKey = pixelSampleKey(seed, x, y, 0);
+        sampleIndex = static_cast<uint64_t>(index);
+        dimension = 0;
+        rng.seed(pixelSampleKey(seed, x, y, index));
+    }
+
+    double get1D() override {
+        if (dimension >= maxDimensions) return rng.randomDouble();
+
+        auto d = dimension++;
+        auto value = radicalInverse(d, sampleIndex) + toUnitDouble(mixSeed(pixelKey, d));
+        value -= std::floor(value);
+        return std::min(value, oneMinusEpsilon);
+    }
+
+    static double radicalInverse(int dimension, uint64_t a) {
+        static const int primes[maxDimensions] = {2,  3,  5,  7,  11, 13, 17, 19,
+                                                  23, 29, 31, 37, 41, 43, 47, 53};
+        if (dimension == 0) {
+            // Base 2 is a bit reversal.
+            a = (a << 32) | (a >> 32);
+            a = ((a & 0x0000ffff0000ffffull) << 16) | ((a & 0xffff0000ffff0000ull) >> 16);
+            a = ((a & 0x00ff00ff00ff00ffull) << 8) | ((a & 0xff00ff00ff00ff00ull) >> 8);
+            a = ((a & 0x0f0f0f0f0f0f0f0full) << 4) | ((a & 0xf0f0f0f0f0f0f0f0ull) >> 4);
+            a = ((a & 0x3333333333333333ull) << 2) | ((a & 0xccccccccccccccccull) >> 2);
+            a = ((a & 0x5555555555555555ull) << 1) | ((a & 0xaaaaaaaaaaaaaaaaull) >> 1);
+            return toUnitDouble(a);
+        }
+
+        const uint64_t base = primes[dimension];
+        const double invBase = 1.0 / base;
+        uint64_t reversed = 0;
+        double invBaseN = 1;
+        while (a) {
+            auto next = a / base;
+            reversed = reversed * base + (a - next * base);
+            invBaseN *= invBase;
+            a = next;
+        }
+        return std::min(reversed * invBaseN, oneMinusEpsilon);
+    }
+
+  private:
+    static constexpr double oneMinusEpsilon = 0x1.fffffffffffffp-1;
+
+    uint64_t seed;
+    uint64_t pixelKey = 0;
+    uint64_t sampleIndex = 0;
+    int dimension = 0;
+    RandomGenerator rng;
+};
+
+inline std::unique_ptr<Sampler> makeSampler(SamplerType type, uint64_t seed) {
+    if (type == SamplerType::Halton) return std::make_unique<HaltonSampler>(seed);
+    return std::make_unique<IndependentSampler>(seed);
+}
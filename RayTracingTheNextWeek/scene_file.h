@@ -0,0 +1,904 @@
+#pragma once
+
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "rtweekend.h"
+#include "scenes.h"
+#include "mapped_file.h"
+
+// Scenes read from files rather than compiled in. A scene has a text form, written by hand or by
+// a generator, and a binary form: the same records as flat arrays, which is memory-mapped and
+// built from without parsing. Text scenes are cached in binary form next to themselves.
+//
+// The text form has one statement per line; '#' starts a comment. Names are words that do not
+// start like a number. A <texture> argument is a texture name or an inline color "r g b".
+//
+//   image width 400 aspect 1.7778 spp 32 background 0.7 0.8 1   (any subset of the keys)
+//   camera from 13 2 3 at 0 0 0 up 0 1 0 fov 20 aperture 0.1 focus 10 shutter 0 1
+//          projection perspective|orthographic|fisheye|equirectangular
+//
+//   texture <name> solid r g b
+//   texture <name> checker <texture> <texture>
+//   texture <name> noise scale
+//   texture <name> image file
+//   material <name> lambertian <texture>
+//   material <name> metal r g b roughness
+//   material <name> dielectric index
+//   material <name> light <texture>
+//
+//   sphere <material> x y z radius
+//   moving_sphere <material> x0 y0 z0 x1 y1 z1 t0 t1 radius
+//   xy_rect <material> x0 x1 y0 y1 z       (xz_rect: x0 x1 z0 z1 y, yz_rect: y0 y1 z0 z1 x)
+//   box <material> x0 y0 z0 x1 y1 z1
+//   mesh <material> file.obj
+//
+//   group <name> ... end                   objects in between (at least one) form one object
+//   instance <group> [translate x y z | rotate ax ay az degrees | scale x y z] ...
+//   medium <group> density <texture> [noise scale]
+//                                          fills the group's boundary; with noise, the density
+//                                          varies as turbulence at 'scale' up to 'density'
+//
+// An instance applies its transforms in the order written. A group becomes usable at its 'end',
+// so groups cannot contain themselves; a medium's group should hold a single closed object.
+// Relative file names are relative to the scene file.
+
+enum class SceneTextureType : uint32_t { Solid, Checker, Noise, Image };
+enum class SceneMaterialType : uint32_t { Lambertian, Metal, Dielectric, Light };
+enum class SceneNodeType : uint32_t {
+    Sphere,
+    MovingSphere,
+    XYRect,
+    XZRect,
+    YZRect,
+    Box,
+    Mesh,
+    Instance,
+    Medium,
+};
+
+// Records of the binary form. They hold no pointers, so they are used in place from the mapping.
+
+// Image and camera settings; the defaults match SceneConfig's.
+struct SceneSettings {
+    double aspectRatio = 16.0 / 9.0;
+    double background[3] = {0, 0, 0};
+    double lookFrom[3] = {0, 0, 0};
+    double lookAt[3] = {0, 0, 0};
+    double vup[3] = {0, 1, 0};
+    double vFov = 40;
+    double distToFocus = 10;
+    double aperture = 0;
+    double t0 = 0;
+    double t1 = 1;
+    int32_t imageWidth = 400;
+    int32_t samplesPerPixel = 32;
+    Projection projection = Projection::Perspective;
+    uint32_t reserved = 0;
+};
+
+struct SceneTexture {
+    SceneTextureType type;
+    uint32_t textures[2];  // checker: odd, even; always earlier textures
+    uint32_t name;         // image: offset of the file name in the string table
+    double values[3];      // solid: color; noise: scale
+};
+
+struct SceneMaterial {
+    SceneMaterialType type;
+    uint32_t texture;  // lambertian, light
+    double values[4];  // metal: albedo, roughness; dielectric: index
+};
+
+// One object of group 'group'; group 0 is the world. 'values' follow the text form's order; an
+// instance keeps its object-to-world matrix there, row by row, and a medium its density and
+// noise scale (0 for a constant density).
+struct SceneNode {
+    SceneNodeType type;
+    uint32_t group;
+    uint32_t material;  // a medium's texture
+    uint32_t ref;       // mesh: mesh index; instance, medium: group index
+    double values[12];
+};
+
+// A triangle mesh in the mesh data: px, py, pz, nx, ny, nz, u, v, then the position, normal and
+// UV indices, each array 4-byte elements; the index arrays for normals and UVs may be absent.
+struct SceneMesh {
+    static constexpr uint32_t hasNormalIndices = 1;
+    static constexpr uint32_t hasUvIndices = 2;
+
+    uint64_t offset;
+    uint64_t vertexCount;
+    uint64_t normalCount;
+    uint64_t uvCount;
+    uint64_t triangleCount;
+    uint32_t flags;
+    uint32_t reserved;
+
+    uint64_t bytes() const {
+        auto indexArrays = 1 + (flags & hasNormalIndices ? 1 : 0) + (flags & hasUvIndices ? 1 : 0);
+        return 4 * (3 * vertexCount + 3 * normalCount + 2 * uvCount +
+                    3 * triangleCount * indexArrays);
+    }
+};
+
+struct SceneFileSection {
+    uint64_t offset;
+    uint64_t count;
+};
+
+// Start of a binary scene file. Sections are 8-byte aligned; the byte order is the host's.
+struct SceneFileHeader {
+    static constexpr uint32_t currentVersion = 2;
+
+    char magic[4];  // "RT2S"
+    uint32_t version;
+    uint32_t groupCount;
+    uint32_t reserved;
+    SceneFileSection settings, textures, materials, nodes, meshes, meshData, strings;
+};
+
+static_assert(std::is_trivially_copyable_v<SceneSettings> &&
+              std::is_trivially_copyable_v<SceneTexture> &&
+              std::is_trivially_copyable_v<SceneMaterial> &&
+              std::is_trivially_copyable_v<SceneNode> && std::is_trivially_copyable_v<SceneMesh>);
+
+template <typename T>
+struct ArrayView {
+    const T* data = nullptr;
+    size_t size = 0;
+
+    const T& operator[](size_t i) const { return data[i]; }
+    const T* begin() const { return data; }
+    const T* end() const { return data + size; }
+};
+
+// A scene's records, wherever they are stored.
+struct SceneView {
+    const SceneSettings* settings = nullptr;
+    ArrayView<SceneTexture> textures;
+    ArrayView<SceneMaterial> materials;
+    ArrayView<SceneNode> nodes;
+    ArrayView<SceneMesh> meshes;
+    ArrayView<uint8_t> meshData;
+    ArrayView<char> strings;
+    uint32_t groupCount = 1;
+};
+
+// A scene's records in memory, as parsed from text.
+struct SceneDescription {
+    SceneSettings settings;
+    std::vector<SceneTexture> textures;
+    std::vector<SceneMaterial> materials;
+    std::vector<SceneNode> nodes;
+    std::vector<SceneMesh> meshes;
+    std::vector<uint8_t> meshData;
+    std::vector<char> strings;
+    uint32_t groupCount = 1;
+
+    SceneView view() const {
+        return {&settings,
+                {textures.data(), textures.size()},
+                {materials.data(), materials.size()},
+                {nodes.data(), nodes.size()},
+                {meshes.data(), meshes.size()},
+                {meshData.data(), meshData.size()},
+                {strings.data(), strings.size()},
+                groupCount};
+    }
+
+    uint32_t addString(const std::string& s) {
+        auto offset = static_cast<uint32_t>(strings.size());
+        strings.insert(strings.end(), s.begin(), s.end());
+        strings.push_back('\0');
+        return offset;
+    }
+
+    void addMesh(const MeshData& mesh) {
+        SceneMesh record{};
+        record.offset = meshData.size();
+        record.vertexCount = mesh.vertexCount();
+        record.normalCount = mesh.nx.size();
+        record.uvCount = mesh.u.size();
+        record.triangleCount = mesh.triangleCount();
+        record.flags = (mesh.normalIndices.empty() ? 0 : SceneMesh::hasNormalIndices) |
+                       (mesh.uvIndices.empty() ? 0 : SceneMesh::hasUvIndices);
+
+        auto append = [&](const auto& array) {
+            const auto* p = reinterpret_cast<const uint8_t*>(array.data());
+            meshData.insert(meshData.end(), p, p + array.size() * sizeof(array[0]));
+        };
+        for (const auto* array : {&mesh.px, &mesh.py, &mesh.pz, &mesh.nx, &mesh.ny, &mesh.nz,
+                                  &mesh.u, &mesh.v}) {
+            append(*array);
+        }
+        append(mesh.positionIndices);
+        append(mesh.normalIndices);
+        append(mesh.uvIndices);
+        meshData.resize((meshData.size() + 7) / 8 * 8);
+        meshes.push_back(record);
+    }
+};
+
+// Reads the text form. Errors are reported with their line and stop the parse.
+class SceneParser {
+  public:
+    // Returns false if the file cannot be read or is malformed.
+    bool parse(const std::string& path, SceneDescription& out) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            std::cerr << "ERROR: could not load scene file: " << path << "\n";
+            return false;
+        }
+        std::string text{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+
+        scene = &out;
+        *scene = SceneDescription{};
+        fileName = path;
+        directory = std::filesystem::path(path).parent_path();
+        textures.clear();
+        materials.clear();
+        groups.clear();
+        currentGroup = 0;
+
+        std::string_view rest = text;
+        for (line = 1; !rest.empty(); ++line) {
+            auto lineEnd = rest.find('\n');
+            if (!parseLine(rest.substr(0, lineEnd))) return false;
+            if (lineEnd == std::string_view::npos) break;
+            rest.remove_prefix(lineEnd + 1);
+        }
+        if (currentGroup != 0) return fail("group without 'end'");
+        return true;
+    }
+
+  private:
+    bool parseLine(std::string_view text) {
+        tokens.clear();
+        next = 0;
+        text = text.substr(0, text.find('#'));
+        size_t i = 0;
+        while (true) {
+            while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i]))) ++i;
+            if (i == text.size()) break;
+            auto start = i;
+            while (i < text.size() && !std::isspace(static_cast<unsigned char>(text[i]))) ++i;
+            tokens.push_back(text.substr(start, i - start));
+        }
+        if (tokens.empty()) return true;
+
+        auto keyword = word();
+        bool ok;
+        if (keyword == "image") {
+            ok = parseImage();
+        } else if (keyword == "camera") {
+            ok = parseCamera();
+        } else if (keyword == "texture") {
+            ok = parseTexture();
+        } else if (keyword == "material") {
+            ok = parseMaterial();
+        } else if (keyword == "group") {
+            ok = parseGroup();
+        } else if (keyword == "end") {
+            if (currentGroup == 0) return fail("'end' outside a group");
+            if (scene->nodes.empty() || scene->nodes.back().group != currentGroup) {
+                return fail("empty group '" + openGroupName + "'");
+            }
+            groups[openGroupName] = currentGroup;
+            currentGroup = 0;
+            ok = true;
+        } else if (keyword == "instance" || keyword == "medium") {
+            ok = parsePlacement(keyword == "medium");
+        } else {
+            ok = parseShape(keyword);
+        }
+        if (!ok) return false;
+        if (next != tokens.size()) return fail("unexpected '" + std::string(tokens[next]) + "'");
+        return true;
+    }
+
+    bool parseImage() {
+        auto& s = scene->settings;
+        while (next < tokens.size()) {
+            auto key = word();
+            double width = s.imageWidth, spp = s.samplesPerPixel;
+            bool ok = (key == "width" && number(width)) ||
+                      (key == "aspect" && number(s.aspectRatio)) ||
+                      (key == "spp" && number(spp)) ||
+                      (key == "background" && numbers(s.background, 3));
+            if (!ok) return fail("bad image setting '" + std::string(key) + "'");
+            s.imageWidth = static_cast<int32_t>(width);
+            s.samplesPerPixel = static_cast<int32_t>(spp);
+        }
+        return true;
+    }
+
+    bool parseCamera() {
+        auto& s = scene->settings;
+        while (next < tokens.size()) {
+            auto key = word();
+            bool ok = (key == "from" && numbers(s.lookFrom, 3)) ||
+                      (key == "at" && numbers(s.lookAt, 3)) || (key == "up" && numbers(s.vup, 3)) ||
+                      (key == "fov" && number(s.vFov)) ||
+                      (key == "aperture" && number(s.aperture)) ||
+                      (key == "focus" && number(s.distToFocus)) ||
+                      (key == "shutter" && number(s.t0) && number(s.t1)) ||
+                      (key == "projection" && projection(s.projection));
+            if (!ok) return fail("bad camera setting '" + std::string(key) + "'");
+        }
+        return true;
+    }
+
+    bool parseTexture() {
+        auto name = word();
+        auto type = word();
+        SceneTexture t{};
+        if (type == "solid") {
+            t.type = SceneTextureType::Solid;
+            if (!numbers(t.values, 3)) return fail("solid texture needs a color");
+        } else if (type == "checker") {
+            t.type = SceneTextureType::Checker;
+            if (!textureRef(t.textures[0]) || !textureRef(t.textures[1])) return false;
+        } else if (type == "noise") {
+            t.type = SceneTextureType::Noise;
+            if (!number(t.values[0])) return fail("noise texture needs a scale");
+        } else if (type == "image") {
+            t.type = SceneTextureType::Image;
+            if (next == tokens.size()) return fail("image texture needs a file");
+            t.name = scene->addString(std::string(word()));
+        } else {
+            return fail("unknown texture type '" + std::string(type) + "'");
+        }
+        textures[std::string(name)] = static_cast<uint32_t>(scene->textures.size());
+        scene->textures.push_back(t);
+        return true;
+    }
+
+    bool parseMaterial() {
+        auto name = word();
+        auto type = word();
+        SceneMaterial m{};
+        if (type == "lambertian" || type == "light") {
+            m.type = type == "light" ? SceneMaterialType::Light : SceneMaterialType::Lambertian;
+            if (!textureRef(m.texture)) return false;
+        } else if (type == "metal") {
+            m.type = SceneMaterialType::Metal;
+            if (!numbers(m.values, 4)) return fail("metal needs an albedo and a roughness");
+        } else if (type == "dielectric") {
+            m.type = SceneMaterialType::Dielectric;
+            if (!number(m.values[0])) return fail("dielectric needs a refractive index");
+        } else {
+            return fail("unknown material type '" + std::string(type) + "'");
+        }
+        materials[std::string(name)] = static_cast<uint32_t>(scene->materials.size());
+        scene->materials.push_back(m);
+        return true;
+    }
+
+    bool parseGroup() {
+        if (currentGroup != 0) return fail("groups cannot be nested");
+        if (next == tokens.size()) return fail("group needs a name");
+        openGroupName = std::string(word());
+        currentGroup = scene->groupCount++;
+        return true;
+    }
+
+    bool parseShape(std::string_view keyword) {
+        struct Shape {
+            std::string_view keyword;
+            SceneNodeType type;
+            int valueCount;
+        };
+        static const Shape shapes[] = {
+            {"sphere", SceneNodeType::Sphere, 4},
+            {"moving_sphere", SceneNodeType::MovingSphere, 9},
+            {"xy_rect", SceneNodeType::XYRect, 5}, {"xz_rect", SceneNodeType::XZRect, 5},
+            {"yz_rect", SceneNodeType::YZRect, 5}, {"box", SceneNodeType::Box, 6},
+            {"mesh", SceneNodeType::Mesh, 0},
+        };
+        const Shape* shape = nullptr;
+        for (const auto& s : shapes) {
+            if (s.keyword == keyword) shape = &s;
+        }
+        if (!shape) return fail("unknown statement '" + std::string(keyword) + "'");
+
+        SceneNode node{};
+        node.type = shape->type;
+        node.group = currentGroup;
+        if (!lookup(materials, "material", node.material)) return false;
+        if (!numbers(node.values, shape->valueCount)) {
+            return fail(std::string(keyword) + " needs " + std::to_string(shape->valueCount) +
+                        " numbers");
+        }
+        if (node.type == SceneNodeType::Mesh) {
+            if (next == tokens.size()) return fail("mesh needs a file");
+            MeshData mesh;
+            if (!loadObj((directory / std::string(word())).string(), mesh)) return false;
+            node.ref = static_cast<uint32_t>(scene->meshes.size());
+            scene->addMesh(mesh);
+        }
+        scene->nodes.push_back(node);
+        return true;
+    }
+
+    bool parsePlacement(bool medium) {
+        SceneNode node{};
+        node.group = currentGroup;
+        if (!lookup(groups, "group", node.ref)) return false;
+        if (medium) {
+            node.type = SceneNodeType::Medium;
+            if (!number(node.values[0])) return fail("medium needs a density");
+            if (!textureRef(node.material)) return false;
+            if (next < tokens.size() && tokens[next] == "noise") {
+                ++next;
+                if (!number(node.values[1]) || node.values[1] <= 0) {
+                    return fail("noise needs a positive scale");
+                }
+            }
+        } else {
+            node.type = SceneNodeType::Instance;
+            auto transform = Affine::identity();
+            while (next < tokens.size()) {
+                auto op = word();
+                double v[4];
+                if (op == "translate" && numbers(v, 3)) {
+                    transform = Affine::translation(Vec3(v[0], v[1], v[2])) * transform;
+                } else if (op == "rotate" && numbers(v, 4)) {
+                    transform = Affine::rotation(Vec3(v[0], v[1], v[2]), v[3]) * transform;
+                } else if (op == "scale" && numbers(v, 3)) {
+                    transform = Affine::scaling(Vec3(v[0], v[1], v[2])) * transform;
+                } else {
+                    return fail("bad transform '" + std::string(op) + "'");
+                }
+            }
+            for (int i = 0; i < 12; ++i) {
+                node.values[i] = transform.m[i / 4][i % 4];
+            }
+        }
+        scene->nodes.push_back(node);
+        return true;
+    }
+
+    // A texture name, or three numbers for a new solid texture.
+    bool textureRef(uint32_t& index) {
+        if (next < tokens.size() && !isNumber(tokens[next])) {
+            return lookup(textures, "texture", index);
+        }
+        SceneTexture t{};
+        t.type = SceneTextureType::Solid;
+        if (!numbers(t.values, 3)) return fail("expected a texture name or a color");
+        index = static_cast<uint32_t>(scene->textures.size());
+        scene->textures.push_back(t);
+        return true;
+    }
+
+    bool lookup(const std::unordered_map<std::string, uint32_t>& names, const char* kind,
+                uint32_t& index) {
+        if (next == tokens.size()) return fail(std::string("expected a ") + kind);
+        auto name = std::string(word());
+        auto it = names.find(name);
+        if (it == names.end()) return fail(std::string("unknown ") + kind + " '" + name + "'");
+        index = it->second;
+        return true;
+    }
+
+    std::string_view word() { return next < tokens.size() ? tokens[next++] : std::string_view{}; }
+
+    bool number(double& value) {
+        if (next == tokens.size()) return false;
+        auto token = tokens[next];
+        if (!token.empty() && token[0] == '+') token.remove_prefix(1);
+        auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), value);
+        if (error != std::errc{} || end != token.data() + token.size()) return false;
+        ++next;
+        return true;
+    }
+
+    bool projection(Projection& value) {
+        if (next == tokens.size()) return false;
+        static const std::pair<std::string_view, Projection> names[] = {
+            {"perspective", Projection::Perspective},
+            {"orthographic", Projection::Orthographic},
+            {"fisheye", Projection::Fisheye},
+            {"equirectangular", Projection::Equirectangular},
+        };
+        for (const auto& [name, p] : names) {
+            if (tokens[next] == name) {
+                value = p;
+                ++next;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool numbers(double* values, int count) {
+        for (int i = 0; i < count; ++i) {
+            if (!number(values[i])) return false;
+        }
+        return true;
+    }
+
+    static bool isNumber(std::string_view token) {
+        return !token.empty() && (std::isdigit(static_cast<unsigned char>(token[0])) ||
+                                  token[0] == '-' || token[0] == '+' || token[0] == '.');
+    }
+
+    bool fail(const std::string& message) const {
+        std::cerr << "ERROR: " << fileName << ":" << line << ": " << message << "\n";
+        return false;
+    }
+
+    SceneDescription* scene = nullptr;
+    std::string fileName;
+    std::filesystem::path directory;
+    int line = 0;
+
+    std::vector<std::string_view> tokens;
+    size_t next = 0;
+
+    std::unordered_map<std::string, uint32_t> textures;
+    std::unordered_map<std::string, uint32_t> materials;
+    std::unordered_map<std::string, uint32_t> groups;
+    uint32_t currentGroup = 0;
+    std::string openGroupName;
+};
+
+// Writes the binary form. Returns false if the file cannot be written.
+inline bool writeSceneBinary(const std::string& path, const SceneDescription& scene) {
+    SceneFileHeader header{};
+    std::memcpy(header.magic, "RT2S", 4);
+    header.version = SceneFileHeader::currentVersion;
+    header.groupCount = scene.groupCount;
+
+    std::vector<std::pair<const void*, size_t>> blocks;
+    uint64_t offset = sizeof(SceneFileHeader);
+    auto place = [&](SceneFileSection& section, const void* data, size_t count, size_t size) {
+        section = {offset, count};
+        blocks.emplace_back(data, count * size);
+        offset = (offset + count * size + 7) / 8 * 8;
+    };
+    place(header.settings, &scene.settings, 1, sizeof(SceneSettings));
+    place(header.textures, scene.textures.data(), scene.textures.size(), sizeof(SceneTexture));
+    place(header.materials, scene.materials.data(), scene.materials.size(),
+          sizeof(SceneMaterial));
+    place(header.nodes, scene.nodes.data(), scene.nodes.size(), sizeof(SceneNode));
+    place(header.meshes, scene.meshes.data(), scene.meshes.size(), sizeof(SceneMesh));
+    place(header.meshData, scene.meshData.data(), scene.meshData.size(), 1);
+    place(header.strings, scene.strings.data(), scene.strings.size(), 1);
+
+    auto file = std::fopen(path.c_str(), "wb");
+    if (!file) return false;
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    const char padding[8] = {};
+    for (const auto& [data, size] : blocks) {
+        if (size > 0) ok = ok && std::fwrite(data, 1, size, file) == size;
+        ok = ok && std::fwrite(padding, 1, (8 - size % 8) % 8, file) == (8 - size % 8) % 8;
+    }
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok) std::remove(path.c_str());
+    return ok;
+}
+
+// A binary scene file, mapped. view() points into the mapping, so it lives as long as this.
+class MappedScene {
+  public:
+    // Returns false if the file cannot be read or is not a binary scene of this version.
+    bool open(const std::string& path) {
+        if (!file.open(path)) return false;
+        if (file.size() < sizeof(SceneFileHeader)) return false;
+        const auto& header = *reinterpret_cast<const SceneFileHeader*>(file.data());
+        if (std::memcmp(header.magic, "RT2S", 4) != 0 ||
+            header.version != SceneFileHeader::currentVersion || header.groupCount == 0) {
+            return false;
+        }
+
+        bool ok = true;
+        auto section = [&](const SceneFileSection& s, auto& array) {
+            using T = std::remove_const_t<std::remove_pointer_t<decltype(array.data)>>;
+            ok = ok && s.offset % 8 == 0 && s.offset <= file.size() &&
+                 s.count <= (file.size() - s.offset) / sizeof(T);
+            if (ok) array = {reinterpret_cast<const T*>(file.data() + s.offset), s.count};
+        };
+        ArrayView<SceneSettings> settings;
+        section(header.settings, settings);
+        section(header.textures, scene.textures);
+        section(header.materials, scene.materials);
+        section(header.nodes, scene.nodes);
+        section(header.meshes, scene.meshes);
+        section(header.meshData, scene.meshData);
+        section(header.strings, scene.strings);
+        if (!ok || settings.size != 1) return false;
+        scene.settings = settings.data;
+        scene.groupCount = header.groupCount;
+        return true;
+    }
+
+    const SceneView& view() const { return scene; }
+
+  private:
+    MappedFile file;
+    SceneView scene;
+};
+
+// Checks that every reference in the records, mesh indices included, is in range and that no
+// group is empty, so a corrupt binary file cannot make buildScene() read out of bounds.
+inline bool validScene(const SceneView& scene) {
+    if (scene.settings->projection > Projection::Equirectangular) return false;
+
+    auto textureCount = scene.textures.size;
+    for (size_t i = 0; i < textureCount; ++i) {
+        const auto& t = scene.textures[i];
+        if (t.type == SceneTextureType::Checker && (t.textures[0] >= i || t.textures[1] >= i)) {
+            return false;
+        }
+        if (t.type == SceneTextureType::Image && t.name >= scene.strings.size) return false;
+        if (t.type > SceneTextureType::Image) return false;
+    }
+    if (scene.strings.size > 0 && scene.strings[scene.strings.size - 1] != '\0') return false;
+
+    for (const auto& m : scene.materials) {
+        if (m.type > SceneMaterialType::Light) return false;
+        if ((m.type == SceneMaterialType::Lambertian || m.type == SceneMaterialType::Light) &&
+            m.texture >= textureCount) {
+            return false;
+        }
+    }
+    for (const auto& mesh : scene.meshes) {
+        if (mesh.offset > scene.meshData.size || mesh.bytes() > scene.meshData.size - mesh.offset) {
+            return false;
+        }
+        // Index arrays follow the attributes; negative normal and UV indices mean "none".
+        const auto* p = scene.meshData.data + mesh.offset +
+                        4 * (3 * mesh.vertexCount + 3 * mesh.normalCount + 2 * mesh.uvCount);
+        auto inRange = [&](uint64_t count, bool hasNone) {
+            for (uint64_t i = 0; i < 3 * mesh.triangleCount; ++i, p += 4) {
+                int64_t index;
+                if (hasNone) {
+                    int32_t value;
+                    std::memcpy(&value, p, 4);
+                    if (value < 0) continue;
+                    index = value;
+                } else {
+                    uint32_t value;
+                    std::memcpy(&value, p, 4);
+                    index = value;
+                }
+                if (static_cast<uint64_t>(index) >= count) return false;
+            }
+            return true;
+        };
+        if (!inRange(mesh.vertexCount, false)) return false;
+        if ((mesh.flags & SceneMesh::hasNormalIndices) && !inRange(mesh.normalCount, true)) {
+            return false;
+        }
+        if ((mesh.flags & SceneMesh::hasUvIndices) && !inRange(mesh.uvCount, true)) return false;
+    }
+
+    // A group is complete once it is referenced; later objects may not join it. This also
+    // rules out cycles. Groups other than the world must not be empty.
+    std::vector<bool> closed(scene.groupCount, false);
+    std::vector<size_t> groupSizes(scene.groupCount, 0);
+    for (const auto& node : scene.nodes) {
+        if (node.type > SceneNodeType::Medium || node.group >= scene.groupCount ||
+            closed[node.group]) {
+            return false;
+        }
+        ++groupSizes[node.group];
+        switch (node.type) {
+            case SceneNodeType::Instance:
+            case SceneNodeType::Medium:
+                if (node.ref == 0 || node.ref >= scene.groupCount || node.ref == node.group) {
+                    return false;
+                }
+                if (node.type == SceneNodeType::Medium && node.material >= textureCount) {
+                    return false;
+                }
+                closed[node.ref] = true;
+                break;
+            case SceneNodeType::Mesh:
+                if (node.ref >= scene.meshes.size) return false;
+                [[fallthrough]];
+            default:
+                if (node.material >= scene.materials.size) return false;
+        }
+    }
+    for (uint32_t g = 1; g < scene.groupCount; ++g) {
+        if (groupSizes[g] == 0) return false;
+    }
+    return true;
+}
+
+// Creates the objects of a scene. Each group is built as soon as it is first placed: a single
+// object stands for itself, several go under a BVH. 'directory' resolves relative image files.
+inline bool buildScene(const SceneView& scene, const std::filesystem::path& directory,
+                       SceneConfig& out) {
+    using std::make_shared;
+
+    if (!validScene(scene)) {
+        std::cerr << "ERROR: scene has references out of range or empty groups\n";
+        return false;
+    }
+
+    const auto& s = *scene.settings;
+    auto vec3 = [](const double* v) { return Vec3(v[0], v[1], v[2]); };
+    out.aspectRatio = s.aspectRatio;
+    out.imageWidth = s.imageWidth;
+    out.samplesPerPixel = s.samplesPerPixel;
+    out.backgroundColor = vec3(s.background);
+    out.lookFrom = vec3(s.lookFrom);
+    out.lookAt = vec3(s.lookAt);
+    out.vup = vec3(s.vup);
+    out.vFov = s.vFov;
+    out.distToFocus = s.distToFocus;
+    out.aperture = s.aperture;
+    out.t0 = s.t0;
+    out.t1 = s.t1;
+    out.projection = s.projection;
+
+    std::vector<std::shared_ptr<Texture>> textures;
+    textures.reserve(scene.textures.size);
+    for (const auto& t : scene.textures) {
+        switch (t.type) {
+            case SceneTextureType::Solid:
+                textures.push_back(make_shared<SolidColor>(vec3(t.values)));
+                break;
+            case SceneTextureType::Checker:
+                textures.push_back(
+                    make_shared<CheckerTexture>(textures[t.textures[0]], textures[t.textures[1]]));
+                break;
+            case SceneTextureType::Noise:
+                textures.push_back(make_shared<NoiseTexture>(t.values[0]));
+                break;
+            case SceneTextureType::Image:
+                auto file = (directory / &scene.strings[t.name]).string();
+                textures.push_back(make_shared<ImageTexture>(file.c_str()));
+                break;
+        }
+    }
+
+    std::vector<std::shared_ptr<Material>> materials;
+    materials.reserve(scene.materials.size);
+    for (const auto& m : scene.materials) {
+        switch (m.type) {
+            case SceneMaterialType::Lambertian:
+                materials.push_back(make_shared<Lambertian>(textures[m.texture]));
+                break;
+            case SceneMaterialType::Metal:
+                materials.push_back(make_shared<Metal>(vec3(m.values), m.values[3]));
+                break;
+            case SceneMaterialType::Dielectric:
+                materials.push_back(make_shared<Dielectric>(m.values[0]));
+                break;
+            case SceneMaterialType::Light:
+                materials.push_back(make_shared<DiffuseLight>(textures[m.texture]));
+                break;
+        }
+    }
+
+    std::vector<HittableList> groups(scene.groupCount);
+    std::vector<std::shared_ptr<Hittable>> built(scene.groupCount);
+    auto group = [&](uint32_t g) {
+        if (!built[g]) {
+            auto& objects = groups[g].objects;
+            built[g] = objects.size() == 1 ? objects.front() : makeBvh(groups[g], s.t0, s.t1);
+        }
+        return built[g];
+    };
+
+    for (const auto& node : scene.nodes) {
+        const auto* v = node.values;
+        std::shared_ptr<Hittable> object;
+        switch (node.type) {
+            case SceneNodeType::Sphere:
+                object = make_shared<Sphere>(vec3(v), v[3], materials[node.material]);
+                break;
+            case SceneNodeType::MovingSphere:
+                object = make_shared<MovingSphere>(vec3(v), vec3(v + 3), v[6], v[7], v[8],
+                                                   materials[node.material]);
+                break;
+            case SceneNodeType::XYRect:
+                object = make_shared<XYRect>(v[0], v[1], v[2], v[3], v[4],
+                                             materials[node.material]);
+                break;
+            case SceneNodeType::XZRect:
+                object = make_shared<XZRect>(v[0], v[1], v[2], v[3], v[4],
+                                             materials[node.material]);
+                break;
+            case SceneNodeType::YZRect:
+                object = make_shared<YZRect>(v[0], v[1], v[2], v[3], v[4],
+                                             materials[node.material]);
+                break;
+            case SceneNodeType::Box:
+                object = make_shared<Box>(vec3(v), vec3(v + 3), materials[node.material]);
+                break;
+            case SceneNodeType::Mesh: {
+                const auto& record = scene.meshes[node.ref];
+                const auto* p = scene.meshData.data + record.offset;
+                auto take = [&](auto& array, uint64_t count) {
+                    array.resize(count);
+                    std::memcpy(array.data(), p, count * 4);
+                    p += count * 4;
+                };
+                MeshData mesh;
+                auto triangleIndices = 3 * record.triangleCount;
+                for (auto* array : {&mesh.px, &mesh.py, &mesh.pz}) take(*array, record.vertexCount);
+                for (auto* array : {&mesh.nx, &mesh.ny, &mesh.nz}) take(*array, record.normalCount);
+                for (auto* array : {&mesh.u, &mesh.v}) take(*array, record.uvCount);
+                take(mesh.positionIndices, triangleIndices);
+                if (record.flags & SceneMesh::hasNormalIndices) {
+                    take(mesh.normalIndices, triangleIndices);
+                }
+                if (record.flags & SceneMesh::hasUvIndices) take(mesh.uvIndices, triangleIndices);
+                object = make_shared<TriangleMesh>(std::move(mesh), materials[node.material]);
+                break;
+            }
+            case SceneNodeType::Instance: {
+                Affine transform;
+                for (int i = 0; i < 12; ++i) {
+                    transform.m[i / 4][i % 4] = v[i];
+                }
+                object = make_shared<Instance>(group(node.ref), transform);
+                break;
+            }
+            case SceneNodeType::Medium:
+                if (v[1] > 0) {
+                    auto noise = make_shared<PerlinNoise>();
+                    auto density = [noise, maxDensity = v[0], scale = v[1]](const Vec3& p) {
+                        return maxDensity * std::min<Real>(1, noise->turb(scale * p));
+                    };
+                    object = make_shared<HeterogeneousMedium>(
+                        group(node.ref), density, v[0], textures[node.material], s.t0, s.t1);
+                } else {
+                    object = make_shared<ConstantMedium>(group(node.ref), v[0],
+                                                         textures[node.material], s.t0, s.t1);
+                }
+                break;
+        }
+        groups[node.group].add(object);
+    }
+    out.world = std::move(groups.front());
+    return true;
+}
+
+// Loads a scene file into 'out', seeding the generator and replacing the materials of the
+// previous scene first, as makeScene() does. Binary files are mapped directly. A text file is
+// parsed unless "<path>.bin" is at least as new, and the parse is cached there when the
+// directory is writable; the cache does not track changes to meshes the text refers to.
+inline bool loadSceneFile(const std::string& path, SceneConfig& out, uint64_t seed = 0) {
+    namespace fs = std::filesystem;
+    gen.seed(seed);
+    materialTable.clear();
+    auto directory = fs::path(path).parent_path();
+    out.name = fs::path(path).stem().string();
+
+    MappedScene mapped;
+    if (mapped.open(path)) return buildScene(mapped.view(), directory, out);
+
+    auto cachePath = path + ".bin";
+    std::error_code error;
+    auto cacheTime = fs::last_write_time(cachePath, error);
+    if (!error && cacheTime >= fs::last_write_time(path, error) && !error &&
+        mapped.open(cachePath)) {
+        return buildScene(mapped.view(), directory, out);
+    }
+
+    SceneDescription scene;
+    if (!SceneParser().parse(path, scene)) return false;
+    writeSceneBinary(cachePath, scene);
+    return buildScene(scene.view(), directory, out);
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "camera.h"
+#include "box.h"
+#include "instance.h"
+#include "obj_loader.h"
+#include "constant_medium.h"
+#include "bvh.h"
+
+HittableList final_scene() {
+    using std::make_shared;
+
+    HittableList objects;
+
+    HittableList boxes1;
+    auto ground = make_shared<Lambertian>(Vec3(0.48, 0.83, 0.53));
+
+    const int boxes_per_side = 20;
+    for (int i = 0; i < boxes_per_side; i++) {
+        for (int j = 0; j < boxes_per_side; j++) {
+            auto w = 100.0;
+            auto x0 = -1000.0 + i * w;
+            auto z0 = -1000.0 + j * w;
+            auto y0 = 0.0;
+            auto x1 = x0 + w;
+            auto y1 = gen.randomDouble(1, 101);
+            auto z1 = z0 + w;
+
+            boxes1.add(make_shared<Box>(Vec3(x0, y0, z0), Vec3(x1, y1, z1), ground));
+        }
+    }
+
+    objects.add(makeBvh(boxes1, 0.0, 1.0));
+
+    auto light = make_shared<DiffuseLight>(Vec3(7, 7, 7));
+    objects.add(make_shared<XZRect>(123, 423, 147, 412, 554, light));
+
+    auto center1 = Vec3(400, 400, 200);
+    auto center2 = center1 + Vec3(30, 0, 0);
+    auto moving_sphere_material = make_shared<Lambertian>(Vec3(0.7, 0.3, 0.1));
+    objects.add(make_shared<MovingSphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+
+    objects.add(make_shared<Sphere>(Vec3(260, 150, 45), 50, make_shared<Dielectric>(1.5)));
+    objects.add(
+        make_shared<Sphere>(Vec3(0, 150, 145), 50, make_shared<Metal>(Vec3(0.8, 0.8, 0.9), 1.0)));
+
+    auto boundary = make_shared<Sphere>(Vec3(360, 150, 145), 70, make_shared<Dielectric>(1.5));
+    objects.add(boundary);
+    objects.add(make_shared<ConstantMedium>(boundary, 0.2, Vec3(0.2, 0.4, 0.9)));
+    boundary = make_shared<Sphere>(Vec3(0, 0, 0), 5000, make_shared<Dielectric>(1.5));
+    objects.add(make_shared<ConstantMedium>(boundary, .0001, Vec3(1, 1, 1)));
+
+    auto emat = make_shared<Lambertian>(make_shared<ImageTexture>("earthmap.jpg"));
+    objects.add(make_shared<Sphere>(Vec3(400, 200, 400), 100, emat));
+    auto pertext = make_shared<NoiseTexture>(0.1);
+    objects.add(make_shared<Sphere>(Vec3(220, 280, 300), 80, make_shared<Lambertian>(pertext)));
+
+    HittableList lotsOfSpheres;
+    auto white = make_shared<Lambertian>(Vec3(0.73, 0.73, 0.73));
+    int ns = 1000;
+    for (int j = 0; j < ns; j++) {
+        lotsOfSpheres.add(make_shared<Sphere>(gen.randomVec3(0, 165), 10, white));
+    }
+
+    // The cluster gets its own BVH, placed in the world by one instance transform.
+    auto cluster = makeBvh(lotsOfSpheres, 0.0, 1.0);
+    auto placement = Affine::translation({-100, 270, 395}) * Affine::rotation({0, 1, 0}, 15);
+    objects.add(make_shared<Instance>(cluster, placement));
+
+    return objects;
+}
+
+// A built-in scene with the camera and image settings it is meant to be rendered with.
+struct SceneConfig {
+    std::string name;
+    HittableList world;
+    Vec3 backgroundColor = {0, 0, 0};
+
+    Real aspectRatio = 16.0 / 9.0;
+    int imageWidth = 400;
+    int samplesPerPixel = 32;
+
+    Vec3 lookFrom;
+    Vec3 lookAt = {0, 0, 0};
+    Vec3 vup = {0, 1, 0};
+    Real vFov = 40.0;
+    Real distToFocus = 10.0;
+    Real aperture = 0.0;
+    Real t0 = 0.0;
+    Real t1 = 1.0;
+    Projection projection = Projection::Perspective;
+
+    int imageHeight() const { return static_cast<int>(imageWidth / aspectRatio); }
+
+    Camera camera() const {
+        return {lookFrom, lookAt, vup, vFov, aspectRatio, aperture, distToFocus, t0, t1,
+                projection};
+    }
+};
+
+// Scene names in id order; id i + 1 is sceneNames()[i].
+inline const std::vector<std::string>& sceneNames() {
+    static const std::vector<std::string> names = {
+        "random",      "two_spheres",   "two_perlin_spheres", "earth",          "simple_light",
+        "cornell_box", "cornell_smoke", "final",              "cornell_teapot",
+        "two_perlin_spheres_baked",
+    };
+    return names;
+}
+
+// Returns the id of the named scene, 0 if there is none.
+inline int sceneId(const std::string& name) {
+    const auto& names = sceneNames();
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (names[i] == name) return static_cast<int>(i) + 1;
+    }
+    return 0;
+}
+
+// Builds scene 'id', replacing the materials of the previous scene. Scene construction draws
+// from the generator, so it is seeded first and the same seed always gives the same scene.
+inline SceneConfig makeScene(int id, uint64_t seed = 0) {
+    gen.seed(seed);
+    materialTable.clear();
+
+    SceneConfig scene;
+    if (id >= 1 && id <= static_cast<int>(sceneNames().size())) scene.name = sceneNames()[id - 1];
+
+    switch (id) {
+        case 1:
+            scene.world = randomScene();
+            scene.lookFrom = {13, 2, 3};
+            scene.lookAt = {0, 0, 0};
+            scene.vFov = 20.0;
+            scene.aperture = 0.1;
+            scene.backgroundColor = {0.7, 0.8, 1.0};
+            break;
+
+        case 2:
+            scene.world = twoSpheresScene();
+            scene.lookFrom = {13, 2, 3};
+            scene.lookAt = {0, 0, 0};
+            scene.vFov = 20.0;
+            scene.backgroundColor = {0.7, 0.8, 1.0};
+            break;
+
+        case 3:
+            scene.world = twoPerlinSpheres();
+            scene.lookFrom = {13, 2, 3};
+            scene.lookAt = {0, 0, 0};
+            scene.vFov = 20.0;
+            scene.backgroundColor = {0.7, 0.8, 1.0};
+            break;
+
+        case 4:
+            scene.world = earthScene();
+            scene.lookFrom = {13, 2, 3};
+            scene.lookAt = {0, 0, 0};
+            scene.vFov = 20.0;
+            scene.backgroundColor = {0.7, 0.8, 1.0};
+            break;
+
+        case 5:
+            scene.world = simpleLightScene();
+            scene.lookFrom = {26, 3, 6};
+            scene.lookAt = {0, 2, 0};
+            scene.samplesPerPixel = 200;
+            scene.vFov = 20.0;
+            scene.backgroundColor = {0.0, 0.0, 0.0};
+            break;
+
+        case 6:
+            scene.world = cornellBox();
+            scene.aspectRatio = 1.0;
+            scene.imageWidth = 600;
+            scene.samplesPerPixel = 200;
+            scene.backgroundColor = {0, 0, 0};
+            scene.lookFrom = {278, 278, -800};
+            scene.lookAt = {278, 278, 0};
+            scene.vFov = 40.0;
+            break;
+
+        case 7:
+            scene.world = cornellSmokeScene();
+            scene.aspectRatio = 1.0;
+            scene.imageWidth = 600;
+            scene.samplesPerPixel = 200;
+            scene.backgroundColor = {0, 0, 0};
+            scene.lookFrom = {278, 278, -800};
+            scene.lookAt = {278, 278, 0};
+            scene.vFov = 40.0;
+            break;
+
+        case 8:
+            scene.world = final_scene();
+            scene.aspectRatio = 1.0;
+            scene.imageWidth = 600;
+            scene.samplesPerPixel = 1000;
+            scene.backgroundColor = {0, 0, 0};
+            scene.lookFrom = {478, 278, -600};
+            scene.lookAt = {278, 278, 0};
+            scene.vFov = 40.0;
+            break;
+
+        case 9:
+            scene.world = cornellTeapotScene();
+            scene.aspectRatio = 1.0;
+            scene.imageWidth = 600;
+            scene.samplesPerPixel = 200;
+            scene.backgroundColor = {0, 0, 0};
+            scene.lookFrom = {278, 278, -800};
+            scene.lookAt = {278, 278, 0};
+            scene.vFov = 40.0;
+            break;
+
+        case 10:
+            // two_perlin_spheres with its noise baked around the small sphere.
+            scene.world = twoPerlinSpheres(64);
+            scene.lookFrom = {13, 2, 3};
+            scene.lookAt = {0, 0, 0};
+            scene.vFov = 20.0;
+            scene.backgroundColor = {0.7, 0.8, 1.0};
+            break;
+    }
+    return scene;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "rtweekend.h"
+#include "framebuffer.h"
+
+// Compile with RT_STATS=1 (CMake option RT2_STATS; always on for rt2_bench) to count traversal
+// and shading work. Without it the STAT_ macros expand to nothing and the counters stay zero.
+#ifndef RT_STATS
+    #define RT_STATS 0
+#endif
+
+#if RT_STATS
+    #define STAT_INC(counter) (++rayStats.counter)
+    #define STAT_ADD(counter, n) (rayStats.counter += (n))
+    #define STAT_PATH_DEPTH(vertices) (rayStats.addPathDepth(vertices))
+#else
+    #define STAT_INC(counter) ((void)0)
+    #define STAT_ADD(counter, n) ((void)0)
+    #define STAT_PATH_DEPTH(vertices) ((void)0)
+#endif
+
+// Traversal and shading work. Every thread counts into its own copy, so the hot paths never
+// share a cache line; workers merge theirs with flushRayStats() when they finish a frame.
+struct RayStats {
+    static const int depthBins = 33;  // path lengths 0 to 31, then 32 or more
+
+    uint64_t rays = 0;            // closest-hit and shadow queries issued by the integrators
+    uint64_t hits = 0;            // closest-hit queries that found a surface (path vertices)
+    uint64_t nodeVisits = 0;      // BVH nodes whose child boxes were tested
+    uint64_t boxTests = 0;        // ray/box slab tests, four per Bvh4 node
+    uint64_t primitiveTests = 0;  // ray tests against spheres, rects, triangles and media
+    uint64_t primitiveHits = 0;   // of those, the ones that hit within the ray's interval
+    uint64_t scatters = 0;        // Material::scatter() calls
+
+    // Why paths ended, and how many vertices they had.
+    uint64_t pathsEscaped = 0;
+    uint64_t pathsAbsorbed = 0;
+    uint64_t pathsMaxDepth = 0;
+    uint64_t pathsRoulette = 0;
+    uint64_t pathDepth[depthBins] = {};
+
+    uint64_t paths() const { return pathsEscaped + pathsAbsorbed + pathsMaxDepth + pathsRoulette; }
+
+    // Intersection tests of any kind; the heatmap shows this per sample.
+    uint64_t traversalCost() const { return boxTests + primitiveTests; }
+
+    void addPathDepth(int vertices) { ++pathDepth[std::min(vertices, depthBins - 1)]; }
+
+    RayStats& operator+=(const RayStats& other) {
+        rays += other.rays;
+        hits += other.hits;
+        nodeVisits += other.nodeVisits;
+        boxTests += other.boxTests;
+        primitiveTests += other.primitiveTests;
+        primitiveHits += other.primitiveHits;
+        scatters += other.scatters;
+        pathsEscaped += other.pathsEscaped;
+        pathsAbsorbed += other.pathsAbsorbed;
+        pathsMaxDepth += other.pathsMaxDepth;
+        pathsRoulette += other.pathsRoulette;
+        for (int i = 0; i < depthBins; ++i) {
+            pathDepth[i] += other.pathDepth[i];
+        }
+        return *this;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const RayStats& s) {
+    auto rays = static_cast<double>(std::max<uint64_t>(s.rays, 1));
+    os << s.rays << " rays, " << s.hits << " hits, " << s.nodeVisits / rays << " nodes, "
+       << s.boxTests / rays << " boxes, " << s.primitiveTests / rays << " primitives per ray; "
+       << s.paths() << " paths: " << s.pathsEscaped << " escaped, " << s.pathsAbsorbed
+       << " absorbed, " << s.pathsMaxDepth << " at max depth, " << s.pathsRoulette
+       << " by roulette";
+    return os;
+}
+
+inline thread_local RayStats rayStats;
+
+inline std::mutex rayStatsMutex;
+inline RayStats rayStatsTotal;  // flushed counters of all threads
+
+// Adds the calling thread's counters to the total and clears them.
+inline void flushRayStats() {
+    std::lock_guard lock(rayStatsMutex);
+    rayStatsTotal += rayStats;
+    rayStats = {};
+}
+
+// Total of all flushed counters plus the calling thread's.
+inline RayStats collectRayStats() {
+    flushRayStats();
+    std::lock_guard lock(rayStatsMutex);
+    return rayStatsTotal;
+}
+
+inline void resetRayStats() {
+    std::lock_guard lock(rayStatsMutex);
+    rayStatsTotal = {};
+    rayStats = {};
+}
+
+// Work the calling thread did since the probe was made, to attribute it to one path or pixel.
+// Reads zero without RT_STATS.
+class StatsProbe {
+  public:
+#if RT_STATS
+    StatsProbe() : hits{rayStats.hits}, cost{rayStats.traversalCost()} {}
+
+    int pathVertices() const { return static_cast<int>(rayStats.hits - hits); }
+    uint64_t traversalCost() const { return rayStats.traversalCost() - cost; }
+
+  private:
+    uint64_t hits;
+    uint64_t cost;
+#else
+    int pathVertices() const { return 0; }
+    uint64_t traversalCost() const { return 0; }
+#endif
+};
+
+// False-color image of per-pixel cost: black through blue, cyan, green and yellow to red. The
+// ramp tops out at the 99th percentile, so a few very expensive pixels do not flatten the rest.
+// Values are display colors; write them without gamma correction.
+inline Framebuffer heatmapImage(const std::vector<float>& cost, int width, int height) {
+    Framebuffer image(width, height);
+    if (cost.empty()) return image;
+
+    auto sorted = cost;
+    auto top = sorted.begin() + static_cast<std::ptrdiff_t>(0.99 * (sorted.size() - 1));
+    std::nth_element(sorted.begin(), top, sorted.end());
+    auto scale = *top > 0 ? 1 / *top : 0.0f;
+
+    static const Vec3 stops[] = {{0, 0, 0}, {0, 0, 1}, {0, 1, 1}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0}};
+    const int segments = static_cast<int>(sizeof(stops) / sizeof(stops[0])) - 1;
+    for (size_t i = 0; i < cost.size(); ++i) {
+        auto x = std::min(1.0f, cost[i] * scale) * segments;
+        auto k = std::min(static_cast<int>(x), segments - 1);
+        image.set(i, lerp(stops[k], stops[k + 1], x - k));
+    }
+    return image;
+}
@@ -0,0 +1,325 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "rtweekend.h"
+#include "image.h"
+
+class TextureCache;
+
+// RGB8 image with its mip pyramid, each level a 2x2 box filter of the one above, down to 1x1.
+// Levels are stored as 8x8 tiles, row-major across the level and in Morton order within a
+// tile, so the texels of one filtered lookup fall into a few cache lines. Tiles are all in
+// memory, or, when the image is paged, read on demand from a temporary file through the cache.
+// Lookups of resident tiles take no lock: each read pins its tile with a reference count, so
+// eviction cannot free it mid-read.
+class MipMap {
+  public:
+    static constexpr int tileSize = 8;
+    static constexpr int bytesPerPixel = 3;
+    static constexpr size_t tileBytes = tileSize * tileSize * bytesPerPixel;
+
+  public:
+    // 'pixels' is row-major RGB8, top row first. With a pager, only the tiles it keeps under
+    // its budget stay in memory.
+    MipMap(const uint8_t* pixels, int width, int height, TextureCache* pager = nullptr);
+    ~MipMap();
+
+    MipMap(const MipMap&) = delete;
+    MipMap& operator=(const MipMap&) = delete;
+
+    int width() const { return levels.front().width; }
+    int height() const { return levels.front().height; }
+    int levelCount() const { return static_cast<int>(levels.size()); }
+    uint32_t tileCount() const { return tileTotal; }
+    bool paged() const { return backing != nullptr; }
+
+    // Level 0 texel containing (u, v); v = 0 is the bottom row.
+    Vec3 nearest(Real u, Real v) const;
+
+    // Trilinear lookup for a footprint 'width' wide in uv units: bilinear in the two levels
+    // whose texels are closest to that width, blended by the fractional level.
+    Vec3 trilinear(Real u, Real v, Real width) const;
+
+  private:
+    friend class TextureCache;
+
+    struct Level {
+        int width;
+        int height;
+        int tilesX;
+        uint32_t firstTile;
+    };
+
+    static int morton(int x, int y) {
+        auto spread = [](int i) { return (i & 1) | (i & 2) << 1 | (i & 4) << 2; };
+        return spread(x) | spread(y) << 1;
+    }
+
+    using Page = std::shared_ptr<const uint8_t[]>;
+
+    const uint8_t* tile(uint32_t index, Page& pin) const;
+    Vec3 texel(const Level& level, int x, int y) const;
+    Vec3 bilinear(const Level& level, Real u, Real v) const;
+
+    std::vector<Level> levels;
+    uint32_t tileTotal = 0;
+    std::vector<uint8_t> tiles;  // every tile in order, unless paged
+
+    // Paging state. 'pages' are read and written atomically; everything else is guarded by
+    // the pager's mutex. A tile's 'referenced' flag is set by every read of it.
+    mutable TextureCache* pager = nullptr;  // reset if the cache is destroyed first
+    std::FILE* backing = nullptr;
+    mutable std::vector<Page> pages;
+    mutable std::unique_ptr<std::atomic<bool>[]> referenced;
+};
+
+// Decoded images by file name, so every ImageTexture of one file shares one MipMap; an image is
+// decoded again only after all its textures are gone. With a budget, images loaded afterwards
+// are paged: their resident tiles together take at most 'budget' bytes. Tiles are evicted in
+// CLOCK order, an approximation of least recently used that lets reads of resident tiles skip
+// the mutex.
+class TextureCache {
+  public:
+    TextureCache() = default;
+    TextureCache(const TextureCache&) = delete;
+    TextureCache& operator=(const TextureCache&) = delete;
+
+    // Textures destroyed at exit may outlive the cache; their images then have no pager left.
+    ~TextureCache() {
+        for (const auto& [filename, entry] : images) {
+            if (auto image = entry.lock()) image->pager = nullptr;
+        }
+    }
+
+    // Null, with a message, when the file cannot be read.
+    std::shared_ptr<const MipMap> load(const std::string& filename) {
+        std::lock_guard lock(mutex);
+        auto& entry = images[filename];
+        if (auto image = entry.lock()) return image;
+
+        int width, height, channels;
+        auto* pixels = stbi_load(filename.c_str(), &width, &height, &channels,
+                                 MipMap::bytesPerPixel);
+        if (!pixels) {
+            std::cerr << "ERROR: could not load texture image file: " << filename << "\n";
+            return nullptr;
+        }
+        auto image = std::make_shared<const MipMap>(pixels, width, height,
+                                                    budget > 0 ? this : nullptr);
+        stbi_image_free(pixels);
+        entry = image;
+        return image;
+    }
+
+    // Bytes of tiles paged images may keep in memory; 0, the default, disables paging.
+    void setBudget(size_t bytes) { budget = bytes; }
+
+    size_t residentBytes() const {
+        std::lock_guard lock(mutex);
+        return resident;
+    }
+
+    // Tiles read from the backing files so far.
+    uint64_t tileLoads() const {
+        std::lock_guard lock(mutex);
+        return loads;
+    }
+
+  private:
+    friend class MipMap;
+
+    // Tile 'index' of 'image', read in if another thread has not done so meanwhile.
+    MipMap::Page pageIn(const MipMap& image, uint32_t index) {
+        std::lock_guard lock(mutex);
+        if (auto page = std::atomic_load(&image.pages[index])) return page;
+
+        // Sweep the clock hand over the resident tiles, sparing each referenced tile once.
+        // Readers may still hold an evicted tile; it is freed when they drop it.
+        while (!residentTiles.empty() && resident + MipMap::tileBytes > budget) {
+            hand %= residentTiles.size();
+            auto [owner, victim] = residentTiles[hand];
+            if (owner->referenced[victim].exchange(false, std::memory_order_relaxed)) {
+                ++hand;
+                continue;
+            }
+            std::atomic_store(&owner->pages[victim], MipMap::Page());
+            residentTiles[hand] = residentTiles.back();
+            residentTiles.pop_back();
+            resident -= MipMap::tileBytes;
+        }
+
+        std::shared_ptr<uint8_t[]> page(new uint8_t[MipMap::tileBytes]);
+        std::fseek(image.backing, static_cast<long>(index * MipMap::tileBytes), SEEK_SET);
+        if (std::fread(page.get(), 1, MipMap::tileBytes, image.backing) != MipMap::tileBytes) {
+            std::fill_n(page.get(), MipMap::tileBytes, uint8_t{0});
+        }
+        image.referenced[index].store(true, std::memory_order_relaxed);
+        std::atomic_store(&image.pages[index], MipMap::Page(page));
+        residentTiles.emplace_back(&image, index);
+        resident += MipMap::tileBytes;
+        ++loads;
+        return page;
+    }
+
+    // Drops the resident tiles of an image that is being destroyed.
+    void release(const MipMap& image) {
+        std::lock_guard lock(mutex);
+        auto kept = std::remove_if(residentTiles.begin(), residentTiles.end(),
+                                   [&](const auto& entry) { return entry.first == &image; });
+        resident -= (residentTiles.end() - kept) * MipMap::tileBytes;
+        residentTiles.erase(kept, residentTiles.end());
+    }
+
+    mutable std::mutex mutex;  // guards everything below and tile reads from backing files
+    std::unordered_map<std::string, std::weak_ptr<const MipMap>> images;
+    std::vector<std::pair<const MipMap*, uint32_t>> residentTiles;  // in clock order
+    size_t hand = 0;
+    size_t budget = 0;
+    size_t resident = 0;
+    uint64_t loads = 0;
+};
+
+inline TextureCache textureCache;
+
+inline MipMap::MipMap(const uint8_t* pixels, int width, int height, TextureCache* pager)
+    : pager{pager} {
+    auto w = width;
+    auto h = height;
+    std::vector<uint8_t> level(pixels, pixels + static_cast<size_t>(w) * h * bytesPerPixel);
+    auto at = [&](int x, int y) {
+        return &level[(static_cast<size_t>(y) * w + x) * bytesPerPixel];
+    };
+    while (true) {
+        Level info{w, h, (w + tileSize - 1) / tileSize, tileTotal};
+        auto tilesY = (h + tileSize - 1) / tileSize;
+        levels.push_back(info);
+        tileTotal += info.tilesX * tilesY;
+
+        // Tiles of this level; texels past the edge repeat the last row and column.
+        tiles.resize(static_cast<size_t>(tileTotal) * tileBytes);
+        for (int ty = 0; ty < tilesY; ++ty) {
+            for (int tx = 0; tx < info.tilesX; ++tx) {
+                auto* out = &tiles[(info.firstTile + ty * info.tilesX + tx) * tileBytes];
+                for (int y = 0; y < tileSize; ++y) {
+                    for (int x = 0; x < tileSize; ++x) {
+                        auto sx = std::min(tx * tileSize + x, w - 1);
+                        auto sy = std::min(ty * tileSize + y, h - 1);
+                        std::copy_n(at(sx, sy), bytesPerPixel, out + morton(x, y) * bytesPerPixel);
+                    }
+                }
+            }
+        }
+
+        if (w == 1 && h == 1) break;
+        auto nextW = std::max(1, w / 2);
+        auto nextH = std::max(1, h / 2);
+        std::vector<uint8_t> next(static_cast<size_t>(nextW) * nextH * bytesPerPixel);
+        for (int y = 0; y < nextH; ++y) {
+            for (int x = 0; x < nextW; ++x) {
+                for (int c = 0; c < bytesPerPixel; ++c) {
+                    int sum = 0;
+                    for (int dy = 0; dy < 2; ++dy) {
+                        for (int dx = 0; dx < 2; ++dx) {
+                            auto sx = std::min(2 * x + dx, w - 1);
+                            auto sy = std::min(2 * y + dy, h - 1);
+                            sum += at(sx, sy)[c];
+                        }
+                    }
+                    next[(static_cast<size_t>(y) * nextW + x) * bytesPerPixel + c] =
+                        static_cast<uint8_t>((sum + 2) / 4);
+                }
+            }
+        }
+        level = std::move(next);
+        w = nextW;
+        h = nextH;
+    }
+
+    // Paged images keep their tiles in a temporary file; without one they stay in memory.
+    if (!pager) return;
+    backing = std::tmpfile();
+    if (!backing) return;
+    if (std::fwrite(tiles.data(), 1, tiles.size(), backing) != tiles.size()) {
+        std::fclose(backing);
+        backing = nullptr;
+        return;
+    }
+    tiles = {};
+    pages.resize(tileTotal);
+    referenced = std::make_unique<std::atomic<bool>[]>(tileTotal);
+}
+
+inline MipMap::~MipMap() {
+    if (!backing) return;
+    if (pager) pager->release(*this);
+    std::fclose(backing);
+}
+
+// Texels of tile 'index'. A paged tile stays valid while 'pin' holds it.
+inline const uint8_t* MipMap::tile(uint32_t index, Page& pin) const {
+    if (!backing) return &tiles[index * tileBytes];
+
+    pin = std::atomic_load(&pages[index]);
+    if (pin) {
+        referenced[index].store(true, std::memory_order_relaxed);
+    } else {
+        pin = pager->pageIn(*this, index);
+    }
+    return pin.get();
+}
+
+inline Vec3 MipMap::texel(const Level& level, int x, int y) const {
+    auto tx = static_cast<unsigned>(clamp(x, 0, level.width - 1));
+    auto ty = static_cast<unsigned>(clamp(y, 0, level.height - 1));
+    auto index = level.firstTile + (ty / tileSize) * level.tilesX + tx / tileSize;
+    Page pin;
+    const auto* p = tile(index, pin) + morton(tx % tileSize, ty % tileSize) * bytesPerPixel;
+
+    const Real colorScale = 1.0 / 255.0;
+    return {colorScale * p[0], colorScale * p[1], colorScale * p[2]};
+}
+
+inline Vec3 MipMap::bilinear(const Level& level, Real u, Real v) const {
+    auto x = clamp<Real>(u, 0, 1) * level.width - Real(0.5);
+    auto y = (1 - clamp<Real>(v, 0, 1)) * level.height - Real(0.5);
+    auto x0 = std::floor(x);
+    auto y0 = std::floor(y);
+    auto fx = x - x0;
+    auto fy = y - y0;
+    auto i = static_cast<int>(x0);
+    auto j = static_cast<int>(y0);
+    return lerp(lerp(texel(level, i, j), texel(level, i + 1, j), fx),
+                lerp(texel(level, i, j + 1), texel(level, i + 1, j + 1), fx), fy);
+}
+
+inline Vec3 MipMap::nearest(Real u, Real v) const {
+    const auto& level = levels.front();
+    auto i = static_cast<int>(clamp<Real>(u, 0, 1) * level.width);
+    auto j = static_cast<int>((1 - clamp<Real>(v, 0, 1)) * level.height);
+    return texel(level, i, j);
+}
+
+inline Vec3 MipMap::trilinear(Real u, Real v, Real width) const {
+    auto texels = width * std::max(levels.front().width, levels.front().height);
+    auto level = texels > 1 ? std::log2(texels) : Real(0);
+    auto last = levelCount() - 1;
+    if (level >= last) return bilinear(levels.back(), u, v);
+
+    auto l = static_cast<int>(level);
+    auto fine = bilinear(levels[l], u, v);
+    auto f = level - l;
+    if (f == 0) return fine;
+    return lerp(fine, bilinear(levels[l + 1], u, v), f);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct Tile {
+    int x0;
+    int y0;
+    int x1;  // exclusive
+    int y1;  // exclusive
+    int index;
+};
+
+inline std::vector<Tile> makeTiles(int width, int height, int tileSize) {
+    std::vector<Tile> tiles;
+    for (int y = 0; y < height; y += tileSize) {
+        for (int x = 0; x < width; x += tileSize) {
+            tiles.push_back({x, y, std::min(x + tileSize, width), std::min(y + tileSize, height),
+                             static_cast<int>(tiles.size())});
+        }
+    }
+    return tiles;
+}
+
+// Work-stealing queue. Every worker starts with a contiguous run of tiles and takes from the
+// front of its own deque; once it runs dry it steals from the back of the other workers' deques.
+class TileQueue {
+  public:
+    TileQueue(const std::vector<Tile>& tiles, int workerCount) {
+        for (int w = 0; w < workerCount; ++w) {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for (size_t i = 0; i < tiles.size(); ++i) {
+            auto owner = i * workerCount / tiles.size();
+            queues[owner]->tiles.push_back(tiles[i]);
+        }
+    }
+
+    bool pop(int worker, Tile& outTile) {
+        if (popFront(*queues[worker], outTile)) return true;
+
+        auto n = static_cast<int>(queues.size());
+        for (int k = 1; k < n; ++k) {
+            if (stealBack(*queues[(worker + k) % n], outTile)) return true;
+        }
+        return false;
+    }
+
+  private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+
+    static bool popFront(WorkerQueue& q, Tile& outTile) {
+        std::lock_guard lock(q.mutex);
+        if (q.tiles.empty()) return false;
+        outTile = q.tiles.front();
+        q.tiles.pop_front();
+        return true;
+    }
+
+    static bool stealBack(WorkerQueue& q, Tile& outTile) {
+        std::lock_guard lock(q.mutex);
+        if (q.tiles.empty()) return false;
+        outTile = q.tiles.back();
+        q.tiles.pop_back();
+        return true;
+    }
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+};
+
+// Workers to run for a thread count setting; 0 picks std::thread::hardware_concurrency().
+inline int workerCountFor(int threadCount) {
+    return threadCount > 0 ? threadCount
+                           : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+}
+
+// Calls f(tile) for every tile on 'workerCount' workers, the calling thread being worker 0, with
+// tiles handed out by a TileQueue. Each worker calls onWorkerDone() once no tiles are left.
+template <typename TileFunction, typename DoneFunction>
+void runTiles(const std::vector<Tile>& tiles, int workerCount, TileFunction&& f,
+              DoneFunction&& onWorkerDone) {
+    TileQueue queue(tiles, workerCount);
+    auto worker = [&](int id) {
+        Tile tile{};
+        while (queue.pop(id, tile)) {
+            f(tile);
+        }
+        onWorkerDone();
+    };
+
+    std::vector<std::thread> threads;
+    for (int id = 1; id < workerCount; ++id) {
+        threads.emplace_back(worker, id);
+    }
+    worker(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+template <typename TileFunction>
+void runTiles(const std::vector<Tile>& tiles, int workerCount, TileFunction&& f) {
+    runTiles(tiles, workerCount, f, [] {});
+}
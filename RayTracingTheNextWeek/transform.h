@@ -0,0 +1,157 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+// Affine transform stored as a 3x4 matrix [linear | translation] acting on column vectors.
+struct Affine {
+    static Affine identity() { return scaling({1, 1, 1}); }
+
+    static Affine translation(const Vec3& t) {
+        auto a = identity();
+        for (int i = 0; i < 3; ++i) {
+            a.m[i][3] = t[i];
+        }
+        return a;
+    }
+
+    static Affine scaling(const Vec3& s) {
+        Affine a{};
+        for (int i = 0; i < 3; ++i) {
+            a.m[i][i] = s[i];
+        }
+        return a;
+    }
+
+    // Counterclockwise about 'axis' when looking down the axis toward the origin.
+    static Affine rotation(const Vec3& axis, Real degrees) {
+        auto k = normalized(axis);
+        auto c = std::cos(toRadian(degrees));
+        auto s = std::sin(toRadian(degrees));
+        Affine a{};
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 3; ++j) {
+                a.m[i][j] = (1 - c) * k[i] * k[j] + (i == j ? c : 0.0);
+            }
+        }
+        a.m[0][1] -= s * k.z();
+        a.m[0][2] += s * k.y();
+        a.m[1][0] += s * k.z();
+        a.m[1][2] -= s * k.x();
+        a.m[2][0] -= s * k.y();
+        a.m[2][1] += s * k.x();
+        return a;
+    }
+
+    Vec3 point(const Vec3& p) const { return vector(p) + Vec3(m[0][3], m[1][3], m[2][3]); }
+
+    Vec3 vector(const Vec3& v) const {
+        return {m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z()};
+    }
+
+    // Applies the transposed linear part. Normals map by the inverse transpose, so call this on
+    // the inverse transform.
+    Vec3 transposedVector(const Vec3& v) const {
+        return {m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z()};
+    }
+
+    Affine inverse() const {
+        // Inverse of the linear part by cofactors, then the translation mapped back.
+        Affine inv{};
+        inv.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        inv.m[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+        inv.m[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+        inv.m[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        inv.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+        inv.m[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+        inv.m[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        inv.m[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+        inv.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+        auto det = m[0][0] * inv.m[0][0] + m[0][1] * inv.m[1][0] + m[0][2] * inv.m[2][0];
+        for (auto& row : inv.m) {
+            for (int j = 0; j < 3; ++j) {
+                row[j] /= det;
+            }
+        }
+
+        auto t = inv.vector({m[0][3], m[1][3], m[2][3]});
+        for (int i = 0; i < 3; ++i) {
+            inv.m[i][3] = -t[i];
+        }
+        return inv;
+    }
+
+    // Determinant of the linear part: the factor by which the transform scales volumes.
+    Real determinant() const {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // Mean factor by which the transform scales lengths: the cube root of its volume scale.
+    Real lengthScale() const { return std::cbrt(std::abs(determinant())); }
+
+    // Error bound of point(p) per coordinate, when p is already off by up to 'error'.
+    Real pointError(const Vec3& p, Real error) const {
+        Real norm = 0, shift = 0;
+        for (int i = 0; i < 3; ++i) {
+            norm = std::max(norm, std::abs(m[i][0]) + std::abs(m[i][1]) + std::abs(m[i][2]));
+            shift = std::max(shift, std::abs(m[i][3]));
+        }
+        auto rounding = 4 * std::numeric_limits<Real>::epsilon() * (norm * p.maxAbs() + shift);
+        return norm * error + rounding;
+    }
+
+    // Tight box around the transformed box (Arvo's method).
+    AABB box(const AABB& b) const {
+        Vec3 lo, hi;
+        for (int i = 0; i < 3; ++i) {
+            lo[i] = hi[i] = m[i][3];
+            for (int j = 0; j < 3; ++j) {
+                if (m[i][j] == 0) continue;
+                auto e = m[i][j] * b.a[j];
+                auto f = m[i][j] * b.b[j];
+                lo[i] += std::min(e, f);
+                hi[i] += std::max(e, f);
+            }
+        }
+        return {lo, hi};
+    }
+
+    Real m[3][4];
+};
+
+// Applies b first, then a.
+inline Affine operator*(const Affine& a, const Affine& b) {
+    Affine c{};
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            for (int k = 0; k < 3; ++k) {
+                c.m[i][j] += a.m[i][k] * b.m[k][j];
+            }
+        }
+        c.m[i][3] += a.m[i][3];
+    }
+    return c;
+}
+
+// Entry-wise blend. Exact for translation and scale; a blend of two rotations is only
+// approximately a rotation, which is fine for the small angles of a motion-blur shutter.
+inline Affine blend(const Affine& a, const Affine& b, Real t) {
+    Affine c;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            c.m[i][j] = (1 - t) * a.m[i][j] + t * b.m[i][j];
+        }
+    }
+    return c;
+}
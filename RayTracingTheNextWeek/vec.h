@@ -4,14 +4,22 @@
 #include <array>
 #include <iostream>
 
+// Scalar type of rays, hits and scene geometry: double, or float when built with RT_FLOAT=1
+// (CMake option RT2_FLOAT). Sample accumulation, timing and statistics stay in double.
+#if RT_FLOAT
+using Real = float;
+#else
+using Real = double;
+#endif
+
 class Vec3 {
   public:
     Vec3() : Vec3(0, 0, 0) {}
-    Vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    Vec3(Real e0, Real e1, Real e2) : e{e0, e1, e2} {}
 
   public:
-    const double& operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    const Real& operator[](int i) const { return e[i]; }
+    Real& operator[](int i) { return e[i]; }
 
     Vec3 operator-() const { return {-e[0], -e[1], -e[2]}; }
 
@@ -22,29 +30,32 @@ class Vec3 {
         return *this;
     }
 
-    Vec3& operator*=(double t) {
+    Vec3& operator*=(Real t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
 
-    Vec3& operator/=(double t) { return *this *= 1 / t; }
+    Vec3& operator/=(Real t) { return *this *= 1 / t; }
 
   public:
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
-    double length() const { return std::sqrt(lengthSquared()); }
-    double lengthSquared() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+    Real x() const { return e[0]; }
+    Real y() const { return e[1]; }
+    Real z() const { return e[2]; }
+    Real length() const { return std::sqrt(lengthSquared()); }
+    Real lengthSquared() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
     bool nearZero() const {
         const auto ep = 1e-8;
         using std::fabs;
         return fabs(e[0]) < ep && fabs(e[1]) < ep && fabs(e[2]) < ep;
     }
+    Real maxAbs() const {
+        return std::fmax(std::fabs(e[0]), std::fmax(std::fabs(e[1]), std::fabs(e[2])));
+    }
 
   private:
-    std::array<double, 3> e;
+    std::array<Real, 3> e;
 };
 
 inline Vec3 operator+(const Vec3& u, const Vec3& v) {
@@ -59,19 +70,19 @@ inline Vec3 operator*(const Vec3& u, const Vec3& v) {
     return {u[0] * v[0], u[1] * v[1], u[2] * v[2]};
 }
 
-inline Vec3 operator*(double t, const Vec3& v) {
+inline Vec3 operator*(Real t, const Vec3& v) {
     return {v[0] * t, v[1] * t, v[2] * t};
 }
 
-inline Vec3 operator*(const Vec3& v, double t) {
+inline Vec3 operator*(const Vec3& v, Real t) {
     return t * v;
 }
 
-inline Vec3 operator/(const Vec3& v, double t) {
+inline Vec3 operator/(const Vec3& v, Real t) {
     return (1 / t) * v;
 }
 
-inline double dot(const Vec3& u, const Vec3& v) {
+inline Real dot(const Vec3& u, const Vec3& v) {
     return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
 }
 
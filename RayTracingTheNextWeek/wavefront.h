@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "lights.h"
+#include "stats.h"
+
+// What a camera ray hit first, for FeatureBuffers. The defaults describe a ray that escaped.
+struct PixelFeatures {
+    Vec3 albedo{1, 1, 1};
+    Vec3 normal;
+    Real depth = 0;
+};
+
+// Features of the closest hit 'rec' of 'r', with its footprint set.
+inline PixelFeatures hitFeatures(const Ray& r, const HitRecord& rec) {
+    return {rec.material().albedoAt(rec), rec.normal, rec.t * r.d.length()};
+}
+
+// One path of a wavefront: the ray to trace next and what the path has gathered so far.
+struct PathState {
+    Ray ray;
+    Vec3 throughput{1, 1, 1};
+    Vec3 radiance;
+    RandomGenerator rng;  // the path's own stream, swapped into 'gen' while it is shaded
+    uint32_t target;      // caller's id for the finished path, e.g. its pixel
+    int depth = 0;        // segments traced so far
+    Real bsdfPdf = 0;     // density of the last scattering, 0 if that vertex sampled no light
+    RayCone cone;         // footprint of 'ray', for texture filtering
+    uint64_t traversalCost = 0;  // intersection tests spent on the path, counted with RT_STATS
+    PixelFeatures features;      // of the first hit, when the integrator records them
+};
+
+// Iterative path tracer over a batch of paths. Each bounce intersects every live path, bins
+// the hits by material kind, runs one shading kernel per bin, then compacts the surviving
+// paths for the next bounce. Paths longer than russianRouletteDepth are terminated at random
+// with probability 1 - max(throughput), and the survivors reweighted, so the estimate stays
+// unbiased. With 'lights', diffuse hits also sample an emitter, as in rayColor(). Gives the same
+// expected image as the recursive rayColor(). With 'features', paths also keep the features of
+// their first hit.
+class WavefrontIntegrator {
+  public:
+    WavefrontIntegrator(const Hittable& world, const Vec3& backgroundColor, int maxDepth,
+                        int russianRouletteDepth, const LightList* lights = nullptr,
+                        bool features = false)
+        : world{world},
+          backgroundColor{backgroundColor},
+          maxDepth{maxDepth},
+          russianRouletteDepth{russianRouletteDepth},
+          lights{lights},
+          features{features},
+          kinds(materialTable.size()) {
+        for (uint32_t id = 0; id < kinds.size(); ++id) {
+            kinds[id] = materialTable[id].kind();
+        }
+    }
+
+    // Traces every path to the end, calling finish(path) once per path. The order of the calls
+    // depends only on the order of 'paths'.
+    template <typename Finish>
+    void trace(std::vector<PathState>& paths, Finish&& finish) {
+        if (maxDepth <= 0) {
+            STAT_ADD(pathsMaxDepth, paths.size());
+            for (auto& path : paths) finish(path);
+            paths.clear();
+            return;
+        }
+
+        while (!paths.empty()) {
+            intersect(paths);
+            shade(paths);
+
+            size_t live = 0;
+            for (size_t i = 0; i < paths.size(); ++i) {
+                if (alive[i]) {
+                    paths[live++] = paths[i];
+                } else {
+                    finish(paths[i]);
+                }
+            }
+            paths.resize(live);
+        }
+    }
+
+  private:
+    void intersect(std::vector<PathState>& paths) {
+        hits.resize(paths.size());
+        alive.assign(paths.size(), 1);
+        for (size_t i = 0; i < paths.size(); ++i) {
+            // Media draw random numbers while intersecting.
+            auto& path = paths[i];
+            gen = path.rng;
+            StatsProbe probe;
+            STAT_INC(rays);
+            if (world.hit(path.ray, 0, infinity, hits[i])) {
+                STAT_INC(hits);
+                hits[i].setFootprint(path.ray, path.cone);
+                if (features && path.depth == 0) path.features = hitFeatures(path.ray, hits[i]);
+            } else {
+                STAT_INC(pathsEscaped);
+                path.radiance += path.throughput * backgroundColor;
+                alive[i] = 0;
+            }
+            path.traversalCost += probe.traversalCost();
+            path.rng = gen;
+        }
+    }
+
+    // Counting sort of the hit paths by material kind, then one kernel per kind.
+    void shade(std::vector<PathState>& paths) {
+        size_t begin[materialKindCount + 1] = {};
+        for (size_t i = 0; i < paths.size(); ++i) {
+            if (alive[i]) ++begin[kindIndex(i) + 1];
+        }
+        for (int k = 0; k < materialKindCount; ++k) {
+            begin[k + 1] += begin[k];
+        }
+
+        order.resize(begin[materialKindCount]);
+        size_t next[materialKindCount];
+        std::copy(begin, begin + materialKindCount, next);
+        for (size_t i = 0; i < paths.size(); ++i) {
+            if (alive[i]) order[next[kindIndex(i)]++] = static_cast<uint32_t>(i);
+        }
+
+        auto bin = [&](MaterialKind kind) {
+            auto k = static_cast<int>(kind);
+            return std::make_pair(order.data() + begin[k], order.data() + begin[k + 1]);
+        };
+        shadeBin<Lambertian>(paths, bin(MaterialKind::Lambertian));
+        shadeBin<Metal>(paths, bin(MaterialKind::Metal));
+        shadeBin<Dielectric>(paths, bin(MaterialKind::Dielectric));
+        shadeBin<DiffuseLight>(paths, bin(MaterialKind::DiffuseLight));
+        shadeBin<Isotropic>(paths, bin(MaterialKind::Isotropic));
+        shadeBin<Material>(paths, bin(MaterialKind::Other));
+    }
+
+    // Scatters every path of the bin off a material of type M. Calls are qualified, so the
+    // known types skip virtual dispatch; M = Material is the generic fallback.
+    template <typename M>
+    void shadeBin(std::vector<PathState>& paths, std::pair<const uint32_t*, const uint32_t*> bin) {
+        for (auto it = bin.first; it != bin.second; ++it) {
+            auto i = *it;
+            auto& path = paths[i];
+            const auto& rec = hits[i];
+            const auto& material = static_cast<const M&>(rec.material());
+            gen = path.rng;
+            StatsProbe probe;
+
+            Vec3 emitted;
+            Vec3 attenuation;
+            Ray scattered;
+            bool scatters;
+            if constexpr (std::is_same_v<M, Material>) {
+                emitted = material.emitted(rec.u, rec.v, rec.p);
+                scatters = material.scatter(path.ray, rec, attenuation, scattered);
+            } else {
+                emitted = material.M::emitted(rec.u, rec.v, rec.p);
+                scatters = material.M::scatter(path.ray, rec, attenuation, scattered);
+            }
+            if (lights && path.bsdfPdf > 0 && !emitted.nearZero()) {
+                emitted *=
+                    lights->emissionWeight(path.ray.o, path.ray.d, rec.t, path.bsdfPdf);
+            }
+            path.radiance += path.throughput * emitted;
+
+            path.bsdfPdf = 0;
+            Vec3 f;
+            if (scatters && lights && path.depth + 1 < maxDepth &&
+                material.evalScattering(path.ray, rec, scattered.d, f, path.bsdfPdf)) {
+                path.radiance += path.throughput * lights->sampleDirect(world, path.ray, rec,
+                                                                        material);
+            }
+
+            ++path.depth;
+            alive[i] = scatters && path.depth < maxDepth;
+            if (alive[i]) {
+                path.throughput = path.throughput * attenuation;
+                path.cone = scatteredCone(path.cone, rec.t * path.ray.d.length(),
+                                          kinds[rec.materialId]);
+                path.ray = scattered;
+                if (path.depth >= russianRouletteDepth && !survivesRoulette(path)) {
+                    STAT_INC(pathsRoulette);
+                    alive[i] = 0;
+                }
+            } else if (scatters) {
+                STAT_INC(pathsMaxDepth);
+            } else {
+                STAT_INC(pathsAbsorbed);
+            }
+            path.traversalCost += probe.traversalCost();
+            path.rng = gen;
+        }
+    }
+
+    static bool survivesRoulette(PathState& path) {
+        const auto& t = path.throughput;
+        auto survival = std::min<Real>(0.95, std::max({t.x(), t.y(), t.z()}));
+        if (gen.randomDouble() >= survival) return false;
+        path.throughput /= survival;
+        return true;
+    }
+
+    int kindIndex(size_t i) const { return static_cast<int>(kinds[hits[i].materialId]); }
+
+    const Hittable& world;
+    Vec3 backgroundColor;
+    int maxDepth;
+    int russianRouletteDepth;
+    const LightList* lights;
+    bool features;
+    std::vector<MaterialKind> kinds;
+
+    // Per-bounce buffers, reused across bounces and calls.
+    std::vector<HitRecord> hits;
+    std::vector<char> alive;
+    std::vector<uint32_t> order;
+};
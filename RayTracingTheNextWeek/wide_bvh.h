@@ -0,0 +1,642 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh_builder.h"
+#include "bvh_cache.h"
+#include "primitive_store.h"
+#include "stats.h"
+
+// Four-wide BVH node. The bounds of all children are stored as structure of arrays, so one SSE
+// instruction per slab plane tests all four child boxes.
+struct alignas(64) Bvh4Node {
+    static const int width = 4;
+    static const uint32_t emptySlot = ~0u;
+
+    float minX[width], minY[width], minZ[width];
+    float maxX[width], maxY[width], maxZ[width];
+    uint32_t child[width];  // node index if count == 0, primitive offset otherwise
+    uint16_t count[width];  // primitive count of leaf children
+    uint8_t pad[8];
+
+    bool isLeaf(int i) const { return count[i] > 0; }
+    bool isEmpty(int i) const { return child[i] == emptySlot; }
+
+    void setBounds(int i, const AABB& box) {
+        minX[i] = roundDown(box.a[0]);
+        minY[i] = roundDown(box.a[1]);
+        minZ[i] = roundDown(box.a[2]);
+        maxX[i] = roundUp(box.b[0]);
+        maxY[i] = roundUp(box.b[1]);
+        maxZ[i] = roundUp(box.b[2]);
+    }
+
+    void setChild(int i, const LinearBvhNode& n) {
+        minX[i] = n.boundsMin[0];
+        minY[i] = n.boundsMin[1];
+        minZ[i] = n.boundsMin[2];
+        maxX[i] = n.boundsMax[0];
+        maxY[i] = n.boundsMax[1];
+        maxZ[i] = n.boundsMax[2];
+        child[i] = n.primitiveOffset;
+        count[i] = n.primitiveCount;
+    }
+
+    // An inverted box never passes the slab test.
+    void clearChild(int i) {
+        const auto inf = std::numeric_limits<float>::infinity();
+        minX[i] = minY[i] = minZ[i] = inf;
+        maxX[i] = maxY[i] = maxZ[i] = -inf;
+        child[i] = emptySlot;
+        count[i] = 0;
+    }
+};
+
+static_assert(sizeof(Bvh4Node) == 128);
+
+// Bounds of a Bvh4Node's children at the end of the shutter, for BVHs over moving objects. The
+// node itself holds them at the start; a ray at time t tests their blend, which stays tight
+// around objects that move far during the shutter where one box over all of it would not.
+struct alignas(32) Bvh4EndBounds {
+    float minX[Bvh4Node::width], minY[Bvh4Node::width], minZ[Bvh4Node::width];
+    float maxX[Bvh4Node::width], maxY[Bvh4Node::width], maxZ[Bvh4Node::width];
+
+    void set(int i, const AABB& box) {
+        minX[i] = roundDown(box.a[0]);
+        minY[i] = roundDown(box.a[1]);
+        minZ[i] = roundDown(box.a[2]);
+        maxX[i] = roundUp(box.b[0]);
+        maxY[i] = roundUp(box.b[1]);
+        maxZ[i] = roundUp(box.b[2]);
+    }
+};
+
+static_assert(sizeof(Bvh4EndBounds) == 96);
+
+// How much motion during [t0, t1] inflates the boxes of the objects in 'list' that move: the
+// mean ratio of the surface area of an object's box over the whole shutter to that of its boxes
+// at the ends. 1 when nothing moves.
+inline Real motionBloat(const HittableList& list, Real t0, Real t1) {
+    Real sum = 0;
+    int moving = 0;
+    for (const auto& object : list.objects) {
+        AABB box0, box1;
+        if (!object->motionBounds(t0, t1, box0, box1) ||
+            std::memcmp(&box0, &box1, sizeof(AABB)) == 0) {
+            continue;
+        }
+        auto endArea = (box0.surfaceArea() + box1.surfaceArea()) / 2;
+        if (endArea > 0) sum += surroundingBox(box0, box1).surfaceArea() / endArea;
+        ++moving;
+    }
+    return moving > 0 ? sum / moving : 1;
+}
+
+// Float copy of a ray for the 4-wide slab test.
+struct Bvh4Ray {
+    explicit Bvh4Ray(const Ray& r) {
+        PreparedRay pr(r);
+        for (int i = 0; i < 3; ++i) {
+            o[i] = static_cast<float>(r.o[i]);
+            invD[i] = static_cast<float>(pr.invD[i]);
+            dirIsNeg[i] = pr.dirIsNeg[i];
+        }
+    }
+
+    float o[3];
+    float invD[3];
+    int dirIsNeg[3];
+};
+
+// Exit distances are scaled by 1 + 2 * gamma(3) so that float rounding in the slab test never
+// culls a box the ray actually touches.
+constexpr float slabExitScale = 1.0f + 2.0f * (3 * 0.5f * std::numeric_limits<float>::epsilon());
+
+// Returns a 4-bit mask of the children hit within [tmin, tmax]; writes their entry distances.
+// With 'end', the children's boxes are blended toward it by 's', the ray's time as a fraction of
+// the shutter.
+inline int intersectChildren(const Bvh4Node& node, const Bvh4Ray& ray, float tmin, float tmax,
+                             float tEntry[4], const Bvh4EndBounds* end = nullptr, float s = 0) {
+    const float* lo[3] = {node.minX, node.minY, node.minZ};
+    const float* hi[3] = {node.maxX, node.maxY, node.maxZ};
+    const float* endLo[3] = {};
+    const float* endHi[3] = {};
+    if (end) {
+        endLo[0] = end->minX, endLo[1] = end->minY, endLo[2] = end->minZ;
+        endHi[0] = end->maxX, endHi[1] = end->maxY, endHi[2] = end->maxZ;
+    }
+#ifdef __SSE2__
+    auto entry = _mm_set1_ps(tmin);
+    auto exit = _mm_set1_ps(tmax);
+    auto blend = _mm_set1_ps(s);
+    for (int dim = 0; dim < 3; ++dim) {
+        auto o = _mm_set1_ps(ray.o[dim]);
+        auto invD = _mm_set1_ps(ray.invD[dim]);
+        auto nearPlane = _mm_load_ps(ray.dirIsNeg[dim] ? hi[dim] : lo[dim]);
+        auto farPlane = _mm_load_ps(ray.dirIsNeg[dim] ? lo[dim] : hi[dim]);
+        if (end) {
+            auto nearEnd = _mm_load_ps(ray.dirIsNeg[dim] ? endHi[dim] : endLo[dim]);
+            auto farEnd = _mm_load_ps(ray.dirIsNeg[dim] ? endLo[dim] : endHi[dim]);
+            nearPlane = _mm_add_ps(nearPlane, _mm_mul_ps(blend, _mm_sub_ps(nearEnd, nearPlane)));
+            farPlane = _mm_add_ps(farPlane, _mm_mul_ps(blend, _mm_sub_ps(farEnd, farPlane)));
+        }
+        // Operand order keeps 'entry'/'exit' when a plane distance is NaN (0 * inf).
+        entry = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(nearPlane, o), invD), entry);
+        exit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(farPlane, o), invD), exit);
+    }
+    exit = _mm_mul_ps(exit, _mm_set1_ps(slabExitScale));
+    _mm_storeu_ps(tEntry, entry);
+    return _mm_movemask_ps(_mm_cmple_ps(entry, exit));
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        auto entry = tmin;
+        auto exit = tmax;
+        for (int dim = 0; dim < 3; ++dim) {
+            auto nearPlane = (ray.dirIsNeg[dim] ? hi : lo)[dim][i];
+            auto farPlane = (ray.dirIsNeg[dim] ? lo : hi)[dim][i];
+            if (end) {
+                nearPlane += s * ((ray.dirIsNeg[dim] ? endHi : endLo)[dim][i] - nearPlane);
+                farPlane += s * ((ray.dirIsNeg[dim] ? endLo : endHi)[dim][i] - farPlane);
+            }
+            auto t0 = (nearPlane - ray.o[dim]) * ray.invD[dim];
+            auto t1 = (farPlane - ray.o[dim]) * ray.invD[dim];
+            entry = t0 > entry ? t0 : entry;
+            exit = t1 < exit ? t1 : exit;
+        }
+        tEntry[i] = entry;
+        mask |= (entry <= exit * slabExitScale) << i;
+    }
+    return mask;
+#endif
+}
+
+// Packet form: one child box against the four rays of a packet, each with its own interval.
+struct Bvh4Packet {
+    explicit Bvh4Packet(const RayPacket& packet) {
+        for (int lane = 0; lane < RayPacket::size; ++lane) {
+            const auto& r = packet.rays[lane];
+            for (int dim = 0; dim < 3; ++dim) {
+                o[dim][lane] = static_cast<float>(r.o[dim]);
+                invD[dim][lane] = static_cast<float>(1.0 / r.d[dim]);
+            }
+        }
+    }
+
+    alignas(16) float o[3][RayPacket::size];
+    alignas(16) float invD[3][RayPacket::size];
+    alignas(16) float s[RayPacket::size] = {};  // times as fractions of the shutter, with 'end'
+};
+
+// With 'end', the child's box is blended toward it by each lane's time.
+inline int intersectPacket(const Bvh4Node& node, int i, const Bvh4Packet& packet,
+                           const float tmin[4], const float tmax[4], float& minEntry,
+                           const Bvh4EndBounds* end = nullptr) {
+    const float lo[3] = {node.minX[i], node.minY[i], node.minZ[i]};
+    const float hi[3] = {node.maxX[i], node.maxY[i], node.maxZ[i]};
+    float loDelta[3] = {}, hiDelta[3] = {};
+    if (end) {
+        const float endLo[3] = {end->minX[i], end->minY[i], end->minZ[i]};
+        const float endHi[3] = {end->maxX[i], end->maxY[i], end->maxZ[i]};
+        for (int dim = 0; dim < 3; ++dim) {
+            loDelta[dim] = endLo[dim] - lo[dim];
+            hiDelta[dim] = endHi[dim] - hi[dim];
+        }
+    }
+#ifdef __SSE2__
+    auto entry = _mm_loadu_ps(tmin);
+    auto exit = _mm_loadu_ps(tmax);
+    auto blend = _mm_load_ps(packet.s);
+    for (int dim = 0; dim < 3; ++dim) {
+        auto o = _mm_load_ps(packet.o[dim]);
+        auto invD = _mm_load_ps(packet.invD[dim]);
+        auto loPlane = _mm_set1_ps(lo[dim]);
+        auto hiPlane = _mm_set1_ps(hi[dim]);
+        if (end) {
+            loPlane = _mm_add_ps(loPlane, _mm_mul_ps(blend, _mm_set1_ps(loDelta[dim])));
+            hiPlane = _mm_add_ps(hiPlane, _mm_mul_ps(blend, _mm_set1_ps(hiDelta[dim])));
+        }
+        auto t0 = _mm_mul_ps(_mm_sub_ps(loPlane, o), invD);
+        auto t1 = _mm_mul_ps(_mm_sub_ps(hiPlane, o), invD);
+        entry = _mm_max_ps(_mm_min_ps(t0, t1), entry);
+        exit = _mm_min_ps(_mm_max_ps(t0, t1), exit);
+    }
+    exit = _mm_mul_ps(exit, _mm_set1_ps(slabExitScale));
+    auto mask = _mm_movemask_ps(_mm_cmple_ps(entry, exit));
+    alignas(16) float entries[4];
+    _mm_store_ps(entries, entry);
+#else
+    int mask = 0;
+    float entries[4];
+    for (int lane = 0; lane < 4; ++lane) {
+        auto entry = tmin[lane];
+        auto exit = tmax[lane];
+        for (int dim = 0; dim < 3; ++dim) {
+            auto loPlane = lo[dim] + packet.s[lane] * loDelta[dim];
+            auto hiPlane = hi[dim] + packet.s[lane] * hiDelta[dim];
+            auto t0 = (loPlane - packet.o[dim][lane]) * packet.invD[dim][lane];
+            auto t1 = (hiPlane - packet.o[dim][lane]) * packet.invD[dim][lane];
+            entry = std::max(entry, std::min(t0, t1));
+            exit = std::min(exit, std::max(t0, t1));
+        }
+        entries[lane] = entry;
+        mask |= (entry <= exit * slabExitScale) << lane;
+    }
+#endif
+    minEntry = std::numeric_limits<float>::infinity();
+    for (int lane = 0; lane < 4; ++lane) {
+        if (mask & (1 << lane)) minEntry = std::min(minEntry, entries[lane]);
+    }
+    return mask;
+}
+
+// QBVH: the binary SAH tree collapsed into nodes with up to four children. Single rays visit
+// children nearest-first; packets of primary rays share one traversal. Occlusion queries skip
+// the sort and the entry distances: they test a node's leaves first and stop at any hit.
+//
+// When objects move far during [t0, t1], the tree is built over the objects' boxes
+// at mid-shutter, so objects group by where they are on average, and every node also gets its
+// children's bounds at t1 (a four-dimensional BVH). The tree is then refit at both ends from
+// the objects' motionBounds(). Rays must have times within [t0, t1].
+class Bvh4 : public Hittable {
+  public:
+    static const int maxPrimitivesInLeaf = 4;
+    static const int stackSize = 3 * SahBvhBuilder::maxDepth + 1;
+    // Blending bounds costs a few operations per node; it pays once motion inflates the boxes
+    // of moving objects this many times (motionBloat()).
+    static constexpr Real motionBloatThreshold = 3;
+
+  public:
+    Bvh4(const HittableList& list, Real t0, Real t1);
+
+    bool hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const override;
+    bool occluded(const Ray& r, Real tmin, Real tmax) const override;
+    bool boundingBox(Real t0, Real t1, AABB& outBox) const override;
+    bool motionBounds(Real time0, Real time1, AABB& box0, AABB& box1) const override;
+
+    void collectEmitters(std::vector<const Hittable*>& emitters) const override {
+        for (const auto& p : primitives) {
+            p->collectEmitters(emitters);
+        }
+    }
+    void hitPacket(const RayPacket& packet, Real tmin, Real tmax, HitRecord recs[],
+                   bool hits[]) const override;
+
+    const BvhBuildStats& buildStats() const { return stats; }
+
+  private:
+    struct StackEntry {
+        uint32_t node;
+        float tEntry;
+    };
+
+    uint32_t collapse(const std::vector<LinearBvhNode>& binary, uint32_t index,
+                      const std::vector<AABB>& starts, const std::vector<AABB>& ends);
+
+    const Bvh4EndBounds* endOf(uint32_t node) const {
+        return endBounds.empty() ? nullptr : &endBounds[node];
+    }
+
+    // Shutter position of a time, for blending toward endBounds.
+    float shutterFraction(Real time) const {
+        return static_cast<float>(t1 > t0 ? (time - t0) / (t1 - t0) : 0);
+    }
+
+    // Insertion sort by descending entry distance, so the nearest child is popped first.
+    static void pushFarToNear(StackEntry children[], int count, StackEntry stack[], int& top) {
+        for (int i = 1; i < count; ++i) {
+            auto e = children[i];
+            int j = i - 1;
+            for (; j >= 0 && children[j].tEntry < e.tEntry; --j) {
+                children[j + 1] = children[j];
+            }
+            children[j + 1] = e;
+        }
+        for (int i = 0; i < count; ++i) {
+            stack[top++] = children[i];
+        }
+    }
+
+    std::vector<Bvh4Node> nodes;
+    std::vector<Bvh4EndBounds> endBounds;  // one per node when objects move, else empty
+    std::vector<std::shared_ptr<Hittable>> primitives;  // owned; leaves go through 'refs'
+    PrimitiveStore store;
+    std::vector<PrimitiveRef> refs;
+    Real t0;
+    Real t1;
+    AABB box;     // over the whole shutter
+    AABB box0;    // at t0 and t1, when objects move
+    AABB box1;
+    BvhBuildStats stats;
+};
+
+// Bounds of the binary nodes at the two ends of the shutter, from those of their primitives.
+// They are widened by a few float ulps of their largest coordinate, which keeps the rounded
+// blend in traversal outside the exact one.
+inline void refitMotionBounds(const std::vector<LinearBvhNode>& binary,
+                              const std::vector<BvhBuildPrimitive>& prims,
+                              const std::vector<AABB>& primStarts,
+                              const std::vector<AABB>& primEnds, std::vector<AABB>& starts,
+                              std::vector<AABB>& ends) {
+    starts.resize(binary.size());
+    ends.resize(binary.size());
+    // Children follow their parents in the array, so a backward sweep goes bottom-up.
+    for (auto i = binary.size(); i-- > 0;) {
+        const auto& node = binary[i];
+        if (node.primitiveCount == 0) {
+            starts[i] = surroundingBox(starts[i + 1], starts[node.secondChild]);
+            ends[i] = surroundingBox(ends[i + 1], ends[node.secondChild]);
+            continue;
+        }
+        starts[i] = primStarts[prims[node.primitiveOffset].index];
+        ends[i] = primEnds[prims[node.primitiveOffset].index];
+        for (uint32_t k = 1; k < node.primitiveCount; ++k) {
+            auto index = prims[node.primitiveOffset + k].index;
+            starts[i] = surroundingBox(starts[i], primStarts[index]);
+            ends[i] = surroundingBox(ends[i], primEnds[index]);
+        }
+    }
+    constexpr Real margin = 4 * std::numeric_limits<float>::epsilon();
+    for (size_t i = 0; i < binary.size(); ++i) {
+        for (int dim = 0; dim < 3; ++dim) {
+            auto pad = margin * std::max({std::abs(starts[i].a[dim]), std::abs(starts[i].b[dim]),
+                                          std::abs(ends[i].a[dim]), std::abs(ends[i].b[dim])});
+            starts[i].a[dim] -= pad;
+            starts[i].b[dim] += pad;
+            ends[i].a[dim] -= pad;
+            ends[i].b[dim] += pad;
+        }
+    }
+}
+
+inline Bvh4::Bvh4(const HittableList& list, Real t0, Real t1) : t0{t0}, t1{t1} {
+    const auto& objects = list.objects;
+    const AABB everywhere(Vec3(-infinity, -infinity, -infinity),
+                          Vec3(infinity, infinity, infinity));
+    bool moving = motionBloat(list, t0, t1) > motionBloatThreshold;
+    std::vector<AABB> primStarts, primEnds;
+    if (moving) {
+        primStarts.resize(objects.size());
+        primEnds.resize(objects.size());
+    }
+    std::vector<BvhBuildPrimitive> prims(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+        auto& p = prims[i];
+        if (moving) {
+            if (!objects[i]->motionBounds(t0, t1, primStarts[i], primEnds[i])) {
+                primStarts[i] = primEnds[i] = everywhere;
+            }
+            p.box = AABB(lerp(primStarts[i].a, primEnds[i].a, 0.5),
+                         lerp(primStarts[i].b, primEnds[i].b, 0.5));
+        } else if (!objects[i]->boundingBox(t0, t1, p.box)) {
+            p.box = everywhere;
+        }
+        p.centroid = p.box.centroid();
+        p.index = static_cast<uint32_t>(i);
+    }
+
+    std::vector<LinearBvhNode> binary;
+    stats = buildBvh(maxPrimitivesInLeaf, prims, binary);
+    if (binary.empty()) return;
+
+    primitives.reserve(prims.size());
+    for (const auto& p : prims) {
+        primitives.push_back(objects[p.index]);
+    }
+    storePrimitives(primitives, store, refs);
+
+    std::vector<AABB> starts, ends;
+    if (moving) {
+        refitMotionBounds(binary, prims, primStarts, primEnds, starts, ends);
+        box0 = starts.front();
+        box1 = ends.front();
+        box = surroundingBox(box0, box1);
+    } else {
+        box = binary.front().bounds();
+    }
+
+    nodes.reserve(binary.size() / 2 + 1);
+    if (moving) endBounds.reserve(binary.size() / 2 + 1);
+    collapse(binary, 0, starts, ends);
+    stats.nodeCount = nodes.size();
+}
+
+// Pulls up grandchildren, always opening the interior child with the largest surface area,
+// until the node has four children or only leaves remain.
+// 'starts' and 'ends' are the binary nodes' bounds at t0 and t1 when objects move, else empty.
+inline uint32_t Bvh4::collapse(const std::vector<LinearBvhNode>& binary, uint32_t index,
+                               const std::vector<AABB>& starts, const std::vector<AABB>& ends) {
+    auto nodeIndex = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+    if (!ends.empty()) endBounds.emplace_back();
+
+    uint32_t slots[Bvh4Node::width];
+    int n = 0;
+    if (binary[index].primitiveCount > 0) {
+        slots[n++] = index;
+    } else {
+        slots[n++] = index + 1;
+        slots[n++] = binary[index].secondChild;
+        while (n < Bvh4Node::width) {
+            int best = -1;
+            double bestArea = -1.0;
+            for (int k = 0; k < n; ++k) {
+                if (binary[slots[k]].primitiveCount > 0) continue;
+                auto area = binary[slots[k]].bounds().surfaceArea();
+                if (area > bestArea) {
+                    bestArea = area;
+                    best = k;
+                }
+            }
+            if (best < 0) break;
+
+            auto opened = slots[best];
+            slots[best] = opened + 1;
+            slots[n++] = binary[opened].secondChild;
+        }
+    }
+
+    for (int k = 0; k < Bvh4Node::width; ++k) {
+        if (k >= n) {
+            nodes[nodeIndex].clearChild(k);
+            if (!ends.empty()) {
+                // Infinite bounds would blend to NaN, which the slab test lets through.
+                const auto big = std::numeric_limits<float>::max();
+                AABB inverted(Vec3(big, big, big), Vec3(-big, -big, -big));
+                nodes[nodeIndex].setBounds(k, inverted);
+                endBounds[nodeIndex].set(k, inverted);
+            }
+            continue;
+        }
+        nodes[nodeIndex].setChild(k, binary[slots[k]]);
+        if (!ends.empty()) {
+            nodes[nodeIndex].setBounds(k, starts[slots[k]]);
+            endBounds[nodeIndex].set(k, ends[slots[k]]);
+        }
+        if (binary[slots[k]].primitiveCount == 0) {
+            auto childIndex = collapse(binary, slots[k], starts, ends);
+            nodes[nodeIndex].child[k] = childIndex;
+        }
+    }
+    return nodeIndex;
+}
+
+inline bool Bvh4::hit(const Ray& r, Real tmin, Real tmax, HitRecord& rec) const {
+    if (nodes.empty()) return false;
+
+    Bvh4Ray ray(r);
+    auto s = shutterFraction(r.time);
+    StackEntry stack[stackSize];
+    int stackTop = 0;
+    stack[stackTop++] = {0, static_cast<float>(tmin)};
+    PrimitiveRef closest{};
+    bool found = false;
+
+    while (stackTop > 0) {
+        auto entry = stack[--stackTop];
+        if (entry.tEntry > tmax) continue;
+
+        const auto& node = nodes[entry.node];
+        STAT_INC(nodeVisits);
+        STAT_ADD(boxTests, 4);
+        float tEntry[4];
+        auto mask = intersectChildren(node, ray, roundDown(tmin), roundUp(tmax), tEntry,
+                                      endOf(entry.node), s);
+
+        // Leaves are intersected right away; interior children are pushed far-to-near.
+        StackEntry interior[4];
+        int interiorCount = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i))) continue;
+            if (node.isLeaf(i)) {
+                // Candidate hits only; the closest one is completed at the end.
+                found |= store.hitLeaf(&refs[node.child[i]], node.count[i], r, tmin, tmax, rec,
+                                       closest);
+            } else {
+                interior[interiorCount++] = {node.child[i], tEntry[i]};
+            }
+        }
+        pushFarToNear(interior, interiorCount, stack, stackTop);
+    }
+
+    if (!found) return false;
+    store.completeHit(closest, rec);
+    return true;
+}
+
+inline bool Bvh4::occluded(const Ray& r, Real tmin, Real tmax) const {
+    if (nodes.empty()) return false;
+
+    Bvh4Ray ray(r);
+    auto s = shutterFraction(r.time);
+    auto lo = roundDown(tmin);
+    auto hi = roundUp(tmax);
+    uint32_t stack[stackSize];
+    int stackTop = 0;
+    stack[stackTop++] = 0;
+
+    while (stackTop > 0) {
+        auto nodeIndex = stack[--stackTop];
+        const auto& node = nodes[nodeIndex];
+        STAT_INC(nodeVisits);
+        STAT_ADD(boxTests, 4);
+        float tEntry[4];
+        auto mask = intersectChildren(node, ray, lo, hi, tEntry, endOf(nodeIndex), s);
+        for (int i = 0; i < 4; ++i) {
+            if (!(mask & (1 << i))) continue;
+            if (!node.isLeaf(i)) {
+                stack[stackTop++] = node.child[i];
+            } else if (store.occludedLeaf(&refs[node.child[i]], node.count[i], r, tmin, tmax)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+inline void Bvh4::hitPacket(const RayPacket& packet, Real tmin, Real tmax, HitRecord recs[],
+                            bool hits[]) const {
+    Real closestT[RayPacket::size];
+    PrimitiveRef closest[RayPacket::size] = {};
+    float laneMin[RayPacket::size];
+    float laneMax[RayPacket::size];
+    for (int lane = 0; lane < RayPacket::size; ++lane) {
+        hits[lane] = false;
+        closestT[lane] = tmax;
+        laneMin[lane] = roundDown(tmin);
+        laneMax[lane] =
+            packet.active[lane] ? roundUp(tmax) : -std::numeric_limits<float>::infinity();
+    }
+    if (nodes.empty()) return;
+
+    Bvh4Packet rays(packet);
+    for (int lane = 0; lane < RayPacket::size; ++lane) {
+        rays.s[lane] = shutterFraction(packet.rays[lane].time);
+    }
+    StackEntry stack[stackSize];
+    int stackTop = 0;
+    stack[stackTop++] = {0, static_cast<float>(tmin)};
+
+    while (stackTop > 0) {
+        auto nodeIndex = stack[--stackTop].node;
+        const auto& node = nodes[nodeIndex];
+        STAT_INC(nodeVisits);
+
+        StackEntry interior[4];
+        int interiorCount = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (node.isEmpty(i)) continue;
+
+            float minEntry;
+            STAT_ADD(boxTests, RayPacket::size);
+            auto mask =
+                intersectPacket(node, i, rays, laneMin, laneMax, minEntry, endOf(nodeIndex));
+            if (!mask) continue;
+
+            if (!node.isLeaf(i)) {
+                interior[interiorCount++] = {node.child[i], minEntry};
+                continue;
+            }
+            for (int lane = 0; lane < RayPacket::size; ++lane) {
+                if (!(mask & (1 << lane))) continue;
+                hits[lane] |= store.hitLeaf(&refs[node.child[i]], node.count[i], packet.rays[lane],
+                                            tmin, closestT[lane], recs[lane], closest[lane]);
+                laneMax[lane] = roundUp(closestT[lane]);
+            }
+        }
+        pushFarToNear(interior, interiorCount, stack, stackTop);
+    }
+
+    for (int lane = 0; lane < RayPacket::size; ++lane) {
+        if (hits[lane]) store.completeHit(closest[lane], recs[lane]);
+    }
+}
+
+inline bool Bvh4::boundingBox(Real t0, Real t1, AABB& outBox) const {
+    outBox = box;
+    return !nodes.empty();
+}
+
+// The refit boxes when asked about the shutter the tree was built for; otherwise, like any
+// object, the whole box at both ends.
+inline bool Bvh4::motionBounds(Real time0, Real time1, AABB& start, AABB& end) const {
+    if (nodes.empty()) return false;
+    if (endBounds.empty() || time0 != t0 || time1 != t1) {
+        return Hittable::motionBounds(time0, time1, start, end);
+    }
+    start = box0;
+    end = box1;
+    return true;
+}